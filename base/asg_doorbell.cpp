@@ -0,0 +1,228 @@
+// Copyright 2020 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "base/asg_doorbell.h"
+
+#include <errno.h>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace asg {
+
+int Doorbell::wait() {
+    if (__atomic_load_n(&mShutdown, __ATOMIC_ACQUIRE)) return -1;
+    waitForRing();
+    return __atomic_load_n(&mShutdown, __ATOMIC_ACQUIRE) ? -1 : 0;
+}
+
+void Doorbell::shutdown() {
+    __atomic_store_n(&mShutdown, 1, __ATOMIC_RELEASE);
+    ring();
+}
+
+std::function<void()> Doorbell::doorbellFunc() {
+    return [this]() { ring(); };
+}
+
+std::function<int()> Doorbell::unavailableReadFunc() {
+    return [this]() { return wait(); };
+}
+
+#ifdef __linux__
+
+namespace {
+
+// Both ends of an fd based doorbell. |mRingFd| and |mWaitFd| may be the same
+// fd, which is then closed once.
+class FdDoorbell : public Doorbell {
+public:
+    FdDoorbell(Kind kind, int ringFd, int waitFd)
+        : Doorbell(kind), mRingFd(ringFd), mWaitFd(waitFd) { }
+
+    ~FdDoorbell() override {
+        close(mRingFd);
+        if (mWaitFd != mRingFd) close(mWaitFd);
+    }
+
+    void ring() override {
+        // Pipes and sockets are written without blocking: if they are
+        // full, the waiter has plenty of rings to wake up to already.
+        uint64_t one = 1;
+        ssize_t res;
+        do {
+            switch (kind()) {
+                case Kind::Eventfd:
+                    res = write(mRingFd, &one, sizeof(one));
+                    break;
+                case Kind::UnixSocket:
+                    res = send(mRingFd, &one, 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+                    break;
+                default:
+                    res = write(mRingFd, &one, 1);
+                    break;
+            }
+        } while (res < 0 && errno == EINTR);
+    }
+
+    int ringFd() const override { return mRingFd; }
+    int waitFd() const override { return mWaitFd; }
+
+protected:
+    void waitForRing() override {
+        // An eventfd read returns and resets the count. Pipes and sockets
+        // are drained of all the bytes there are, which takes one read
+        // unless there were more than fit in |buf|.
+        char buf[256];
+        size_t size = kind() == Kind::Eventfd ? sizeof(uint64_t) : sizeof(buf);
+        ssize_t res;
+        do {
+            res = read(mWaitFd, buf, size);
+        } while (res < 0 && errno == EINTR);
+
+        int left = 0;
+        while (res == (ssize_t)sizeof(buf) &&
+               !ioctl(mWaitFd, FIONREAD, &left) && left > 0) {
+            res = read(mWaitFd, buf, sizeof(buf));
+        }
+    }
+
+private:
+    int mRingFd;
+    int mWaitFd;
+};
+
+// The futex word is 0 while idle, 1 once rung, and 2 while the waiter is (about
+// to be) asleep, so that ringing an already rung doorbell is a fence and a
+// load, and ringing one nobody sleeps on one more atomic, with no system call.
+class FutexDoorbell : public Doorbell {
+public:
+    explicit FutexDoorbell(uint32_t* word) : Doorbell(Kind::Futex), mWord(word) { }
+
+    void ring() override {
+        // If it is still rung, the waiter has yet to consume that ring and
+        // will look at whatever we wrote before this fence once it does.
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        uint32_t old = __atomic_load_n(mWord, __ATOMIC_RELAXED);
+        if (old == kRung) return;
+
+        old = __atomic_exchange_n(mWord, kRung, __ATOMIC_SEQ_CST);
+        if (old == kSleeping) {
+            syscall(SYS_futex, mWord, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+        }
+    }
+
+protected:
+    void waitForRing() override {
+        while (true) {
+            uint32_t expected = kRung;
+            if (__atomic_compare_exchange_n(mWord, &expected, kIdle, false,
+                                            __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+                return;
+            }
+
+            expected = kIdle;
+            if (__atomic_compare_exchange_n(mWord, &expected, kSleeping, false,
+                                            __ATOMIC_SEQ_CST, __ATOMIC_RELAXED) ||
+                expected == kSleeping) {
+                // Not FUTEX_PRIVATE: the word may be shared with another
+                // process.
+                syscall(SYS_futex, mWord, FUTEX_WAIT, kSleeping, nullptr, nullptr, 0);
+            }
+        }
+    }
+
+private:
+    static constexpr uint32_t kIdle = 0;
+    static constexpr uint32_t kRung = 1;
+    static constexpr uint32_t kSleeping = 2;
+
+    uint32_t* mWord;
+};
+
+} // namespace
+
+std::unique_ptr<Doorbell> Doorbell::create(Kind kind, uint32_t* futexWord) {
+    int fds[2];
+    switch (kind) {
+        case Kind::Eventfd: {
+            int fd = eventfd(0, EFD_CLOEXEC);
+            if (fd < 0) return nullptr;
+            return std::unique_ptr<Doorbell>(new FdDoorbell(kind, fd, fd));
+        }
+        case Kind::Futex:
+            if (!futexWord) {
+                errno = EINVAL;
+                return nullptr;
+            }
+            return std::unique_ptr<Doorbell>(new FutexDoorbell(futexWord));
+        case Kind::Pipe:
+            if (pipe2(fds, O_CLOEXEC)) return nullptr;
+            return adopt(kind, fds[1], fds[0]);
+        case Kind::UnixSocket:
+            if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds)) return nullptr;
+            return std::unique_ptr<Doorbell>(new FdDoorbell(kind, fds[1], fds[0]));
+    }
+
+    errno = EINVAL;
+    return nullptr;
+}
+
+std::unique_ptr<Doorbell> Doorbell::adopt(Kind kind, int ringFd, int waitFd) {
+    if (kind == Kind::Futex || ringFd < 0 || waitFd < 0) {
+        errno = EINVAL;
+        return nullptr;
+    }
+
+    if (kind == Kind::Pipe) {
+        int flags = fcntl(ringFd, F_GETFL);
+        if (flags < 0 || fcntl(ringFd, F_SETFL, flags | O_NONBLOCK)) {
+            int err = errno;
+            close(ringFd);
+            close(waitFd);
+            errno = err;
+            return nullptr;
+        }
+    }
+
+    return std::unique_ptr<Doorbell>(new FdDoorbell(kind, ringFd, waitFd));
+}
+
+#else // !__linux__
+
+std::unique_ptr<Doorbell> Doorbell::create(Kind kind, uint32_t* futexWord) {
+    (void)kind;
+    (void)futexWord;
+    errno = ENOSYS;
+    return nullptr;
+}
+
+std::unique_ptr<Doorbell> Doorbell::adopt(Kind kind, int ringFd, int waitFd) {
+    (void)kind;
+    (void)ringFd;
+    (void)waitFd;
+    errno = ENOSYS;
+    return nullptr;
+}
+
+#endif // __linux__
+
+} // namespace asg
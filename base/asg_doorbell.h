@@ -0,0 +1,98 @@
+// Copyright 2020 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <functional>
+#include <memory>
+
+#include <stdint.h>
+
+namespace asg {
+
+// Host IPC stand-ins for the guest -> host notification: the client rings the
+// doorbell (its DoorbellFunc) when the host may be asleep, and the server
+// waits on it when it runs out of things to read (its UnavailableReadFunc).
+// A second doorbell serves the other direction: the server rings it as its
+// GuestNotifyFunc and the client waits on it as its reply WaitFunc.
+//
+// Rings are coalesced: any number of them before a wait satisfy that one
+// wait, as the server rereads the rings after every wake-up anyway. All
+// kinds work between threads and between processes, inheriting the doorbell
+// across fork() or passing its fds (see ringFd / waitFd and adopt) or
+// futex word.
+//
+// Only implemented on Linux; elsewhere create fails with errno set to ENOSYS.
+class Doorbell {
+public:
+    enum class Kind {
+        // One eventfd, written to ring and read to wait.
+        Eventfd,
+        // A 32-bit word in memory shared by both sides, with FUTEX_WAKE /
+        // FUTEX_WAIT. The only kind that costs no system call to ring while
+        // the waiter is awake.
+        Futex,
+        // A pipe, a byte written per ring.
+        Pipe,
+        // A connected unix stream socket pair, a byte sent per ring.
+        UnixSocket,
+    };
+
+    // Creates a doorbell of |kind|. Futex doorbells need |futexWord|, a
+    // zero-initialized word that all sides map (MAP_SHARED for processes);
+    // it is ignored by the others. Returns null and sets errno on failure.
+    static std::unique_ptr<Doorbell> create(Kind kind, uint32_t* futexWord = nullptr);
+
+    // Makes a doorbell of an fd based |kind| over |ringFd| and |waitFd| as
+    // returned by ringFd() / waitFd() in another process, taking ownership
+    // of both (they may be the same fd). Returns null and sets errno on
+    // failure.
+    static std::unique_ptr<Doorbell> adopt(Kind kind, int ringFd, int waitFd);
+
+    virtual ~Doorbell() = default;
+
+    Kind kind() const { return mKind; }
+
+    // Rings the doorbell. Safe to call from any thread or process.
+    virtual void ring() = 0;
+
+    // Waits for a ring, consuming all rings since the last wait. Returns 0
+    // once rung, or -1 once shutdown() has been called, which is what the
+    // server's UnavailableReadFunc returns to stop the stream.
+    int wait();
+
+    // Makes the current and all later waits in this process return -1.
+    void shutdown();
+
+    // The fds to ring and wait on, to hand to another process, or -1 for
+    // futex doorbells.
+    virtual int ringFd() const { return -1; }
+    virtual int waitFd() const { return -1; }
+
+    // The doorbell as the RingStream callbacks. The doorbell must outlive
+    // them.
+    std::function<void()> doorbellFunc();
+    std::function<int()> unavailableReadFunc();
+
+protected:
+    explicit Doorbell(Kind kind) : mKind(kind) { }
+
+    // Blocks until rung, then consumes the rings.
+    virtual void waitForRing() = 0;
+
+private:
+    Kind mKind;
+    uint32_t mShutdown = 0;
+};
+
+} // namespace asg
@@ -0,0 +1,151 @@
+// Copyright 2020 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "base/asg_payload_cache.h"
+
+#include <string.h>
+
+namespace asg {
+
+namespace {
+
+constexpr uint64_t kPrime1 = 0x9E3779B185EBCA87ULL;
+constexpr uint64_t kPrime2 = 0xC2B2AE3D27D4EB4FULL;
+constexpr uint64_t kPrime3 = 0x165667B19E3779F9ULL;
+constexpr uint64_t kPrime4 = 0x85EBCA77C2B2AE63ULL;
+constexpr uint64_t kPrime5 = 0x27D4EB2F165667C5ULL;
+
+inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+inline uint64_t load64(const uint8_t* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline uint64_t round64(uint64_t acc, uint64_t input) {
+    return rotl64(acc + input * kPrime2, 31) * kPrime1;
+}
+
+inline uint64_t merge64(uint64_t acc, uint64_t lane) {
+    return (acc ^ round64(0, lane)) * kPrime1 + kPrime4;
+}
+
+inline uint64_t avalanche64(uint64_t h) {
+    h ^= h >> 33;
+    h *= kPrime2;
+    h ^= h >> 29;
+    h *= kPrime3;
+    h ^= h >> 32;
+    return h;
+}
+
+} // namespace
+
+PayloadKey hashPayload(const void* data, size_t size) {
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    const uint8_t* end = p + size;
+
+    uint64_t v1 = kPrime1 + kPrime2;
+    uint64_t v2 = kPrime2;
+    uint64_t v3 = 0;
+    uint64_t v4 = 0 - kPrime1;
+
+    while (end - p >= 32) {
+        v1 = round64(v1, load64(p));
+        v2 = round64(v2, load64(p + 8));
+        v3 = round64(v3, load64(p + 16));
+        v4 = round64(v4, load64(p + 24));
+        p += 32;
+    }
+
+    // The two halves converge the same lanes differently, and take the
+    // tail with different multipliers.
+    uint64_t h1 = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+    uint64_t h2 = rotl64(v1, 18) + rotl64(v2, 12) + rotl64(v3, 7) + rotl64(v4, 1);
+    h1 = merge64(merge64(merge64(merge64(h1, v1), v2), v3), v4);
+    h2 = merge64(merge64(merge64(merge64(h2, v4), v3), v2), v1);
+    h1 += size;
+    h2 ^= size * kPrime5;
+
+    while (end - p >= 8) {
+        uint64_t k = round64(0, load64(p));
+        h1 = rotl64(h1 ^ k, 27) * kPrime1 + kPrime4;
+        h2 = rotl64(h2 ^ k, 29) * kPrime3 + kPrime2;
+        p += 8;
+    }
+
+    while (p < end) {
+        h1 = rotl64(h1 ^ (*p * kPrime5), 11) * kPrime1;
+        h2 = rotl64(h2 ^ (*p * kPrime1), 13) * kPrime5;
+        ++p;
+    }
+
+    PayloadKey key;
+    key.hash[0] = avalanche64(h1);
+    key.hash[1] = avalanche64(h2 ^ key.hash[0]);
+    key.size = (uint32_t)size;
+    return key;
+}
+
+void PayloadCache::reset(size_t capacity) {
+    mCapacity = capacity;
+    mBytes = 0;
+    mEntries.clear();
+    mIndex.clear();
+}
+
+const std::vector<uint8_t>* PayloadCache::find(const PayloadKey& key) {
+    auto it = mIndex.find(key);
+    if (it == mIndex.end()) return nullptr;
+
+    mEntries.splice(mEntries.begin(), mEntries, it->second);
+    return &it->second->contents;
+}
+
+bool PayloadCache::contains(const PayloadKey& key) const {
+    return mIndex.count(key) != 0;
+}
+
+void PayloadCache::touch(const PayloadKey& key) {
+    auto it = mIndex.find(key);
+    if (it == mIndex.end()) return;
+
+    mEntries.splice(mEntries.begin(), mEntries, it->second);
+}
+
+bool PayloadCache::insert(const PayloadKey& key, std::vector<uint8_t>&& contents) {
+    if (key.size > mCapacity) return false;
+
+    auto it = mIndex.find(key);
+    if (it != mIndex.end()) {
+        it->second->contents = std::move(contents);
+        mEntries.splice(mEntries.begin(), mEntries, it->second);
+        return true;
+    }
+
+    while (mBytes + key.size > mCapacity) {
+        mBytes -= mEntries.back().key.size;
+        mIndex.erase(mEntries.back().key);
+        mEntries.pop_back();
+    }
+
+    mEntries.push_front({ key, std::move(contents) });
+    mIndex[key] = mEntries.begin();
+    mBytes += key.size;
+    return true;
+}
+
+} // namespace asg
@@ -0,0 +1,95 @@
+// Copyright 2020 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace asg {
+
+// What a payload is known by in the payload cache: a 128-bit hash of its
+// contents and its size. The hash is not cryptographic; it is meant to tell
+// apart the payloads one guest uploads, not to resist crafted collisions.
+struct PayloadKey {
+    uint64_t hash[2];
+    uint32_t size;
+
+    bool operator==(const PayloadKey& other) const {
+        return hash[0] == other.hash[0] && hash[1] == other.hash[1] &&
+               size == other.size;
+    }
+};
+
+// Hashes |size| bytes at |data|. Four independent 64-bit lanes over 32-byte
+// stripes, in the manner of xxHash64, so the multiplies of one stripe run in
+// parallel, and without any intrinsics, so it builds for any guest.
+PayloadKey hashPayload(const void* data, size_t size);
+
+// A least recently used set of payloads, holding at most |capacity| bytes of
+// them. The host keeps the contents of the payloads the guest stored; the
+// guest keeps only their keys, in a cache of the same capacity, and mirrors
+// every store and reference the host processes, in the same order, so that
+// both always evict the same payloads and the guest knows exactly what the
+// host holds.
+class PayloadCache {
+public:
+    explicit PayloadCache(size_t capacity = 0) : mCapacity(capacity) { }
+
+    // Sets the capacity, dropping all payloads.
+    void reset(size_t capacity);
+
+    size_t capacity() const { return mCapacity; }
+    size_t bytes() const { return mBytes; }
+    size_t count() const { return mIndex.size(); }
+
+    // Returns the contents of the payload |key| (empty if the cache keeps
+    // keys only) and makes it the most recently used, or null if it is not
+    // there.
+    const std::vector<uint8_t>* find(const PayloadKey& key);
+
+    // Whether the payload |key| is there, leaving the order alone.
+    bool contains(const PayloadKey& key) const;
+
+    // Makes the payload |key| the most recently used, if it is there.
+    void touch(const PayloadKey& key);
+
+    // Adds the payload |key| as the most recently used, evicting the least
+    // recently used until there is room for key.size bytes. Payloads larger
+    // than the capacity are not added. Returns whether it was.
+    bool insert(const PayloadKey& key, std::vector<uint8_t>&& contents);
+
+private:
+    struct KeyHash {
+        size_t operator()(const PayloadKey& key) const {
+            return (size_t)key.hash[0];
+        }
+    };
+
+    struct Entry {
+        PayloadKey key;
+        std::vector<uint8_t> contents;
+    };
+
+    size_t mCapacity;
+    size_t mBytes = 0;
+    // Most recently used first.
+    std::list<Entry> mEntries;
+    std::unordered_map<PayloadKey, std::list<Entry>::iterator, KeyHash> mIndex;
+};
+
+} // namespace asg
@@ -0,0 +1,344 @@
+// Copyright 2020 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "base/asg_shared_region.h"
+
+#include <errno.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <linux/magic.h>
+#include <linux/memfd.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+#endif
+
+namespace asg {
+
+#ifdef __linux__
+
+static size_t roundUp(size_t size, size_t align) {
+    return (size + align - 1) & ~(align - 1);
+}
+
+static size_t basePageSize() {
+    return (size_t)sysconf(_SC_PAGESIZE);
+}
+
+static void closePreservingErrno(int fd) {
+    int err = errno;
+    close(fd);
+    errno = err;
+}
+
+// Maps |size| bytes of |fd| as the options say, or returns null with errno
+// set.
+static uint8_t* mapRegion(
+    int fd, size_t size, const SharedRegion::Options& options) {
+    int flags = MAP_SHARED;
+    if (options.populate) flags |= MAP_POPULATE;
+
+    void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, flags, fd, 0);
+    if (data == MAP_FAILED) return nullptr;
+
+    if (options.lock && mlock(data, size)) {
+        int err = errno;
+        munmap(data, size);
+        errno = err;
+        return nullptr;
+    }
+
+    return (uint8_t*)data;
+}
+
+// Creates a hugetlbfs memfd of |size| bytes with |hugePageSize| pages and maps
+// it, or returns -1 with errno set. Making the memfd and sizing it succeed
+// even when the pool has no pages left; that only shows when mapping.
+static int createHugetlbMemfd(
+    size_t size, size_t hugePageSize,
+    const SharedRegion::Options& options, uint8_t** data_out) {
+    int shift = __builtin_ctzll(hugePageSize);
+    int fd = memfd_create(
+        "asg-region", MFD_CLOEXEC | MFD_HUGETLB | (shift << MFD_HUGE_SHIFT));
+    if (fd < 0) return -1;
+
+    if (ftruncate(fd, (off_t)size)) {
+        closePreservingErrno(fd);
+        return -1;
+    }
+
+    uint8_t* data = mapRegion(fd, size, options);
+    if (!data) {
+        closePreservingErrno(fd);
+        return -1;
+    }
+
+    *data_out = data;
+    return fd;
+}
+
+// Creates an unlinked POSIX shm object of |size| bytes, or returns -1 with
+// errno set. Once unlinked, it is only reachable through the fd.
+static int createShm(size_t size) {
+    static uint32_t s_counter = 0;
+
+    for (int attempts = 0; attempts < 16; ++attempts) {
+        char name[64];
+        snprintf(name, sizeof(name), "/asg-region-%d-%u", (int)getpid(),
+                 __atomic_fetch_add(&s_counter, 1, __ATOMIC_RELAXED));
+
+        int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd < 0) {
+            if (errno == EEXIST) continue;
+            return -1;
+        }
+        shm_unlink(name);
+
+        if (ftruncate(fd, (off_t)size)) {
+            closePreservingErrno(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    errno = EEXIST;
+    return -1;
+}
+
+std::unique_ptr<SharedRegion> SharedRegion::create(
+    size_t ringXferBufferSize, const Options& options) {
+    size_t pageSize = basePageSize();
+    size_t hugePageSize = options.hugePageSize;
+    if (hugePageSize && (hugePageSize <= pageSize ||
+                         (hugePageSize & (hugePageSize - 1)))) {
+        errno = EINVAL;
+        return nullptr;
+    }
+
+    size_t size = sizeof(struct asg_ring_storage) + ringXferBufferSize;
+    uint8_t* data = nullptr;
+    int fd = -1;
+
+    if (options.backing == Backing::Memfd) {
+        if (hugePageSize) {
+            fd = createHugetlbMemfd(
+                roundUp(size, hugePageSize), hugePageSize, options, &data);
+            if (fd >= 0) {
+                return std::unique_ptr<SharedRegion>(new SharedRegion(
+                    fd, data, roundUp(size, hugePageSize),
+                    ringXferBufferSize, hugePageSize));
+            }
+            if (options.hugePagesRequired) return nullptr;
+        }
+
+        fd = memfd_create("asg-region", MFD_CLOEXEC);
+        if (fd < 0) return nullptr;
+        size = roundUp(size, pageSize);
+        if (ftruncate(fd, (off_t)size)) {
+            closePreservingErrno(fd);
+            return nullptr;
+        }
+    } else {
+        // Round up to the huge page size anyway, so that the tail of the
+        // region can be backed by a huge page too.
+        size = roundUp(size, hugePageSize ? hugePageSize : pageSize);
+        fd = createShm(size);
+        if (fd < 0) return nullptr;
+    }
+
+    data = mapRegion(fd, size, options);
+    if (!data) {
+        closePreservingErrno(fd);
+        return nullptr;
+    }
+
+    // Base pages from here on; ask for transparent huge pages where the
+    // kernel has them for shared memory.
+    if (hugePageSize && madvise(data, size, MADV_HUGEPAGE) &&
+        options.hugePagesRequired) {
+        int err = errno;
+        munmap(data, size);
+        close(fd);
+        errno = err;
+        return nullptr;
+    }
+
+    return std::unique_ptr<SharedRegion>(
+        new SharedRegion(fd, data, size, ringXferBufferSize, pageSize));
+}
+
+std::unique_ptr<SharedRegion> SharedRegion::attach(
+    int fd, size_t ringXferBufferSize, const Options& options) {
+    struct stat st;
+    if (fstat(fd, &st)) {
+        closePreservingErrno(fd);
+        return nullptr;
+    }
+
+    size_t size = (size_t)st.st_size;
+    if (size < sizeof(struct asg_ring_storage) + ringXferBufferSize) {
+        close(fd);
+        errno = EINVAL;
+        return nullptr;
+    }
+
+    size_t pageSize = basePageSize();
+    struct statfs fs;
+    if (!fstatfs(fd, &fs) && fs.f_type == HUGETLBFS_MAGIC) {
+        pageSize = (size_t)fs.f_bsize;
+    }
+
+    uint8_t* data = mapRegion(fd, size, options);
+    if (!data) {
+        closePreservingErrno(fd);
+        return nullptr;
+    }
+
+    return std::unique_ptr<SharedRegion>(
+        new SharedRegion(fd, data, size, ringXferBufferSize, pageSize));
+}
+
+int SharedRegion::sendTo(int socket) const {
+    uint64_t xferSize = mRingXferBufferSize;
+    struct iovec iov = { &xferSize, sizeof(xferSize) };
+
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &mFd, sizeof(int));
+
+    ssize_t sent;
+    do {
+        sent = sendmsg(socket, &msg, MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+
+    if (sent < 0) return -1;
+    if (sent != (ssize_t)sizeof(xferSize)) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+std::unique_ptr<SharedRegion> SharedRegion::receiveFrom(
+    int socket, const Options& options) {
+    uint64_t xferSize = 0;
+    struct iovec iov = { &xferSize, sizeof(xferSize) };
+
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    ssize_t got;
+    do {
+        got = recvmsg(socket, &msg, MSG_CMSG_CLOEXEC);
+    } while (got < 0 && errno == EINTR);
+
+    if (got < 0) return nullptr;
+
+    int fd = -1;
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+        cmsg->cmsg_type == SCM_RIGHTS &&
+        cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+        memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+
+    if (fd < 0 || got != (ssize_t)sizeof(xferSize) ||
+        (msg.msg_flags & MSG_CTRUNC)) {
+        if (fd >= 0) close(fd);
+        errno = EBADMSG;
+        return nullptr;
+    }
+
+    return attach(fd, (size_t)xferSize, options);
+}
+
+SharedRegion::~SharedRegion() {
+    munmap(mData, mMappedSize);
+    close(mFd);
+}
+
+#else // !__linux__
+
+std::unique_ptr<SharedRegion> SharedRegion::create(
+    size_t ringXferBufferSize, const Options& options) {
+    (void)ringXferBufferSize;
+    (void)options;
+    errno = ENOSYS;
+    return nullptr;
+}
+
+std::unique_ptr<SharedRegion> SharedRegion::attach(
+    int fd, size_t ringXferBufferSize, const Options& options) {
+    (void)fd;
+    (void)ringXferBufferSize;
+    (void)options;
+    errno = ENOSYS;
+    return nullptr;
+}
+
+int SharedRegion::sendTo(int socket) const {
+    (void)socket;
+    errno = ENOSYS;
+    return -1;
+}
+
+std::unique_ptr<SharedRegion> SharedRegion::receiveFrom(
+    int socket, const Options& options) {
+    (void)socket;
+    (void)options;
+    errno = ENOSYS;
+    return nullptr;
+}
+
+SharedRegion::~SharedRegion() = default;
+
+#endif // __linux__
+
+SharedRegion::SharedRegion(int fd, uint8_t* data, size_t mappedSize,
+                           size_t ringXferBufferSize, size_t pageSize)
+    : mFd(fd),
+      mData(data),
+      mMappedSize(mappedSize),
+      mRingXferBufferSize(ringXferBufferSize),
+      mPageSize(pageSize) { }
+
+} // namespace asg
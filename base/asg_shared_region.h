@@ -0,0 +1,125 @@
+// Copyright 2020 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include "base/asg_types.h"
+
+#include <memory>
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace asg {
+
+// A shared memory region laid out the way RingStreams expect it:
+//
+//     | struct asg_ring_storage | ringXferBufferSize bytes for the xfer buffer |
+//
+// backed by a memfd or a POSIX shm object, for hosts that do not get one from
+// virtio-gpu or another driver, and for tests and benchmarks that want the
+// same kind of memory the rings run over in production rather than the heap.
+//
+// The region can be backed by huge pages, so a large xfer buffer costs a
+// handful of TLB entries, and prefaulted and locked, so nothing on the hot
+// path takes a first-touch page fault. Its fd can be handed to another
+// process, over a unix socket with sendTo / receiveFrom or any other way,
+// which maps the same memory with attach.
+//
+// Only implemented on Linux; elsewhere creating or attaching a region fails
+// with errno set to ENOSYS.
+class SharedRegion {
+public:
+    enum class Backing {
+        Memfd,
+        Shm,
+    };
+
+    struct Options {
+        Backing backing = Backing::Memfd;
+
+        // Page size to back the region with: 0 for the base page size, or
+        // the size of a huge page, e.g. 2 MiB or 1 GiB. The region is
+        // rounded up to a whole number of pages.
+        //
+        // Memfd regions are created in hugetlbfs with that page size; shm
+        // regions use base pages and ask for transparent huge pages, which
+        // is all tmpfs offers. If there are no such huge pages to be had,
+        // the region falls back to base pages, unless |hugePagesRequired|.
+        size_t hugePageSize = 0;
+        bool hugePagesRequired = false;
+
+        // Fault every page in on mapping (MAP_POPULATE).
+        bool populate = false;
+
+        // Lock the mapping in memory (mlock), which also faults it in.
+        // Creating or attaching fails if that is not allowed, typically
+        // with ENOMEM or EPERM due to RLIMIT_MEMLOCK.
+        bool lock = false;
+    };
+
+    // Creates a new zero-filled region with an xfer buffer of
+    // |ringXferBufferSize| bytes. Returns null and sets errno on failure.
+    static std::unique_ptr<SharedRegion> create(
+        size_t ringXferBufferSize, const Options& options);
+
+    // Maps the region behind |fd|, as created by another SharedRegion (in
+    // this process or another), taking ownership of |fd|. Only
+    // |populate| and |lock| of |options| apply. Returns null and sets errno
+    // on failure, in which case |fd| is closed.
+    static std::unique_ptr<SharedRegion> attach(
+        int fd, size_t ringXferBufferSize, const Options& options);
+
+    // Sends the region's fd and xfer buffer size over the connected unix
+    // socket |socket|, for the other end to receiveFrom. Returns 0, or -1
+    // with errno set.
+    int sendTo(int socket) const;
+
+    // Receives a region sent with sendTo on |socket| and attaches to it.
+    static std::unique_ptr<SharedRegion> receiveFrom(
+        int socket, const Options& options);
+
+    ~SharedRegion();
+
+    SharedRegion(const SharedRegion&) = delete;
+    SharedRegion& operator=(const SharedRegion&) = delete;
+
+    // Start of the region, to pass to the RingStreams as their shared region.
+    uint8_t* data() const { return mData; }
+
+    // The xfer buffer following the asg_ring_storage.
+    uint8_t* xferBuffer() const { return mData + sizeof(struct asg_ring_storage); }
+    size_t ringXferBufferSize() const { return mRingXferBufferSize; }
+
+    // Bytes mapped, a whole number of pages.
+    size_t mappedSize() const { return mMappedSize; }
+
+    // Page size the region is backed by. For shm regions asking for
+    // transparent huge pages, this stays the base page size, as it is up to
+    // the kernel whether and when they are used.
+    size_t pageSize() const { return mPageSize; }
+
+    int fd() const { return mFd; }
+
+private:
+    SharedRegion(int fd, uint8_t* data, size_t mappedSize,
+                 size_t ringXferBufferSize, size_t pageSize);
+
+    int mFd;
+    uint8_t* mData;
+    size_t mMappedSize;
+    size_t mRingXferBufferSize;
+    size_t mPageSize;
+};
+
+} // namespace asg
@@ -56,7 +56,9 @@
 // 5. ioctl(CLAIM_SHARED) and mmap on those two offset/size pairs to get a
 // guest-side mapping.
 //
-// 6. call asg_context_create on the ring and buffer pointers to create the asg_context.
+// 6. call asg_context_create (or asg_context_create_versioned, with the versions
+// exchanged by ping(ASG_SET_VERSION)) on the ring and buffer pointers to create
+// the asg_context.
 //
 // 7. Now the guest and host share asg_context pts and can communicate.
 //
@@ -107,8 +109,76 @@ enum asg_host_state {
     ASG_HOST_STATE_RENDERING = 4,
 };
 
+// The guest side of the same, in asg_ring_config::guest_state, for waiting on
+// replies in from_host_large_xfer.
+enum asg_guest_state {
+    // The guest is reading (or not reading) without needing to be woken up.
+    // Guests that never wait on the host stay here.
+    ASG_GUEST_STATE_RUNNING = 0,
+
+    // The guest is asleep and needs to be notified once the host writes
+    // past from_host_large_xfer_notify_pos.
+    ASG_GUEST_STATE_NEED_NOTIFY = 1,
+};
+
 struct asg_ring_config;
 
+// Layouts of the shared ring storage. The guest and host each advertise the
+// newest layout they support in to_host's guest_version / host_version
+// (exchanged with Ping(set_version)) and both run the older of the two, so
+// peers that predate layout versions keep getting v1.
+//
+// v1: asg_ring_config and the host state are in to_host's state / config[],
+// right after the end of its data buffer, all on the same cache lines.
+//
+// v2: They move to the spare tail of the to_host page (asg_ring_lines_v2),
+// grouped by which side writes them, each group on its own 128-byte line so
+// that the adjacent-line prefetcher, which pulls in 64-byte lines in pairs,
+// does not couple neighbours either. The ring indices themselves stay where
+// they are in struct ring_buffer for both layouts, since every ring shares
+// that struct and every ring function addresses them in it: write_pos and
+// read_pos are 64 bytes apart, so the prefetcher still couples those two
+// (BenchmarkRingLayoutFalseSharing measures what that costs).
+#define ASG_RING_LAYOUT_V1 1
+#define ASG_RING_LAYOUT_V2 2
+#define ASG_RING_LAYOUT_LATEST ASG_RING_LAYOUT_V2
+
+#define ASG_RING_LINE_SIZE 128
+
+struct asg_ring_lines_v2 {
+    // Written by the guest (and at setup): the asg_ring_config. Its
+    // transfer_size, host_consumed_pos, in_error and notify positions are
+    // unused in v2.
+    uint32_t config[NUM_CONFIG_FIELDS];
+
+    // Written by both: the guest sets it, the host counts it down.
+    uint32_t transfer_size;
+    uint32_t unused0[31];
+
+    // Written by the host.
+    uint32_t host_state;
+    uint32_t host_consumed_pos;
+    uint32_t in_error;
+    uint32_t to_host_notify_pos;
+    uint32_t to_host_large_xfer_notify_pos;
+    uint32_t unused1[27];
+};
+
+#define ASG_RING_LINES_V2_OFFSET \
+    ((sizeof(struct ring_buffer) + ASG_RING_LINE_SIZE - 1) & \
+     ~(size_t)(ASG_RING_LINE_SIZE - 1))
+
+// Returns the layout to run given the versions both sides advertise. 0 (not
+// advertised) counts as v1.
+inline uint32_t asg_ring_layout_negotiate(
+    uint32_t guest_version, uint32_t host_version) {
+    uint32_t version =
+        guest_version < host_version ? guest_version : host_version;
+    if (version < ASG_RING_LAYOUT_V1) return ASG_RING_LAYOUT_V1;
+    if (version > ASG_RING_LAYOUT_LATEST) return ASG_RING_LAYOUT_LATEST;
+    return version;
+}
+
 // Each context has a pair of ring buffers for communication
 // to and from the host. There is another ring buffer for large xfers
 // to the host (all xfers from the host are already considered "large").
@@ -122,53 +192,16 @@ struct asg_context { // ptrs into RingStorage
     asg_ring_config* ring_config;
     struct ring_buffer_with_view to_host_large_xfer;
     struct ring_buffer_with_view from_host_large_xfer;
-};
 
-// Helper function that will be common between guest and host:
-// Given ring storage and a write buffer, returns asg_context that
-// is the correct view into it.
-inline struct asg_context asg_context_create(
-    char* ring_storage,
-    char* buffer,
-    uint32_t buffer_size) {
-
-    struct asg_context res;
-
-    res.to_host =
-        reinterpret_cast<struct ring_buffer*>(
-            ring_storage +
-            offsetof(struct asg_ring_storage, to_host));
-    res.to_host_large_xfer.ring =
-        reinterpret_cast<struct ring_buffer*>(
-            ring_storage +
-            offsetof(struct asg_ring_storage, to_host_large_xfer));
-    res.from_host_large_xfer.ring =
-        reinterpret_cast<struct ring_buffer*>(
-            ring_storage +
-            offsetof(struct asg_ring_storage, from_host_large_xfer));
-
-    ring_buffer_init(res.to_host);
-
-    res.buffer = buffer;
-    res.host_state =
-        reinterpret_cast<asg_host_state*>(
-            &res.to_host->state);
-    res.ring_config =
-        reinterpret_cast<asg_ring_config*>(
-            res.to_host->config);
-
-    ring_buffer_view_init(
-        res.to_host_large_xfer.ring,
-        &res.to_host_large_xfer.view,
-        (uint8_t*)res.buffer, buffer_size);
-
-    ring_buffer_view_init(
-        res.from_host_large_xfer.ring,
-        &res.from_host_large_xfer.view,
-        (uint8_t*)res.buffer, buffer_size);
-
-    return res;
-}
+    // The asg_ring_config fields that live elsewhere depending on the
+    // layout; access them through these rather than |ring_config|.
+    uint32_t* transfer_size;
+    uint32_t* host_consumed_pos;
+    uint32_t* in_error;
+    uint32_t* to_host_notify_pos;
+    uint32_t* to_host_large_xfer_notify_pos;
+    uint32_t layout_version;
+};
 
 // During operation, the guest sends commands and data over the auxiliary
 // buffer while using the |to_host| ring to communicate what parts of the auxiliary
@@ -207,6 +240,9 @@ inline struct asg_context asg_context_create(
 //
 // Each of |to_host| and |from_host| can contain elements of type 1, 2, or 3:
 // Type 1: 8 bytes: 4 bytes offset, 4 bytes size. Relative to write buffer.
+// If several guest threads share one context, |to_host| can instead be run
+// with ring_buffer_mpsc_* and sizeof(asg_type1_xfer) payloads, so that they
+// post descriptors concurrently to the one host consumer.
 struct __attribute__((__packed__)) asg_type1_xfer {
     uint32_t offset;
     uint32_t size;
@@ -247,6 +283,8 @@ struct asg_ring_config {
 
     // 1 if transfers are of type 1, 2 if transfers of type 2,
     // 3 if the overall transfer size is known and we are sending something large.
+    // 4 or 5 (ASG_TRANSFER_MODE_PAYLOAD_*) for type 3 transfers that go
+    // through the payload cache.
     uint32_t transfer_mode;
 
     // the size of the transfer, used if transfer size is known.
@@ -255,8 +293,208 @@ struct asg_ring_config {
 
     // error state
     uint32_t in_error;
+
+    // ASG_HOST_FEATURE_* bits, set by the host before the guest starts
+    // sending. Zero from hosts that predate them.
+    uint32_t host_features;
+
+    // With ASG_HOST_FEATURE_NOTIFY_POS, the host's notify positions for
+    // to_host and to_host_large_xfer (see asg_need_notify).
+    uint32_t to_host_notify_pos;
+    uint32_t to_host_large_xfer_notify_pos;
+
+    // asg_guest_state, and the from_host_large_xfer write position the
+    // guest saw before going to sleep.
+    uint32_t guest_state;
+    uint32_t from_host_large_xfer_notify_pos;
+
+    // Bounds, set by the host before the guest starts sending, on the step
+    // (bytes of small writes batched per type 1 descriptor) and the chunk
+    // (bytes of a type 3 transfer published at a time) the guest picks at
+    // runtime. Zero leaves a bound to the guest.
+    uint32_t min_step_size;
+    uint32_t max_step_size;
+    uint32_t min_chunk_size;
+    uint32_t max_chunk_size;
+
+    // With ASG_HOST_FEATURE_PAYLOAD_CACHE, the capacity in bytes of the
+    // host's payload cache.
+    uint32_t payload_cache_size;
+};
+
+static_assert(sizeof(uint32_t) * NUM_CONFIG_FIELDS == ASG_RING_LINE_SIZE,
+              "asg_ring_lines_v2: config[] is not one line");
+static_assert(sizeof(struct asg_ring_lines_v2) == 3 * ASG_RING_LINE_SIZE,
+              "asg_ring_lines_v2: bad padding");
+static_assert(ASG_RING_LINES_V2_OFFSET + sizeof(struct asg_ring_lines_v2) <=
+                  ADDRESS_SPACE_GRAPHICS_PAGE_SIZE,
+              "asg_ring_lines_v2: does not fit in the to_host page");
+
+static_assert(sizeof(struct asg_ring_config) <= sizeof(uint32_t) * NUM_CONFIG_FIELDS,
+              "asg_ring_config: does not fit in config[]");
+
+// The host publishes, per ring, the write position past which it needs a
+// doorbell: the position it saw before going to sleep. The guest rings only
+// when a publish moves write_pos from |old_pos| to |new_pos| across it, as
+// with virtio's event_idx, instead of on every write while the host is not
+// rendering. So a host that stays awake gets no doorbells at all, and a
+// sleeping one gets one.
+//
+// The host notifies a guest sleeping on from_host_large_xfer by the same rule,
+// against from_host_large_xfer_notify_pos.
+//
+// Both sides order their store before the other's load with a seq_cst
+// fence: the guest between publishing write_pos and loading the notify
+// position, the host between storing the notify position and checking the
+// ring once more before it sleeps (asg_host_prepare_to_sleep).
+#define ASG_HOST_FEATURE_NOTIFY_POS (1 << 0)
+
+inline bool asg_need_notify(
+    uint32_t notify_pos, uint32_t new_pos, uint32_t old_pos) {
+    return (uint32_t)(new_pos - notify_pos - 1) < (uint32_t)(new_pos - old_pos);
+}
+
+// Host side: sets the notify positions of both guest -> host rings to where
+// the guest has written up to, so its next publish to either rings the
+// doorbell.
+inline void asg_host_publish_notify_pos(struct asg_context* ctx) {
+    __atomic_store_n(ctx->to_host_notify_pos,
+                     __atomic_load_n(&ctx->to_host->write_pos, __ATOMIC_ACQUIRE),
+                     __ATOMIC_SEQ_CST);
+    __atomic_store_n(ctx->to_host_large_xfer_notify_pos,
+                     __atomic_load_n(&ctx->to_host_large_xfer.ring->write_pos,
+                                     __ATOMIC_ACQUIRE),
+                     __ATOMIC_SEQ_CST);
+}
+
+// Host side, right before it sleeps waiting for the guest: asks for a
+// doorbell (ASG_HOST_STATE_NEED_NOTIFY and the notify positions), then looks
+// at both guest -> host rings once more. A publish that landed after the host
+// last looked, but before the guest could see the request, rang no doorbell
+// and never will, so this returns true if there is anything to read; the
+// host must not sleep then.
+inline bool asg_host_prepare_to_sleep(struct asg_context* ctx) {
+    __atomic_store_n(ctx->host_state, ASG_HOST_STATE_NEED_NOTIFY, __ATOMIC_SEQ_CST);
+    asg_host_publish_notify_pos(ctx);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return ring_buffer_available_read(ctx->to_host, nullptr) ||
+           ring_buffer_available_read(ctx->to_host_large_xfer.ring,
+                                      &ctx->to_host_large_xfer.view);
+}
+
+// The host keeps the last payload_cache_size bytes of large payloads the
+// guest asked it to (asg::PayloadCache), so that the guest can send them
+// again by reference instead of in full. Such a type 3 transfer starts with
+// a struct asg_payload_ref, and runs in one of two transfer modes, which the
+// guest keeps set until the host has drained the transfer:
+//
+// ASG_TRANSFER_MODE_PAYLOAD_STORE: the payload follows, and is read by the
+// consumer as in mode 3; the host also adds it to its cache.
+//
+// ASG_TRANSFER_MODE_PAYLOAD_REF: nothing follows; the host feeds the consumer
+// the payload from its cache. The guest only refers to payloads it knows the
+// host holds, by mirroring the host's cache; a reference the host cannot
+// resolve puts the stream in error.
+#define ASG_HOST_FEATURE_PAYLOAD_CACHE (1 << 1)
+
+#define ASG_TRANSFER_MODE_PAYLOAD_STORE 4
+#define ASG_TRANSFER_MODE_PAYLOAD_REF 5
+
+struct asg_payload_ref {
+    uint64_t hash[2];
+    uint32_t size;
+    uint32_t reserved;
 };
 
+// Helper function that will be common between guest and host:
+// Given ring storage, a write buffer and the versions advertised by the guest
+// and host, returns asg_context that is the correct view into it, and records
+// the versions in to_host.
+inline struct asg_context asg_context_create_versioned(
+    char* ring_storage,
+    char* buffer,
+    uint32_t buffer_size,
+    uint32_t guest_version,
+    uint32_t host_version) {
+
+    struct asg_context res;
+
+    res.to_host =
+        reinterpret_cast<struct ring_buffer*>(
+            ring_storage +
+            offsetof(struct asg_ring_storage, to_host));
+    res.to_host_large_xfer.ring =
+        reinterpret_cast<struct ring_buffer*>(
+            ring_storage +
+            offsetof(struct asg_ring_storage, to_host_large_xfer));
+    res.from_host_large_xfer.ring =
+        reinterpret_cast<struct ring_buffer*>(
+            ring_storage +
+            offsetof(struct asg_ring_storage, from_host_large_xfer));
+
+    ring_buffer_init(res.to_host);
+
+    res.buffer = buffer;
+    res.layout_version =
+        asg_ring_layout_negotiate(guest_version, host_version);
+
+    res.to_host->guest_version = guest_version;
+    res.to_host->host_version = host_version;
+
+    if (res.layout_version >= ASG_RING_LAYOUT_V2) {
+        struct asg_ring_lines_v2* lines =
+            reinterpret_cast<struct asg_ring_lines_v2*>(
+                ring_storage +
+                offsetof(struct asg_ring_storage, to_host) +
+                ASG_RING_LINES_V2_OFFSET);
+        res.host_state =
+            reinterpret_cast<asg_host_state*>(&lines->host_state);
+        res.ring_config =
+            reinterpret_cast<asg_ring_config*>(lines->config);
+        res.transfer_size = &lines->transfer_size;
+        res.host_consumed_pos = &lines->host_consumed_pos;
+        res.in_error = &lines->in_error;
+        res.to_host_notify_pos = &lines->to_host_notify_pos;
+        res.to_host_large_xfer_notify_pos =
+            &lines->to_host_large_xfer_notify_pos;
+    } else {
+        res.host_state =
+            reinterpret_cast<asg_host_state*>(
+                &res.to_host->state);
+        res.ring_config =
+            reinterpret_cast<asg_ring_config*>(
+                res.to_host->config);
+        res.transfer_size = &res.ring_config->transfer_size;
+        res.host_consumed_pos = &res.ring_config->host_consumed_pos;
+        res.in_error = &res.ring_config->in_error;
+        res.to_host_notify_pos = &res.ring_config->to_host_notify_pos;
+        res.to_host_large_xfer_notify_pos =
+            &res.ring_config->to_host_large_xfer_notify_pos;
+    }
+
+    ring_buffer_view_init(
+        res.to_host_large_xfer.ring,
+        &res.to_host_large_xfer.view,
+        (uint8_t*)res.buffer, buffer_size);
+
+    ring_buffer_view_init(
+        res.from_host_large_xfer.ring,
+        &res.from_host_large_xfer.view,
+        (uint8_t*)res.buffer, buffer_size);
+
+    return res;
+}
+
+// As above, for peers that do not advertise a version: always v1.
+inline struct asg_context asg_context_create(
+    char* ring_storage,
+    char* buffer,
+    uint32_t buffer_size) {
+    return asg_context_create_versioned(
+        ring_storage, buffer, buffer_size,
+        ASG_RING_LAYOUT_V1, ASG_RING_LAYOUT_V1);
+}
+
 // State/config changes may only occur if the ring is empty, or the state
 // is transitioning to Error. That way, the host and guest have a chance to
 // synchronize on the same state.
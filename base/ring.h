@@ -0,0 +1,171 @@
+// Copyright 2020 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include "base/ring_buffer.h"
+
+#include <string.h>
+
+#ifdef _MSC_VER
+#define RING_FORCE_INLINE __forceinline
+#else
+#define RING_FORCE_INLINE inline __attribute__((always_inline))
+#endif
+
+namespace asg {
+
+// Header-only fast paths of the ring_buffer protocol with the buffer geometry
+// fixed at compile time.
+//
+// ring_view<Shift> works on the indices of a struct ring_buffer together with
+// a buffer of (1 << Shift) bytes, like a struct ring_buffer_view whose size
+// and mask are constants: index math folds into the instructions using it,
+// small fixed-size copies (descriptors) become plain moves, and none of it
+// crosses into ring_buffer.cpp except to wake a sleeping peer. It interoperates
+// with the C API on the same ring (ring_buffer_view_* on the other side, or
+// on this side for anything not covered here) as long as that uses a view of
+// the same (1 << Shift) bytes, since both sides mask the indices with the
+// size. It does not look at
+// RING_BUFFER_VIEW_DOUBLE_MAPPED: copies that cross the end of the buffer are
+// always split, which is still correct over a double-mapped one.
+//
+// ring<> is the same over the ring's own statically allocated buffer, which
+// it always covers all of, as ring_buffer_read / ring_buffer_write do.
+// Descriptor rings deeper than RING_BUFFER_SIZE can be had with ring_view
+// over separately allocated storage; no asg stream uses one, as to_host is
+// fixed in the shared ring page layout.
+template <uint32_t Shift>
+class ring_view {
+public:
+    static constexpr uint32_t kShift = Shift;
+    static constexpr uint32_t kSize = 1u << Shift;
+    static constexpr uint32_t kMask = kSize - 1;
+
+    static_assert(Shift > 0 && Shift < 32, "ring_view: bad shift");
+
+    RING_FORCE_INLINE ring_view(struct ring_buffer* r, uint8_t* buf)
+        : mRing(r), mBuf(buf) { }
+
+    struct ring_buffer* ring() const { return mRing; }
+    uint8_t* buf() const { return mBuf; }
+
+    // As ring_buffer_available_read/write; may be called from either side.
+    RING_FORCE_INLINE uint32_t available_read() const {
+        return (loadAcquire(&mRing->write_pos) -
+                loadAcquire(&mRing->read_pos)) & kMask;
+    }
+
+    RING_FORCE_INLINE uint32_t available_write() const {
+        return (loadAcquire(&mRing->read_pos) -
+                loadAcquire(&mRing->write_pos) - 1) & kMask;
+    }
+
+    // Producer side.
+    RING_FORCE_INLINE bool can_write(uint32_t bytes) const {
+        return ((loadAcquire(&mRing->read_pos) -
+                 loadRelaxed(&mRing->write_pos) - 1) & kMask) >= bytes;
+    }
+
+    // Writes all of |bytes| or nothing, and publishes it.
+    RING_FORCE_INLINE bool write(const void* data, uint32_t bytes) {
+        if (!can_write(bytes)) return false;
+        copyIn(loadRelaxed(&mRing->write_pos), (const uint8_t*)data, bytes);
+        publish(&mRing->write_pos, &mRing->write_waiters, bytes);
+        return true;
+    }
+
+    // Consumer side.
+    RING_FORCE_INLINE bool can_read(uint32_t bytes) const {
+        return ((loadAcquire(&mRing->write_pos) -
+                 loadRelaxed(&mRing->read_pos)) & kMask) >= bytes;
+    }
+
+    // Copies out |bytes| without consuming them, if they are all there.
+    RING_FORCE_INLINE bool peek(void* data, uint32_t bytes) const {
+        if (!can_read(bytes)) return false;
+        copyOut(loadRelaxed(&mRing->read_pos), (uint8_t*)data, bytes);
+        return true;
+    }
+
+    RING_FORCE_INLINE void consume(uint32_t bytes) {
+        publish(&mRing->read_pos, &mRing->read_waiters, bytes);
+    }
+
+    // Reads all of |bytes| or nothing.
+    RING_FORCE_INLINE bool read(void* data, uint32_t bytes) {
+        if (!peek(data, bytes)) return false;
+        consume(bytes);
+        return true;
+    }
+
+private:
+    static RING_FORCE_INLINE uint32_t loadRelaxed(const uint32_t* pos) {
+        return __atomic_load_n(pos, __ATOMIC_RELAXED);
+    }
+
+    static RING_FORCE_INLINE uint32_t loadAcquire(const uint32_t* pos) {
+        return __atomic_load_n(pos, __ATOMIC_ACQUIRE);
+    }
+
+    // Same protocol as the C API: release the index, then, after a full
+    // fence, wake the other side if it said it may be asleep on it.
+    RING_FORCE_INLINE void publish(
+        uint32_t* pos, const uint32_t* waiters, uint32_t bytes) {
+        __atomic_store_n(pos, loadRelaxed(pos) + bytes, __ATOMIC_RELEASE);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__builtin_expect(loadRelaxed(waiters), 0)) {
+            ring_buffer_wake_index(pos);
+        }
+    }
+
+    RING_FORCE_INLINE void copyIn(
+        uint32_t index, const uint8_t* src, uint32_t bytes) {
+        uint32_t pos = index & kMask;
+        uint32_t availableAtEnd = kSize - pos;
+        if (__builtin_expect(bytes > availableAtEnd, 0)) {
+            memcpy(mBuf + pos, src, availableAtEnd);
+            memcpy(mBuf, src + availableAtEnd, bytes - availableAtEnd);
+        } else {
+            memcpy(mBuf + pos, src, bytes);
+        }
+    }
+
+    RING_FORCE_INLINE void copyOut(
+        uint32_t index, uint8_t* dst, uint32_t bytes) const {
+        uint32_t pos = index & kMask;
+        uint32_t availableAtEnd = kSize - pos;
+        if (__builtin_expect(bytes > availableAtEnd, 0)) {
+            memcpy(dst, mBuf + pos, availableAtEnd);
+            memcpy(dst + availableAtEnd, mBuf, bytes - availableAtEnd);
+        } else {
+            memcpy(dst, mBuf + pos, bytes);
+        }
+    }
+
+    struct ring_buffer* mRing;
+    uint8_t* mBuf;
+};
+
+template <uint32_t Shift = RING_BUFFER_SHIFT>
+class ring : public ring_view<Shift> {
+public:
+    static_assert(Shift == RING_BUFFER_SHIFT,
+                  "ring: must cover the statically allocated buffer, as the "
+                  "C API does");
+
+    RING_FORCE_INLINE explicit ring(struct ring_buffer* r)
+        : ring_view<Shift>(r, r->buf) { }
+};
+
+} // namespace asg
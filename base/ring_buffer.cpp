@@ -12,6 +12,8 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 #include "ring_buffer.h"
+#include "ring_buffer_copy.h"
+#include "ring.h"
 
 #include <errno.h>
 #include <string.h>
@@ -31,13 +33,31 @@
 #include <windows.h>
 #else
 #include <sched.h>
+#include <time.h>
 #include <unistd.h>
 #endif
 
+#ifdef __linux__
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
 #define RING_BUFFER_MASK (RING_BUFFER_SIZE - 1)
 
 #define RING_BUFFER_VERSION 1
 
+// Defaults for struct ring_buffer_wait_policy: the initial spin budget and
+// the bounds it is tuned within (in pause iterations), how many times to yield
+// before going to sleep, and the longest a waiter sleeps before checking again
+// by itself. Sync-state waits use the initial budget as a fixed spin count.
+#define RING_BUFFER_WAIT_SPINS 1024
+#define RING_BUFFER_WAIT_MIN_SPINS 16
+#define RING_BUFFER_WAIT_MAX_SPINS 65536
+#define RING_BUFFER_WAIT_YIELDS 4
+#define RING_BUFFER_WAIT_SLEEP_US 1000
+
 static inline void ring_buffer_pause() {
 #if RING_BUFFER_X86
     _mm_pause();
@@ -46,6 +66,35 @@ static inline void ring_buffer_pause() {
 #endif
 }
 
+// Sleeps while |*addr| == |expected|, for at most |timeout_us|. The futex is
+// deliberately not FUTEX_PRIVATE_FLAG so that it keys on the underlying page
+// and works across processes that map the same ring.
+static void ring_buffer_futex_wait(
+    const uint32_t* addr, uint32_t expected, uint32_t timeout_us) {
+#ifdef __linux__
+    struct timespec ts;
+    ts.tv_sec = timeout_us / 1000000;
+    ts.tv_nsec = (timeout_us % 1000000) * 1000;
+    syscall(SYS_futex, addr, FUTEX_WAIT, expected, &ts, nullptr, 0);
+#elif defined(_WIN32)
+    (void)addr;
+    (void)expected;
+    Sleep(timeout_us / 1000);
+#else
+    (void)addr;
+    (void)expected;
+    usleep(timeout_us);
+#endif
+}
+
+static void ring_buffer_futex_wake(const uint32_t* addr) {
+#ifdef __linux__
+    syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+#else
+    (void)addr;
+#endif
+}
+
 void ring_buffer_init(struct ring_buffer* r) {
     r->guest_version = 1;
     r->write_pos = 0;
@@ -55,135 +104,236 @@ void ring_buffer_init(struct ring_buffer* r) {
     r->read_yield_count = 0;
     r->read_sleep_us_count = 0;
 
+    r->write_waiters = 0;
+    r->read_waiters = 0;
+    r->state_waiters = 0;
+
     r->state = 0;
 }
 
-static uint32_t get_ring_pos(uint32_t index) {
-    return index & RING_BUFFER_MASK;
+// Index access for the single producer / single consumer protocol.
+//
+// write_pos is only ever written by the producer and read_pos only by the
+// consumer, so each side can read its own index without synchronization and
+// publish it with a plain release store instead of a locked read-modify-write.
+// The index owned by the other side is read with acquire so that the data it
+// guards (bytes written before write_pos moved, or bytes finished being read
+// before read_pos moved) is visible before we act on it.
+static inline uint32_t ring_buffer_load_own(const uint32_t* pos) {
+    return __atomic_load_n(pos, __ATOMIC_RELAXED);
+}
+
+static inline uint32_t ring_buffer_load_remote(const uint32_t* pos) {
+    return __atomic_load_n(pos, __ATOMIC_ACQUIRE);
+}
+
+static inline void ring_buffer_publish(uint32_t* pos, uint32_t bytes) {
+    __atomic_store_n(pos, ring_buffer_load_own(pos) + bytes, __ATOMIC_RELEASE);
+}
+
+// Publishing also wakes the other side if it said it may be asleep on the
+// index. The fence keeps the waiter check from being satisfied before the
+// index store is visible; without it, a waiter that sets its flag and
+// re-checks the index in between (see ring_buffer_wait_on) can miss both and
+// sleep for its whole timeout.
+static inline void ring_buffer_publish_write(struct ring_buffer* r, uint32_t bytes) {
+    ring_buffer_publish(&r->write_pos, bytes);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->write_waiters, __ATOMIC_RELAXED)) {
+        ring_buffer_futex_wake(&r->write_pos);
+    }
+}
+
+static inline void ring_buffer_publish_read(struct ring_buffer* r, uint32_t bytes) {
+    ring_buffer_publish(&r->read_pos, bytes);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->read_waiters, __ATOMIC_RELAXED)) {
+        ring_buffer_futex_wake(&r->read_pos);
+    }
+}
+
+// The statically allocated ring, for the functions below that are thin
+// wrappers over base/ring.h.
+static inline asg::ring<> ring_buffer_static_ring(const struct ring_buffer* r) {
+    return asg::ring<>((struct ring_buffer*)r);
 }
 
 bool ring_buffer_can_write(const struct ring_buffer* r, uint32_t bytes) {
-    uint32_t read_view;
-    __atomic_load(&r->read_pos, &read_view, __ATOMIC_SEQ_CST);
-    return get_ring_pos(read_view - r->write_pos - 1) >= bytes;
+    return ring_buffer_static_ring(r).can_write(bytes);
 }
 
 bool ring_buffer_can_read(const struct ring_buffer* r, uint32_t bytes) {
-    uint32_t write_view;
-    __atomic_load(&r->write_pos, &write_view, __ATOMIC_SEQ_CST);
-    return get_ring_pos(write_view - r->read_pos) >= bytes;
+    return ring_buffer_static_ring(r).can_read(bytes);
 }
 
-long ring_buffer_write(
-    struct ring_buffer* r, const void* data, uint32_t step_size, uint32_t steps) {
-    const uint8_t* data_bytes = (const uint8_t*)data;
-    uint32_t i;
+// The statically allocated ring as a view, so that it can share the view
+// copy paths.
+static inline struct ring_buffer_view ring_buffer_static_view(
+    struct ring_buffer* r) {
+    struct ring_buffer_view v = {
+        r->buf, RING_BUFFER_SIZE, RING_BUFFER_MASK, 0, 0,
+    };
+    return v;
+}
 
-    for (i = 0; i < steps; ++i) {
-        if (!ring_buffer_can_write(r, step_size)) {
-            errno = -EAGAIN;
-            return (long)i;
-        }
+// Copies |bytes| into / out of the view starting at ring index |index|.
+// Needs to be split up into 2 copies for the edge case, unless the view is
+// double mapped. Copies in stream or not as a whole, however they are split
+// (see ring_buffer_copy.h); copies out never stream.
+static void ring_buffer_view_copy_in(
+    struct ring_buffer_view* v,
+    uint32_t index,
+    const uint8_t* src,
+    uint32_t bytes) {
+    ring_buffer_copy_func copy =
+        ring_buffer_copy_for_threshold(bytes, v->nt_threshold);
 
-        // Needs to be split up into 2 writes for the edge case.
-        uint32_t available_at_end =
-            RING_BUFFER_SIZE - get_ring_pos(r->write_pos);
-
-        if (step_size > available_at_end) {
-            uint32_t remaining = step_size - available_at_end;
-            memcpy(
-                &r->buf[get_ring_pos(r->write_pos)],
-                data_bytes + i * step_size,
-                available_at_end);
-            memcpy(
-                &r->buf[get_ring_pos(r->write_pos + available_at_end)],
-                data_bytes + i * step_size + available_at_end,
-                remaining);
-        } else {
-            memcpy(
-                &r->buf[get_ring_pos(r->write_pos)],
-                data_bytes + i * step_size,
-                step_size);
-        }
+    if (v->flags & RING_BUFFER_VIEW_DOUBLE_MAPPED) {
+        copy(&v->buf[ring_buffer_view_get_ring_pos(v, index)], src, bytes);
+        return;
+    }
+
+    uint32_t available_at_end =
+        v->size - ring_buffer_view_get_ring_pos(v, index);
+
+    if (bytes > available_at_end) {
+        uint32_t remaining = bytes - available_at_end;
+        copy(&v->buf[ring_buffer_view_get_ring_pos(v, index)],
+             src,
+             available_at_end);
+        copy(&v->buf[ring_buffer_view_get_ring_pos(v, index + available_at_end)],
+             src + available_at_end,
+             remaining);
+    } else {
+        copy(&v->buf[ring_buffer_view_get_ring_pos(v, index)],
+             src,
+             bytes);
+    }
+}
 
-        __atomic_add_fetch(&r->write_pos, step_size, __ATOMIC_SEQ_CST);
+static void ring_buffer_view_copy_out(
+    const struct ring_buffer_view* v,
+    uint32_t index,
+    uint8_t* dst,
+    uint32_t bytes) {
+    if (v->flags & RING_BUFFER_VIEW_DOUBLE_MAPPED) {
+        memcpy(dst, &v->buf[ring_buffer_view_get_ring_pos(v, index)], bytes);
+        return;
     }
 
-    errno = 0;
-    return (long)steps;
+    uint32_t available_at_end =
+        v->size - ring_buffer_view_get_ring_pos(v, index);
+
+    if (bytes > available_at_end) {
+        uint32_t remaining = bytes - available_at_end;
+        memcpy(dst,
+               &v->buf[ring_buffer_view_get_ring_pos(v, index)],
+               available_at_end);
+        memcpy(dst + available_at_end,
+               &v->buf[ring_buffer_view_get_ring_pos(v, index + available_at_end)],
+               remaining);
+    } else {
+        memcpy(dst,
+               &v->buf[ring_buffer_view_get_ring_pos(v, index)],
+               bytes);
+    }
 }
 
-long ring_buffer_read(
-    struct ring_buffer* r, void* data, uint32_t step_size, uint32_t steps) {
-    uint8_t* data_bytes = (uint8_t*)data;
-    uint32_t i;
+// Free space for the producer / readable bytes for the consumer.
+static inline uint32_t ring_buffer_view_free(
+    const struct ring_buffer* r,
+    const struct ring_buffer_view* v) {
+    return ring_buffer_view_get_ring_pos(
+        v,
+        ring_buffer_load_remote(&r->read_pos) -
+        ring_buffer_load_own(&r->write_pos) - 1);
+}
 
-    for (i = 0; i < steps; ++i) {
-        if (!ring_buffer_can_read(r, step_size)) {
-            errno = -EAGAIN;
-            return (long)i;
-        }
+static inline uint32_t ring_buffer_view_filled(
+    const struct ring_buffer* r,
+    const struct ring_buffer_view* v) {
+    return ring_buffer_view_get_ring_pos(
+        v,
+        ring_buffer_load_remote(&r->write_pos) -
+        ring_buffer_load_own(&r->read_pos));
+}
 
-        // Needs to be split up into 2 reads for the edge case.
-        uint32_t available_at_end =
-            RING_BUFFER_SIZE - get_ring_pos(r->read_pos);
-
-        if (step_size > available_at_end) {
-            uint32_t remaining = step_size - available_at_end;
-            memcpy(
-                data_bytes + i * step_size,
-                &r->buf[get_ring_pos(r->read_pos)],
-                available_at_end);
-            memcpy(
-                data_bytes + i * step_size + available_at_end,
-                &r->buf[get_ring_pos(r->read_pos + available_at_end)],
-                remaining);
-        } else {
-            memcpy(
-                data_bytes + i * step_size,
-                &r->buf[get_ring_pos(r->read_pos)],
-                step_size);
-        }
+static inline uint32_t ring_buffer_steps_that_fit(
+    uint32_t avail, uint32_t step_size, uint32_t steps) {
+    if (!step_size) return steps;
+    uint32_t fit = avail / step_size;
+    return fit < steps ? fit : steps;
+}
+
+// Copies as many whole steps as fit in |avail| and then publishes all of them
+// with a single index update, so the other side sees one publish per call
+// rather than one per step. If |data| is null, only the index is advanced.
+static long ring_buffer_view_write_steps(
+    struct ring_buffer* r,
+    struct ring_buffer_view* v,
+    const uint8_t* data, uint32_t step_size, uint32_t steps,
+    uint32_t avail) {
+    uint32_t fit = ring_buffer_steps_that_fit(avail, step_size, steps);
 
-        __atomic_add_fetch(&r->read_pos, step_size, __ATOMIC_SEQ_CST);
+    if (fit) {
+        if (data) {
+            ring_buffer_view_copy_in(v, r->write_pos, data, fit * step_size);
+        }
+        ring_buffer_publish_write(r, fit * step_size);
     }
 
-    errno = 0;
-    return (long)steps;
+    errno = fit < steps ? -EAGAIN : 0;
+    return (long)fit;
 }
 
-long ring_buffer_advance_write(
-    struct ring_buffer* r, uint32_t step_size, uint32_t steps) {
-    uint32_t i;
+static long ring_buffer_view_read_steps(
+    struct ring_buffer* r,
+    struct ring_buffer_view* v,
+    uint8_t* data, uint32_t step_size, uint32_t steps,
+    uint32_t avail) {
+    uint32_t fit = ring_buffer_steps_that_fit(avail, step_size, steps);
 
-    for (i = 0; i < steps; ++i) {
-        if (!ring_buffer_can_write(r, step_size)) {
-            errno = -EAGAIN;
-            return (long)i;
+    if (fit) {
+        if (data) {
+            ring_buffer_view_copy_out(v, r->read_pos, data, fit * step_size);
         }
-
-        __atomic_add_fetch(&r->write_pos, step_size, __ATOMIC_SEQ_CST);
+        ring_buffer_publish_read(r, fit * step_size);
     }
 
-    errno = 0;
-    return (long)steps;
+    errno = fit < steps ? -EAGAIN : 0;
+    return (long)fit;
 }
 
-long ring_buffer_advance_read(
-    struct ring_buffer* r, uint32_t step_size, uint32_t steps) {
-    uint32_t i;
+long ring_buffer_write(
+    struct ring_buffer* r, const void* data, uint32_t step_size, uint32_t steps) {
+    struct ring_buffer_view v = ring_buffer_static_view(r);
+    return ring_buffer_view_write_steps(
+        r, &v, (const uint8_t*)data, step_size, steps,
+        ring_buffer_view_free(r, &v));
+}
 
-    for (i = 0; i < steps; ++i) {
-        if (!ring_buffer_can_read(r, step_size)) {
-            errno = -EAGAIN;
-            return (long)i;
-        }
+long ring_buffer_read(
+    struct ring_buffer* r, void* data, uint32_t step_size, uint32_t steps) {
+    struct ring_buffer_view v = ring_buffer_static_view(r);
+    return ring_buffer_view_read_steps(
+        r, &v, (uint8_t*)data, step_size, steps,
+        ring_buffer_view_filled(r, &v));
+}
 
-        __atomic_add_fetch(&r->read_pos, step_size, __ATOMIC_SEQ_CST);
-    }
+long ring_buffer_advance_write(
+    struct ring_buffer* r, uint32_t step_size, uint32_t steps) {
+    struct ring_buffer_view v = ring_buffer_static_view(r);
+    return ring_buffer_view_write_steps(
+        r, &v, nullptr, step_size, steps,
+        ring_buffer_view_free(r, &v));
+}
 
-    errno = 0;
-    return (long)steps;
+long ring_buffer_advance_read(
+    struct ring_buffer* r, uint32_t step_size, uint32_t steps) {
+    struct ring_buffer_view v = ring_buffer_static_view(r);
+    return ring_buffer_view_read_steps(
+        r, &v, nullptr, step_size, steps,
+        ring_buffer_view_filled(r, &v));
 }
 
 uint32_t ring_buffer_calc_shift(uint32_t size) {
@@ -199,6 +349,77 @@ uint32_t ring_buffer_calc_shift(uint32_t size) {
     return shift;
 }
 
+uint8_t* ring_buffer_double_map_fd(int fd, uint64_t offset, uint32_t size) {
+#ifdef __linux__
+    long page = sysconf(_SC_PAGESIZE);
+    if (!size || (size & (size - 1)) || (size % page) || (offset % page)) {
+        errno = EINVAL;
+        return nullptr;
+    }
+
+    // Reserve address space for both halves first, so that the two fixed
+    // mappings below cannot land on top of anything else.
+    void* base = mmap(nullptr, 2 * (size_t)size, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) return nullptr;
+
+    uint8_t* lo = (uint8_t*)base;
+    for (uint32_t i = 0; i < 2; ++i) {
+        if (mmap(lo + i * (size_t)size, size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_FIXED, fd, (off_t)offset) == MAP_FAILED) {
+            int err = errno;
+            munmap(base, 2 * (size_t)size);
+            errno = err;
+            return nullptr;
+        }
+    }
+
+    return lo;
+#else
+    (void)fd;
+    (void)offset;
+    (void)size;
+    errno = ENOSYS;
+    return nullptr;
+#endif
+}
+
+uint8_t* ring_buffer_double_map_create(uint32_t size, int* fd_out) {
+#ifdef __linux__
+    int fd = memfd_create("ring_buffer", MFD_CLOEXEC);
+    if (fd < 0) return nullptr;
+
+    uint8_t* buf = nullptr;
+    if (ftruncate(fd, size) == 0) {
+        buf = ring_buffer_double_map_fd(fd, 0, size);
+    }
+
+    if (!buf || !fd_out) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return buf;
+    }
+
+    *fd_out = fd;
+    return buf;
+#else
+    (void)size;
+    (void)fd_out;
+    errno = ENOSYS;
+    return nullptr;
+#endif
+}
+
+void ring_buffer_double_unmap(uint8_t* buf, uint32_t size) {
+#ifdef __linux__
+    if (buf) munmap(buf, 2 * (size_t)size);
+#else
+    (void)buf;
+    (void)size;
+#endif
+}
+
 void ring_buffer_view_init(
     struct ring_buffer* r,
     struct ring_buffer_view* v,
@@ -212,6 +433,8 @@ void ring_buffer_view_init(
     v->buf = buf;
     v->size = (1 << shift);
     v->mask = (1 << shift) - 1;
+    v->flags = 0;
+    v->nt_threshold = 0;
 }
 
 void ring_buffer_init_view_only(
@@ -224,6 +447,8 @@ void ring_buffer_init_view_only(
     v->buf = buf;
     v->size = (1 << shift);
     v->mask = (1 << shift) - 1;
+    v->flags = 0;
+    v->nt_threshold = 0;
 }
 
 uint32_t ring_buffer_view_get_ring_pos(
@@ -236,46 +461,88 @@ bool ring_buffer_view_can_write(
     const struct ring_buffer* r,
     const struct ring_buffer_view* v,
     uint32_t bytes) {
-    uint32_t read_view;
-    __atomic_load(&r->read_pos, &read_view, __ATOMIC_SEQ_CST);
+    uint32_t read_view = ring_buffer_load_remote(&r->read_pos);
     return ring_buffer_view_get_ring_pos(
-            v, read_view - r->write_pos - 1) >= bytes;
+            v, read_view - ring_buffer_load_own(&r->write_pos) - 1) >= bytes;
 }
 
 bool ring_buffer_view_can_read(
     const struct ring_buffer* r,
     const struct ring_buffer_view* v,
     uint32_t bytes) {
-    uint32_t write_view;
-    __atomic_load(&r->write_pos, &write_view, __ATOMIC_SEQ_CST);
+    uint32_t write_view = ring_buffer_load_remote(&r->write_pos);
     return ring_buffer_view_get_ring_pos(
-            v, write_view - r->read_pos) >= bytes;
+            v, write_view - ring_buffer_load_own(&r->read_pos)) >= bytes;
 }
 
 uint32_t ring_buffer_available_read(
     const struct ring_buffer* r,
     const struct ring_buffer_view* v) {
-    uint32_t write_view;
-    __atomic_load(&r->write_pos, &write_view, __ATOMIC_SEQ_CST);
-    if (v) {
-        return ring_buffer_view_get_ring_pos(
-                v, write_view - r->read_pos);
-    } else {
-        return get_ring_pos(write_view - r->read_pos);
+    // Also used by the producer to watch the consumer drain the ring, so
+    // neither index can be assumed to be our own here.
+    if (!v) {
+        return ring_buffer_static_ring(r).available_read();
     }
+    uint32_t write_view = ring_buffer_load_remote(&r->write_pos);
+    uint32_t read_view = ring_buffer_load_remote(&r->read_pos);
+    return ring_buffer_view_get_ring_pos(v, write_view - read_view);
 }
 
 uint32_t ring_buffer_available_write(
     const struct ring_buffer* r,
     const struct ring_buffer_view* v) {
-    uint32_t read_view;
-    __atomic_load(&r->read_pos, &read_view, __ATOMIC_SEQ_CST);
-    if (v) {
-        return ring_buffer_view_get_ring_pos(
-                v, read_view - r->write_pos - 1);
-    } else {
-        return get_ring_pos(read_view - r->write_pos - 1);
+    if (!v) {
+        return ring_buffer_static_ring(r).available_write();
     }
+    uint32_t read_view = ring_buffer_load_remote(&r->read_pos);
+    uint32_t write_view = ring_buffer_load_remote(&r->write_pos);
+    return ring_buffer_view_get_ring_pos(v, read_view - write_view - 1);
+}
+
+void ring_buffer_producer_cache_init(
+    const struct ring_buffer* r,
+    struct ring_buffer_index_cache* c) {
+    c->remote_pos = ring_buffer_load_remote(&r->read_pos);
+    c->refreshes = 0;
+}
+
+void ring_buffer_consumer_cache_init(
+    const struct ring_buffer* r,
+    struct ring_buffer_index_cache* c) {
+    c->remote_pos = ring_buffer_load_remote(&r->write_pos);
+    c->refreshes = 0;
+}
+
+// Free space / readable bytes according to the cached remote index. Only
+// reloads the shared index when the cached one cannot satisfy |bytes|.
+static uint32_t ring_buffer_view_free_cached(
+    const struct ring_buffer* r,
+    const struct ring_buffer_view* v,
+    struct ring_buffer_index_cache* c,
+    uint32_t bytes) {
+    uint32_t write_pos = ring_buffer_load_own(&r->write_pos);
+    uint32_t avail = ring_buffer_view_get_ring_pos(
+        v, c->remote_pos - write_pos - 1);
+    if (avail >= bytes && avail) return avail;
+
+    c->remote_pos = ring_buffer_load_remote(&r->read_pos);
+    ++c->refreshes;
+    return ring_buffer_view_get_ring_pos(v, c->remote_pos - write_pos - 1);
+}
+
+static uint32_t ring_buffer_view_filled_cached(
+    const struct ring_buffer* r,
+    const struct ring_buffer_view* v,
+    struct ring_buffer_index_cache* c,
+    uint32_t bytes) {
+    uint32_t read_pos = ring_buffer_load_own(&r->read_pos);
+    uint32_t avail = ring_buffer_view_get_ring_pos(
+        v, c->remote_pos - read_pos);
+    if (avail >= bytes && avail) return avail;
+
+    c->remote_pos = ring_buffer_load_remote(&r->write_pos);
+    ++c->refreshes;
+    return ring_buffer_view_get_ring_pos(v, c->remote_pos - read_pos);
 }
 
 int ring_buffer_copy_contents(
@@ -284,177 +551,722 @@ int ring_buffer_copy_contents(
     uint32_t wanted_bytes,
     uint8_t* res) {
 
-    uint32_t total_available =
-        ring_buffer_available_read(r, v);
-    uint32_t available_at_end = 0;
-
-    if (v) {
-        available_at_end =
-            v->size - ring_buffer_view_get_ring_pos(v, r->read_pos);
-    } else {
-        available_at_end =
-            RING_BUFFER_SIZE - get_ring_pos(r->write_pos);
+    struct ring_buffer_view static_view;
+    if (!v) {
+        static_view = ring_buffer_static_view((struct ring_buffer*)r);
+        v = &static_view;
     }
 
-    if (total_available < wanted_bytes) {
+    if (ring_buffer_available_read(r, v) < wanted_bytes) {
         return -1;
     }
 
-    if (v) {
-        if (wanted_bytes > available_at_end) {
-            uint32_t remaining = wanted_bytes - available_at_end;
-            memcpy(res,
-                   &v->buf[ring_buffer_view_get_ring_pos(v, r->read_pos)],
-                   available_at_end);
-            memcpy(res + available_at_end,
-                   &v->buf[ring_buffer_view_get_ring_pos(v, r->read_pos + available_at_end)],
-                   remaining);
-        } else {
-            memcpy(res,
-                   &v->buf[ring_buffer_view_get_ring_pos(v, r->read_pos)],
-                   wanted_bytes);
-        }
+    ring_buffer_view_copy_out(v, r->read_pos, res, wanted_bytes);
+    return 0;
+}
+
+// Describes |bytes| of the view starting at ring index |index| in place.
+static void ring_buffer_view_get_spans(
+    const struct ring_buffer_view* v,
+    uint32_t index,
+    uint32_t bytes,
+    struct ring_buffer_spans* spans) {
+    uint32_t pos = ring_buffer_view_get_ring_pos(v, index);
+    uint32_t available_at_end = v->size - pos;
+
+    spans->first = &v->buf[pos];
+    if (bytes > available_at_end &&
+        !(v->flags & RING_BUFFER_VIEW_DOUBLE_MAPPED)) {
+        spans->first_len = available_at_end;
+        spans->second = v->buf;
+        spans->second_len = bytes - available_at_end;
     } else {
-        if (wanted_bytes > available_at_end) {
-            uint32_t remaining = wanted_bytes - available_at_end;
-            memcpy(res,
-                   &r->buf[get_ring_pos(r->read_pos)],
-                   available_at_end);
-            memcpy(res + available_at_end,
-                   &r->buf[get_ring_pos(r->read_pos + available_at_end)],
-                   remaining);
-        } else {
-            memcpy(res,
-                   &r->buf[get_ring_pos(r->read_pos)],
-                   wanted_bytes);
-        }
+        spans->first_len = bytes;
+        spans->second = nullptr;
+        spans->second_len = 0;
     }
-    return 0;
+}
+
+uint32_t ring_buffer_view_reserve_write(
+    struct ring_buffer* r,
+    struct ring_buffer_view* v,
+    struct ring_buffer_index_cache* c,
+    uint32_t bytes,
+    struct ring_buffer_spans* spans) {
+    struct ring_buffer_view static_view;
+    if (!v) {
+        static_view = ring_buffer_static_view(r);
+        v = &static_view;
+    }
+
+    uint32_t avail = c ?
+        ring_buffer_view_free_cached(r, v, c, bytes) :
+        ring_buffer_view_free(r, v);
+    uint32_t reserved = avail < bytes ? avail : bytes;
+
+    ring_buffer_view_get_spans(v, r->write_pos, reserved, spans);
+    return reserved;
+}
+
+void ring_buffer_commit_write(
+    struct ring_buffer* r,
+    uint32_t bytes) {
+    ring_buffer_publish_write(r, bytes);
+}
+
+uint32_t ring_buffer_view_peek_read(
+    struct ring_buffer* r,
+    struct ring_buffer_view* v,
+    struct ring_buffer_index_cache* c,
+    uint32_t bytes,
+    struct ring_buffer_spans* spans) {
+    struct ring_buffer_view static_view;
+    if (!v) {
+        static_view = ring_buffer_static_view(r);
+        v = &static_view;
+    }
+
+    uint32_t avail = c ?
+        ring_buffer_view_filled_cached(r, v, c, bytes) :
+        ring_buffer_view_filled(r, v);
+    uint32_t peeked = avail < bytes ? avail : bytes;
+
+    ring_buffer_view_get_spans(v, r->read_pos, peeked, spans);
+    return peeked;
+}
+
+void ring_buffer_consume_read(
+    struct ring_buffer* r,
+    uint32_t bytes) {
+    ring_buffer_publish_read(r, bytes);
 }
 
 long ring_buffer_view_write(
     struct ring_buffer* r,
     struct ring_buffer_view* v,
     const void* data, uint32_t step_size, uint32_t steps) {
+    return ring_buffer_view_write_steps(
+        r, v, (const uint8_t*)data, step_size, steps,
+        ring_buffer_view_free(r, v));
+}
+
+long ring_buffer_view_read(
+    struct ring_buffer* r,
+    struct ring_buffer_view* v,
+    void* data, uint32_t step_size, uint32_t steps) {
+    return ring_buffer_view_read_steps(
+        r, v, (uint8_t*)data, step_size, steps,
+        ring_buffer_view_filled(r, v));
+}
+
+uint32_t ring_buffer_available_write_cached(
+    const struct ring_buffer* r,
+    const struct ring_buffer_view* v,
+    struct ring_buffer_index_cache* c) {
+    return ring_buffer_view_free_cached(r, v, c, 1);
+}
+
+uint32_t ring_buffer_available_read_cached(
+    const struct ring_buffer* r,
+    const struct ring_buffer_view* v,
+    struct ring_buffer_index_cache* c) {
+    return ring_buffer_view_filled_cached(r, v, c, 1);
+}
+
+// Bytes needed for |steps| steps, capped so it cannot overflow; anything
+// past the view size cannot fit anyway.
+static inline uint32_t ring_buffer_steps_bytes(
+    const struct ring_buffer_view* v, uint32_t step_size, uint32_t steps) {
+    uint64_t bytes = (uint64_t)step_size * steps;
+    return bytes > v->size ? v->size : (uint32_t)bytes;
+}
+
+long ring_buffer_view_write_cached(
+    struct ring_buffer* r,
+    struct ring_buffer_view* v,
+    struct ring_buffer_index_cache* c,
+    const void* data, uint32_t step_size, uint32_t steps) {
+    return ring_buffer_view_write_steps(
+        r, v, (const uint8_t*)data, step_size, steps,
+        ring_buffer_view_free_cached(
+            r, v, c, ring_buffer_steps_bytes(v, step_size, steps)));
+}
+
+long ring_buffer_view_read_cached(
+    struct ring_buffer* r,
+    struct ring_buffer_view* v,
+    struct ring_buffer_index_cache* c,
+    void* data, uint32_t step_size, uint32_t steps) {
+    return ring_buffer_view_read_steps(
+        r, v, (uint8_t*)data, step_size, steps,
+        ring_buffer_view_filled_cached(
+            r, v, c, ring_buffer_steps_bytes(v, step_size, steps)));
+}
+
+long ring_buffer_writev(
+    struct ring_buffer* r,
+    struct ring_buffer_view* v,
+    const struct ring_buffer_iovec* iov,
+    uint32_t iovcnt) {
+    struct ring_buffer_view static_view;
+    if (!v) {
+        static_view = ring_buffer_static_view(r);
+        v = &static_view;
+    }
 
-    uint8_t* data_bytes = (uint8_t*)data;
+    uint32_t avail = ring_buffer_view_free(r, v);
+    uint32_t used = 0;
     uint32_t i;
 
-    for (i = 0; i < steps; ++i) {
-        if (!ring_buffer_view_can_write(r, v, step_size)) {
-            errno = -EAGAIN;
-            return (long)i;
-        }
+    for (i = 0; i < iovcnt; ++i) {
+        if (iov[i].len > avail - used) break;
+        ring_buffer_view_copy_in(
+            v, r->write_pos + used, (const uint8_t*)iov[i].base, iov[i].len);
+        used += iov[i].len;
+    }
 
-        // Needs to be split up into 2 writes for the edge case.
-        uint32_t available_at_end =
-            v->size - ring_buffer_view_get_ring_pos(v, r->write_pos);
-
-        if (step_size > available_at_end) {
-            uint32_t remaining = step_size - available_at_end;
-            memcpy(
-                &v->buf[ring_buffer_view_get_ring_pos(v, r->write_pos)],
-                data_bytes + i * step_size,
-                available_at_end);
-            memcpy(
-                &v->buf[ring_buffer_view_get_ring_pos(v, r->write_pos + available_at_end)],
-                data_bytes + i * step_size + available_at_end,
-                remaining);
-        } else {
-            memcpy(
-                &v->buf[ring_buffer_view_get_ring_pos(v, r->write_pos)],
-                data_bytes + i * step_size,
-                step_size);
-        }
+    if (used) {
+        ring_buffer_publish_write(r, used);
+    }
 
-        __atomic_add_fetch(&r->write_pos, step_size, __ATOMIC_SEQ_CST);
+    errno = i < iovcnt ? -EAGAIN : 0;
+    return (long)i;
+}
+
+long ring_buffer_readv(
+    struct ring_buffer* r,
+    struct ring_buffer_view* v,
+    const struct ring_buffer_iovec* iov,
+    uint32_t iovcnt) {
+    struct ring_buffer_view static_view;
+    if (!v) {
+        static_view = ring_buffer_static_view(r);
+        v = &static_view;
     }
 
-    errno = 0;
-    return (long)steps;
+    uint32_t avail = ring_buffer_view_filled(r, v);
+    uint32_t used = 0;
+    uint32_t i;
 
+    for (i = 0; i < iovcnt; ++i) {
+        if (iov[i].len > avail - used) break;
+        ring_buffer_view_copy_out(
+            v, r->read_pos + used, (uint8_t*)iov[i].base, iov[i].len);
+        used += iov[i].len;
+    }
+
+    if (used) {
+        ring_buffer_publish_read(r, used);
+    }
+
+    errno = i < iovcnt ? -EAGAIN : 0;
+    return (long)i;
 }
 
-long ring_buffer_view_read(
+static inline uint32_t ring_buffer_record_total(uint32_t len) {
+    return sizeof(uint32_t) + ((len + 3) & ~3u);
+}
+
+// Bytes to skip before a record of |total| bytes at ring index |index|, so
+// that it does not wrap.
+static inline uint32_t ring_buffer_record_pad(
+    const struct ring_buffer_view* v, uint32_t index, uint32_t total) {
+    if (v->flags & RING_BUFFER_VIEW_DOUBLE_MAPPED) return 0;
+    uint32_t available_at_end = v->size - ring_buffer_view_get_ring_pos(v, index);
+    return available_at_end < total ? available_at_end : 0;
+}
+
+static inline uint32_t ring_buffer_record_header(
+    const struct ring_buffer_view* v, uint32_t index) {
+    uint32_t header;
+    memcpy(&header, &v->buf[ring_buffer_view_get_ring_pos(v, index)], sizeof(header));
+    return header;
+}
+
+uint32_t ring_buffer_view_max_record_size(const struct ring_buffer_view* v) {
+    // Keeping records to half the ring means that a record plus the padding
+    // in front of it (which is always smaller than the record) always fits
+    // in an empty ring.
+    uint32_t size = v ? v->size : RING_BUFFER_SIZE;
+    return size / 2 - sizeof(uint32_t);
+}
+
+long ring_buffer_view_write_records(
     struct ring_buffer* r,
     struct ring_buffer_view* v,
-    void* data, uint32_t step_size, uint32_t steps) {
-    uint8_t* data_bytes = (uint8_t*)data;
+    const struct ring_buffer_iovec* records,
+    uint32_t count) {
+    struct ring_buffer_view static_view;
+    if (!v) {
+        static_view = ring_buffer_static_view(r);
+        v = &static_view;
+    }
+
+    uint32_t max_record_size = ring_buffer_view_max_record_size(v);
+    uint32_t avail = ring_buffer_view_free(r, v);
+    uint32_t index = r->write_pos;
+    int err = 0;
     uint32_t i;
 
-    for (i = 0; i < steps; ++i) {
-        if (!ring_buffer_view_can_read(r, v, step_size)) {
-            errno = -EAGAIN;
-            return (long)i;
+    for (i = 0; i < count; ++i) {
+        uint32_t len = records[i].len;
+        if (len > max_record_size) {
+            err = -EMSGSIZE;
+            break;
         }
 
-        // Needs to be split up into 2 reads for the edge case.
-        uint32_t available_at_end =
-            v->size - ring_buffer_view_get_ring_pos(v, r->read_pos);
-
-        if (step_size > available_at_end) {
-            uint32_t remaining = step_size - available_at_end;
-            memcpy(
-                data_bytes + i * step_size,
-                &v->buf[ring_buffer_view_get_ring_pos(v, r->read_pos)],
-                available_at_end);
-            memcpy(
-                data_bytes + i * step_size + available_at_end,
-                &v->buf[ring_buffer_view_get_ring_pos(v, r->read_pos + available_at_end)],
-                remaining);
-        } else {
-            memcpy(data_bytes + i * step_size,
-                   &v->buf[ring_buffer_view_get_ring_pos(v, r->read_pos)],
-                   step_size);
+        uint32_t total = ring_buffer_record_total(len);
+        uint32_t pad = ring_buffer_record_pad(v, index, total);
+        if (pad + total > avail) {
+            err = -EAGAIN;
+            break;
         }
-        __atomic_add_fetch(&r->read_pos, step_size, __ATOMIC_SEQ_CST);
+
+        if (pad) {
+            uint32_t marker = RING_BUFFER_RECORD_PAD;
+            ring_buffer_view_copy_in(v, index, (const uint8_t*)&marker, sizeof(marker));
+            index += pad;
+        }
+
+        ring_buffer_view_copy_in(v, index, (const uint8_t*)&len, sizeof(len));
+        ring_buffer_view_copy_in(
+            v, index + sizeof(len), (const uint8_t*)records[i].base, len);
+        index += total;
+        avail -= pad + total;
+    }
+
+    if (index != r->write_pos) {
+        ring_buffer_publish_write(r, index - r->write_pos);
+    }
+
+    errno = err;
+    return (long)i;
+}
+
+// Walks the readable records from read_pos, calling |visit(index, len)| with
+// the ring index of each payload until it returns false or there are no more
+// records. Returns the number of records visited and sets |bytes| to the size
+// they (and any padding before them) take up in the ring.
+template <class Visit>
+static uint32_t ring_buffer_view_walk_records(
+    struct ring_buffer* r,
+    const struct ring_buffer_view* v,
+    uint32_t count,
+    uint32_t* bytes,
+    Visit visit) {
+    uint32_t avail = ring_buffer_view_filled(r, v);
+    uint32_t index = r->read_pos;
+    uint32_t i = 0;
+
+    // Whole records are published at once, so a header that is readable
+    // means that its payload (or, for padding, the record after it) is too.
+    while (i < count && avail >= sizeof(uint32_t)) {
+        uint32_t header = ring_buffer_record_header(v, index);
+        if (header == RING_BUFFER_RECORD_PAD) {
+            uint32_t pad = v->size - ring_buffer_view_get_ring_pos(v, index);
+            index += pad;
+            avail -= pad;
+            continue;
+        }
+
+        if (!visit(i, index + sizeof(uint32_t), header)) break;
+
+        uint32_t total = ring_buffer_record_total(header);
+        index += total;
+        avail -= total;
+        ++i;
+    }
+
+    *bytes = index - r->read_pos;
+    return i;
+}
+
+long ring_buffer_view_read_records(
+    struct ring_buffer* r,
+    struct ring_buffer_view* v,
+    struct ring_buffer_iovec* records,
+    uint32_t count) {
+    struct ring_buffer_view static_view;
+    if (!v) {
+        static_view = ring_buffer_static_view(r);
+        v = &static_view;
     }
 
-    errno = 0;
-    return (long)steps;
+    int err = -EAGAIN;
+    uint32_t bytes;
+    uint32_t read = ring_buffer_view_walk_records(r, v, count, &bytes,
+        [v, records, &err](uint32_t i, uint32_t index, uint32_t len) {
+            if (len > records[i].len) {
+                err = -ENOBUFS;
+                return false;
+            }
+            ring_buffer_view_copy_out(v, index, (uint8_t*)records[i].base, len);
+            records[i].len = len;
+            return true;
+        });
+
+    if (bytes) {
+        ring_buffer_publish_read(r, bytes);
+    }
+
+    errno = read < count ? err : 0;
+    return (long)read;
+}
+
+long ring_buffer_view_peek_records(
+    struct ring_buffer* r,
+    struct ring_buffer_view* v,
+    struct ring_buffer_iovec* records,
+    uint32_t count,
+    uint32_t* bytes) {
+    struct ring_buffer_view static_view;
+    if (!v) {
+        static_view = ring_buffer_static_view(r);
+        v = &static_view;
+    }
+
+    return (long)ring_buffer_view_walk_records(r, v, count, bytes,
+        [v, records](uint32_t i, uint32_t index, uint32_t len) {
+            records[i].base = &v->buf[ring_buffer_view_get_ring_pos(v, index)];
+            records[i].len = len;
+            return true;
+        });
 }
 
 void ring_buffer_yield() { }
 
-bool ring_buffer_wait_write(
+void ring_buffer_wake_index(const uint32_t* pos) {
+    ring_buffer_futex_wake(pos);
+}
+
+void ring_buffer_wait_policy_init(struct ring_buffer_wait_policy* p) {
+    p->spin_budget = RING_BUFFER_WAIT_SPINS;
+    p->min_spins = RING_BUFFER_WAIT_MIN_SPINS;
+    p->max_spins = RING_BUFFER_WAIT_MAX_SPINS;
+    p->yields = RING_BUFFER_WAIT_YIELDS;
+    p->max_sleep_us = RING_BUFFER_WAIT_SLEEP_US;
+    p->tune = 0;
+    p->tune_opaque = 0;
+}
+
+// Policies used by ring_buffer_wait_read/wait_write. They are per thread, as
+// the budget they learn is about how fast the peer of this thread responds.
+static thread_local struct ring_buffer_wait_policy s_read_policy;
+static thread_local struct ring_buffer_wait_policy s_write_policy;
+static thread_local bool s_default_policies_init = false;
+
+static void ring_buffer_init_default_policies() {
+    if (s_default_policies_init) return;
+    ring_buffer_wait_policy_init(&s_read_policy);
+    ring_buffer_wait_policy_init(&s_write_policy);
+    s_default_policies_init = true;
+}
+
+static void ring_buffer_thread_yield() {
+#ifdef _WIN32
+    SwitchToThread();
+#else
+    sched_yield();
+#endif
+}
+
+uint64_t ring_buffer_monotonic_ns() {
+#ifdef _WIN32
+    static LARGE_INTEGER freq = []() {
+        LARGE_INTEGER f;
+        QueryPerformanceFrequency(&f);
+        return f;
+    }();
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return (uint64_t)((double)now.QuadPart * 1e9 / (double)freq.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+uint64_t ring_buffer_deadline_after_ns(uint64_t timeout_ns) {
+    if (timeout_ns == RING_BUFFER_NO_DEADLINE) return RING_BUFFER_NO_DEADLINE;
+    uint64_t now = ring_buffer_monotonic_ns();
+    return timeout_ns > RING_BUFFER_NO_DEADLINE - now ?
+        RING_BUFFER_NO_DEADLINE : now + timeout_ns;
+}
+
+// The builtin tuning is the adaptive-mutex scheme from glibc: move the budget
+// an eighth of the way towards what this wait says would have been right.
+// Unlike a mutex, a wait that had to sleep means spinning was wasted, so that
+// pulls the budget down; a wait satisfied within the spin window aims for
+// twice the spins it took, and one satisfied while yielding means the peer
+// was just out of reach, so the budget is allowed to double.
+static uint32_t ring_buffer_wait_policy_target(
+    const struct ring_buffer_wait_policy* p,
+    const struct ring_buffer_wait_sample* sample) {
+    if (sample->sleep_us) return p->min_spins;
+    if (sample->yields) return p->spin_budget * 2;
+    return sample->spins * 2;
+}
+
+static void ring_buffer_wait_policy_update(
+    struct ring_buffer_wait_policy* p,
+    const struct ring_buffer_wait_sample* sample) {
+    uint32_t next;
+    if (p->tune) {
+        next = p->tune(p->tune_opaque, p, sample);
+    } else {
+        int64_t budget = p->spin_budget;
+        int64_t target = ring_buffer_wait_policy_target(p, sample);
+        next = (uint32_t)(budget + (target - budget) / 8);
+    }
+    if (next < p->min_spins) next = p->min_spins;
+    if (next > p->max_spins) next = p->max_spins;
+    p->spin_budget = next;
+}
+
+// Waits until |ready| returns true or |deadline_ns| passes, escalating from
+// spinning to yielding to sleeping on |pos| as |p| dictates. |waiters| is set
+// while we may be asleep so that the side publishing |pos| knows to wake us
+// up. Records what the wait took in |sample| and feeds it back into |p|.
+// Returns false on timeout.
+//
+// The spin phase is bounded by the policy, so the clock is only consulted
+// once it is over.
+template <class Ready>
+static bool ring_buffer_wait_on(
+    const uint32_t* pos, uint32_t* waiters, Ready ready,
+    struct ring_buffer_wait_policy* p,
+    struct ring_buffer_wait_sample* sample,
+    uint64_t deadline_ns) {
+    sample->spins = 0;
+    sample->yields = 0;
+    sample->sleep_us = 0;
+
+    bool ok = true;
+    while (!ready()) {
+        if (sample->spins < p->spin_budget) {
+            ring_buffer_pause();
+            ++sample->spins;
+            continue;
+        }
+
+        if (ring_buffer_monotonic_ns() >= deadline_ns) {
+            ok = false;
+            break;
+        }
+
+        if (sample->yields < p->yields) {
+            ring_buffer_thread_yield();
+            ++sample->yields;
+            continue;
+        }
+
+        uint64_t sleep_start = ring_buffer_monotonic_ns();
+        uint64_t now = sleep_start;
+        while (true) {
+            uint32_t seen = __atomic_load_n(pos, __ATOMIC_ACQUIRE);
+            if (ready()) break;
+
+            if (now >= deadline_ns) {
+                ok = false;
+                break;
+            }
+
+            uint64_t sleep_us = p->max_sleep_us;
+            if ((deadline_ns - now) / 1000 < sleep_us) {
+                sleep_us = (deadline_ns - now + 999) / 1000;
+            }
+
+            __atomic_store_n(waiters, 1, __ATOMIC_RELAXED);
+            // Order the waiters store before re-checking |pos|; pairs with the
+            // publish followed by the waiters check on the other side.
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (__atomic_load_n(pos, __ATOMIC_ACQUIRE) == seen) {
+                ring_buffer_futex_wait(pos, seen, (uint32_t)sleep_us);
+            }
+            __atomic_store_n(waiters, 0, __ATOMIC_RELAXED);
+            now = ring_buffer_monotonic_ns();
+        }
+        // Never report a sleep as zero, or it would count as a live wait.
+        uint64_t slept = (ring_buffer_monotonic_ns() - sleep_start) / 1000;
+        sample->sleep_us = slept ? (uint32_t)slept : 1;
+        break;
+    }
+
+    ring_buffer_wait_policy_update(p, sample);
+    if (!ok) errno = -ETIMEDOUT;
+    return ok;
+}
+
+bool ring_buffer_wait_write_with_policy(
     const struct ring_buffer* r,
     const struct ring_buffer_view* v,
-    uint32_t bytes) {
-
-    bool can_write =
-        v ? ring_buffer_view_can_write(r, v, bytes) :
-            ring_buffer_can_write(r, bytes);
+    uint32_t bytes,
+    struct ring_buffer_wait_policy* p,
+    uint64_t deadline_ns) {
+
+    struct ring_buffer* mr = (struct ring_buffer*)r;
+    struct ring_buffer_wait_sample sample;
+    return ring_buffer_wait_on(&r->read_pos, &mr->read_waiters, [r, v, bytes]() {
+        return v ? ring_buffer_view_can_write(r, v, bytes) :
+                   ring_buffer_can_write(r, bytes);
+    }, p, &sample, deadline_ns);
+}
 
-    while (!can_write) {
-        ring_buffer_yield();
-        can_write =
-            v ? ring_buffer_view_can_write(r, v, bytes) :
-                ring_buffer_can_write(r, bytes);
+bool ring_buffer_wait_read_with_policy(
+    const struct ring_buffer* r,
+    const struct ring_buffer_view* v,
+    uint32_t bytes,
+    struct ring_buffer_wait_policy* p,
+    uint64_t deadline_ns) {
+
+    struct ring_buffer* mr = (struct ring_buffer*)r;
+    struct ring_buffer_wait_sample sample;
+    bool ok = ring_buffer_wait_on(&r->write_pos, &mr->write_waiters, [r, v, bytes]() {
+        return v ? ring_buffer_view_can_read(r, v, bytes) :
+                   ring_buffer_can_read(r, bytes);
+    }, p, &sample, deadline_ns);
+
+    // The read_* counters belong to the consumer, which is the only writer.
+    if (!sample.sleep_us) {
+        __atomic_store_n(&mr->read_live_count,
+                         mr->read_live_count + 1, __ATOMIC_RELAXED);
     }
+    __atomic_store_n(&mr->read_yield_count,
+                     mr->read_yield_count + sample.yields, __ATOMIC_RELAXED);
+    __atomic_store_n(&mr->read_sleep_us_count,
+                     mr->read_sleep_us_count + sample.sleep_us, __ATOMIC_RELAXED);
+    return ok;
+}
 
-    return true;
+bool ring_buffer_wait_write_until(
+    const struct ring_buffer* r,
+    const struct ring_buffer_view* v,
+    uint32_t bytes,
+    uint64_t deadline_ns) {
+    ring_buffer_init_default_policies();
+    return ring_buffer_wait_write_with_policy(
+        r, v, bytes, &s_write_policy, deadline_ns);
+}
+
+bool ring_buffer_wait_read_until(
+    const struct ring_buffer* r,
+    const struct ring_buffer_view* v,
+    uint32_t bytes,
+    uint64_t deadline_ns) {
+    ring_buffer_init_default_policies();
+    return ring_buffer_wait_read_with_policy(
+        r, v, bytes, &s_read_policy, deadline_ns);
+}
+
+bool ring_buffer_wait_write(
+    const struct ring_buffer* r,
+    const struct ring_buffer_view* v,
+    uint32_t bytes) {
+    return ring_buffer_wait_write_until(r, v, bytes, RING_BUFFER_NO_DEADLINE);
 }
 
 bool ring_buffer_wait_read(
     const struct ring_buffer* r,
     const struct ring_buffer_view* v,
     uint32_t bytes) {
+    return ring_buffer_wait_read_until(r, v, bytes, RING_BUFFER_NO_DEADLINE);
+}
+
+static uint32_t ring_buffer_mpsc_slot_size(uint32_t payload_size) {
+    uint32_t slot_size = 1;
+    while (slot_size < payload_size + sizeof(uint32_t)) {
+        slot_size <<= 1;
+    }
+    return slot_size;
+}
+
+// Slot |pos| of an MPSC ring: the sequence number, then the payload.
+static inline uint32_t* ring_buffer_mpsc_slot(
+    struct ring_buffer* r, uint32_t slot_size, uint32_t pos) {
+    return (uint32_t*)&r->buf[(pos * slot_size) & RING_BUFFER_MASK];
+}
+
+uint32_t ring_buffer_mpsc_init(struct ring_buffer* r, uint32_t payload_size) {
+    uint32_t slot_size = ring_buffer_mpsc_slot_size(payload_size);
+    if (slot_size > RING_BUFFER_SIZE) return 0;
+
+    // A slot whose sequence number equals a producer's claimed position is
+    // free for that producer to fill.
+    uint32_t slots = RING_BUFFER_SIZE / slot_size;
+    for (uint32_t i = 0; i < slots; ++i) {
+        __atomic_store_n(
+            ring_buffer_mpsc_slot(r, slot_size, i), i, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&r->read_pos, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&r->write_pos, 0, __ATOMIC_RELEASE);
+    return slots;
+}
+
+bool ring_buffer_mpsc_try_enqueue(
+    struct ring_buffer* r, uint32_t payload_size, const void* payload) {
+    uint32_t slot_size = ring_buffer_mpsc_slot_size(payload_size);
+    uint32_t pos = __atomic_load_n(&r->write_pos, __ATOMIC_RELAXED);
+    uint32_t* slot;
+
+    while (true) {
+        slot = ring_buffer_mpsc_slot(r, slot_size, pos);
+        uint32_t seq = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+        int32_t diff = (int32_t)(seq - pos);
+        if (diff == 0) {
+            // Free; claim it. On failure |pos| is reloaded for us.
+            if (__atomic_compare_exchange_n(
+                    &r->write_pos, &pos, pos + 1, true /* weak */,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // Still holds the entry from one lap ago: full.
+            return false;
+        } else {
+            // Another producer claimed it first.
+            pos = __atomic_load_n(&r->write_pos, __ATOMIC_RELAXED);
+        }
+    }
 
-    bool can_read =
-        v ? ring_buffer_view_can_read(r, v, bytes) :
-            ring_buffer_can_read(r, bytes);
+    memcpy(slot + 1, payload, payload_size);
+    __atomic_store_n(slot, pos + 1, __ATOMIC_RELEASE);
 
-    while (!can_read) {
-        ring_buffer_yield();
-        can_read =
-            v ? ring_buffer_view_can_read(r, v, bytes) :
-                ring_buffer_can_read(r, bytes);
+    // As in ring_buffer_publish_write.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->write_waiters, __ATOMIC_RELAXED)) {
+        ring_buffer_futex_wake(&r->write_pos);
     }
+    return true;
+}
+
+bool ring_buffer_mpsc_try_dequeue(
+    struct ring_buffer* r, uint32_t payload_size, void* payload) {
+    uint32_t slot_size = ring_buffer_mpsc_slot_size(payload_size);
+    uint32_t pos = ring_buffer_load_own(&r->read_pos);
+    uint32_t* slot = ring_buffer_mpsc_slot(r, slot_size, pos);
 
-    ((struct ring_buffer*)r)->read_live_count++;
+    if (__atomic_load_n(slot, __ATOMIC_ACQUIRE) != pos + 1) {
+        return false;
+    }
+
+    memcpy(payload, slot + 1, payload_size);
+    // Hand the slot to whichever producer claims it on the next lap.
+    __atomic_store_n(slot, pos + RING_BUFFER_SIZE / slot_size, __ATOMIC_RELEASE);
+    __atomic_store_n(&r->read_pos, pos + 1, __ATOMIC_RELAXED);
     return true;
 }
 
+void ring_buffer_mpsc_dequeue(
+    struct ring_buffer* r, uint32_t payload_size, void* payload) {
+    ring_buffer_init_default_policies();
+    struct ring_buffer_wait_sample sample;
+    ring_buffer_wait_on(&r->write_pos, &r->write_waiters,
+        [r, payload_size, payload]() {
+            return ring_buffer_mpsc_try_dequeue(r, payload_size, payload);
+        }, &s_read_policy, &sample, RING_BUFFER_NO_DEADLINE);
+}
+
 static uint32_t get_step_size(
     struct ring_buffer_view* v,
     uint32_t bytes) {
@@ -556,8 +1368,35 @@ uint32_t ring_buffer_read_fully_with_abort(
     return processed;
 }
 
+// State changes are rare, so unlike index publishes they afford a full fence
+// before checking for sleepers, which makes their wakeups exact.
+static void ring_buffer_state_changed(struct ring_buffer* r) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->state_waiters, __ATOMIC_RELAXED)) {
+        ring_buffer_futex_wake(&r->state);
+    }
+}
+
+static void ring_buffer_wait_state(struct ring_buffer* r, uint32_t wanted) {
+    for (uint32_t i = 0; i < RING_BUFFER_WAIT_SPINS; ++i) {
+        if (__atomic_load_n(&r->state, __ATOMIC_ACQUIRE) == wanted) return;
+        ring_buffer_pause();
+    }
+
+    __atomic_add_fetch(&r->state_waiters, 1, __ATOMIC_SEQ_CST);
+    uint32_t seen;
+    while ((seen = __atomic_load_n(&r->state, __ATOMIC_ACQUIRE)) != wanted) {
+        ring_buffer_futex_wait(&r->state, seen, RING_BUFFER_WAIT_SLEEP_US);
+    }
+    __atomic_sub_fetch(&r->state_waiters, 1, __ATOMIC_RELAXED);
+}
+
+// The sync state hands the channel back and forth between producer and
+// consumer, so a successful transition acquires whatever the previous owner
+// released and releases our own accesses to the next owner.
 void ring_buffer_sync_init(struct ring_buffer* r) {
-    __atomic_store_n(&r->state, RING_BUFFER_SYNC_PRODUCER_IDLE, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&r->state, RING_BUFFER_SYNC_PRODUCER_IDLE, __ATOMIC_RELEASE);
+    ring_buffer_state_changed(r);
 }
 
 bool ring_buffer_producer_acquire(struct ring_buffer* r) {
@@ -567,8 +1406,9 @@ bool ring_buffer_producer_acquire(struct ring_buffer* r) {
         &expected_idle,
         RING_BUFFER_SYNC_PRODUCER_ACTIVE,
         false /* strong */,
-        __ATOMIC_SEQ_CST,
-        __ATOMIC_SEQ_CST);
+        __ATOMIC_ACQ_REL,
+        __ATOMIC_ACQUIRE);
+    if (success) ring_buffer_state_changed(r);
     return success;
 }
 
@@ -579,20 +1419,19 @@ bool ring_buffer_producer_acquire_from_hangup(struct ring_buffer* r) {
         &expected_hangup,
         RING_BUFFER_SYNC_PRODUCER_ACTIVE,
         false /* strong */,
-        __ATOMIC_SEQ_CST,
-        __ATOMIC_SEQ_CST);
+        __ATOMIC_ACQ_REL,
+        __ATOMIC_ACQUIRE);
+    if (success) ring_buffer_state_changed(r);
     return success;
 }
 
 void ring_buffer_producer_wait_hangup(struct ring_buffer* r) {
-    while (__atomic_load_n(&r->state, __ATOMIC_SEQ_CST) !=
-           RING_BUFFER_SYNC_CONSUMER_HUNG_UP) {
-        ring_buffer_yield();
-    }
+    ring_buffer_wait_state(r, RING_BUFFER_SYNC_CONSUMER_HUNG_UP);
 }
 
 void ring_buffer_producer_idle(struct ring_buffer* r) {
-    __atomic_store_n(&r->state, RING_BUFFER_SYNC_PRODUCER_IDLE, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&r->state, RING_BUFFER_SYNC_PRODUCER_IDLE, __ATOMIC_RELEASE);
+    ring_buffer_state_changed(r);
 }
 
 bool ring_buffer_consumer_hangup(struct ring_buffer* r) {
@@ -602,18 +1441,17 @@ bool ring_buffer_consumer_hangup(struct ring_buffer* r) {
         &expected_idle,
         RING_BUFFER_SYNC_CONSUMER_HANGING_UP,
         false /* strong */,
-        __ATOMIC_SEQ_CST,
-        __ATOMIC_SEQ_CST);
+        __ATOMIC_ACQ_REL,
+        __ATOMIC_ACQUIRE);
+    if (success) ring_buffer_state_changed(r);
     return success;
 }
 
 void ring_buffer_consumer_wait_producer_idle(struct ring_buffer* r) {
-    while (__atomic_load_n(&r->state, __ATOMIC_SEQ_CST) !=
-           RING_BUFFER_SYNC_PRODUCER_IDLE) {
-        ring_buffer_yield();
-    }
+    ring_buffer_wait_state(r, RING_BUFFER_SYNC_PRODUCER_IDLE);
 }
 
 void ring_buffer_consumer_hung_up(struct ring_buffer* r) {
-    __atomic_store_n(&r->state, RING_BUFFER_SYNC_CONSUMER_HUNG_UP, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&r->state, RING_BUFFER_SYNC_CONSUMER_HUNG_UP, __ATOMIC_RELEASE);
+    ring_buffer_state_changed(r);
 }
@@ -26,24 +26,30 @@ struct ring_buffer {
     uint32_t host_version;
     uint32_t guest_version;
     uint32_t write_pos; // Atomically updated for the consumer
-    uint32_t unused0[13]; // Separate cache line
+    uint32_t write_waiters; // Nonzero if the consumer may be asleep on write_pos
+    uint32_t unused0[12]; // Separate cache line
     uint32_t read_pos; // Atomically updated for the producer
     uint32_t read_live_count;
     uint32_t read_yield_count;
     uint32_t read_sleep_us_count;
-    uint32_t unused1[12]; // Separate cache line
+    uint32_t read_waiters; // Nonzero if the producer may be asleep on read_pos
+    uint32_t unused1[11]; // Separate cache line
     uint8_t buf[RING_BUFFER_SIZE];
     uint32_t state; // An atomically updated variable from both
                     // producer and consumer for other forms of
                     // coordination.
     // Configuration fields
     uint32_t config[NUM_CONFIG_FIELDS];
+    // Number of threads that may be asleep on state. Kept past config, away
+    // from write_pos, as waiting on state bumps it.
+    uint32_t state_waiters;
 };
 
 void ring_buffer_init(struct ring_buffer* r);
 
 // Writes or reads step_size at a time. Sets errno=EAGAIN if full or empty.
-// Returns the number of step_size steps read.
+// Returns the number of step_size steps read. All steps that fit are
+// published to the other side with a single index update.
 long ring_buffer_write(
     struct ring_buffer* r, const void* data, uint32_t step_size, uint32_t steps);
 long ring_buffer_read(
@@ -64,8 +70,18 @@ struct ring_buffer_view {
     uint8_t* buf;
     uint32_t size;
     uint32_t mask;
+    uint32_t flags; // RING_BUFFER_VIEW_* below
+    // Copies into the view of at least this many bytes use streaming stores
+    // (see ring_buffer_copy.h); 0, as initialized, for the process default.
+    // Set by the view's producer, like flags.
+    uint32_t nt_threshold;
 };
 
+// |buf| is followed by a second mapping of the same |size| bytes (see
+// ring_buffer_double_map_fd), so any range of up to |size| bytes starting in
+// the buffer is contiguous and never needs to be split at the wrap point.
+#define RING_BUFFER_VIEW_DOUBLE_MAPPED (1 << 0)
+
 // Convenience struct that holds a pointer to a ring along with a view.  It's a
 // common pattern for the ring and the buffer of the view to be shared between
 // two entities (in this case, usually guest and host).
@@ -92,6 +108,26 @@ void ring_buffer_init_view_only(
     uint8_t* buf,
     uint32_t size);
 
+// Double-mapped buffers (Linux only).
+//
+// ring_buffer_double_map_fd maps |size| bytes of |fd| at |offset| twice, back
+// to back, and returns the start of the first mapping; writes through either
+// half show up in both. |size| must be a power of two and a multiple of the
+// page size, and |offset| page aligned. ring_buffer_double_map_create does the
+// same over a new memfd, returned in |fd_out| if that is not null (otherwise
+// it is closed, and the mapping keeps the memory alive).
+//
+// The result is used like any other view buffer, along with setting
+// RING_BUFFER_VIEW_DOUBLE_MAPPED in the view's flags once it is initialized.
+// Both return null and set errno on failure.
+//
+// Only the ring_buffer_view_* functions act on the flag. Nothing in asg maps
+// its buffers this way yet: the xfer buffer of an asg_context is wherever
+// SharedRegion or the guest driver put it, mapped once.
+uint8_t* ring_buffer_double_map_fd(int fd, uint64_t offset, uint32_t size);
+uint8_t* ring_buffer_double_map_create(uint32_t size, int* fd_out);
+void ring_buffer_double_unmap(uint8_t* buf, uint32_t size);
+
 // Read/write functions with the view.
 long ring_buffer_view_write(
     struct ring_buffer* r,
@@ -102,13 +138,180 @@ long ring_buffer_view_read(
     struct ring_buffer_view* v,
     void* data, uint32_t step_size, uint32_t steps);
 
+// One segment of a scatter/gather transfer.
+struct ring_buffer_iovec {
+    void* base;
+    uint32_t len;
+};
+
+// Writes or reads the segments in |iov| in order, stopping at the first one
+// that does not fit entirely, and publishes everything transferred with a
+// single index update. If |v| is null, the statically allocated ring buffer is
+// used. Sets errno=EAGAIN if not all segments fit. Returns the number of
+// segments transferred.
+long ring_buffer_writev(
+    struct ring_buffer* r,
+    struct ring_buffer_view* v,
+    const struct ring_buffer_iovec* iov,
+    uint32_t iovcnt);
+long ring_buffer_readv(
+    struct ring_buffer* r,
+    struct ring_buffer_view* v,
+    const struct ring_buffer_iovec* iov,
+    uint32_t iovcnt);
+
+// Framed-record mode.
+//
+// Each record is written as a 4-byte length header followed by the payload,
+// padded to a multiple of 4 bytes. A record is never split at the end of the
+// buffer: if it would not fit contiguously, the rest of the buffer is skipped
+// with a RING_BUFFER_RECORD_PAD header and the record starts over at the
+// beginning (double-mapped views never need this). Message boundaries thus
+// come with the data, and a consumer can take a burst of whole records at
+// once, in place if it likes. A ring in record mode must only be used through
+// these functions.
+//
+// ring_buffer_view_write_records writes the records in |records| in order,
+// stopping at the first that does not fit, and publishes them with a single
+// index update. Sets errno=-EAGAIN if not all records fit, or -EMSGSIZE if a
+// record is longer than ring_buffer_view_max_record_size. Returns the number
+// of records written.
+//
+// ring_buffer_view_read_records reads up to |count| records, each into
+// records[i].base, and sets records[i].len to its length; records[i].len is
+// the capacity of the buffer on input. Stops early with errno=-EAGAIN if the
+// ring runs out of records, or -ENOBUFS if the next record does not fit its
+// buffer. Returns the number of records read.
+//
+// ring_buffer_view_peek_records instead points records[i] at up to |count|
+// records in the ring itself, and sets |bytes| to how much to pass to
+// ring_buffer_consume_read once done with them. Returns the number of records.
+//
+// If |v| is null, the statically allocated ring buffer is used.
+#define RING_BUFFER_RECORD_PAD 0xffffffff
+
+uint32_t ring_buffer_view_max_record_size(const struct ring_buffer_view* v);
+long ring_buffer_view_write_records(
+    struct ring_buffer* r,
+    struct ring_buffer_view* v,
+    const struct ring_buffer_iovec* records,
+    uint32_t count);
+long ring_buffer_view_read_records(
+    struct ring_buffer* r,
+    struct ring_buffer_view* v,
+    struct ring_buffer_iovec* records,
+    uint32_t count);
+long ring_buffer_view_peek_records(
+    struct ring_buffer* r,
+    struct ring_buffer_view* v,
+    struct ring_buffer_iovec* records,
+    uint32_t count,
+    uint32_t* bytes);
+
+// Producer- or consumer-local shadow of the index owned by the other side of a
+// view. Since the remote index only ever moves forward, free space (producer)
+// or readable bytes (consumer) computed from a stale copy is an underestimate,
+// so the shared index only needs to be reloaded when the cached copy says the
+// ring is too full or too empty. This keeps the remote side's index cache line
+// from bouncing between cores on every step.
+//
+// Each side keeps its own cache in private memory; it is never shared.
+struct ring_buffer_index_cache {
+    uint32_t remote_pos;
+    uint32_t refreshes; // Number of times the shared remote index was reloaded.
+};
+
+// Initializes |c| for use by the producer (caching read_pos) or the consumer
+// (caching write_pos) of |r|.
+void ring_buffer_producer_cache_init(
+    const struct ring_buffer* r,
+    struct ring_buffer_index_cache* c);
+void ring_buffer_consumer_cache_init(
+    const struct ring_buffer* r,
+    struct ring_buffer_index_cache* c);
+
+// Up to two contiguous regions of a ring's buffer that together cover a range
+// of ring positions. |second| is only used if the range wraps around the end
+// of the buffer, and is null otherwise; it is always null for double-mapped
+// views.
+struct ring_buffer_spans {
+    uint8_t* first;
+    uint32_t first_len;
+    uint8_t* second;
+    uint32_t second_len;
+};
+
+// Zero-copy producer/consumer access.
+//
+// ring_buffer_view_reserve_write describes up to |bytes| of free space at the
+// write position in |spans| for the producer to fill in place, and returns how
+// many bytes were reserved. Nothing becomes visible to the consumer until
+// ring_buffer_commit_write publishes them; |bytes| passed to commit must not
+// exceed what was reserved.
+//
+// ring_buffer_view_peek_read likewise describes up to |bytes| of readable data
+// for the consumer to use in place, and ring_buffer_consume_read hands them
+// back to the producer once the consumer is done with them.
+//
+// If |v| is null, the statically allocated ring buffer is used. If |c| is not
+// null, it is used as in the _cached functions below.
+uint32_t ring_buffer_view_reserve_write(
+    struct ring_buffer* r,
+    struct ring_buffer_view* v,
+    struct ring_buffer_index_cache* c,
+    uint32_t bytes,
+    struct ring_buffer_spans* spans);
+void ring_buffer_commit_write(
+    struct ring_buffer* r,
+    uint32_t bytes);
+uint32_t ring_buffer_view_peek_read(
+    struct ring_buffer* r,
+    struct ring_buffer_view* v,
+    struct ring_buffer_index_cache* c,
+    uint32_t bytes,
+    struct ring_buffer_spans* spans);
+void ring_buffer_consume_read(
+    struct ring_buffer* r,
+    uint32_t bytes);
+
+// Like ring_buffer_available_write / ring_buffer_available_read, but only
+// reload the remote index if the cached one says there is nothing available.
+// The producer may only use the write variant and the consumer the read one.
+uint32_t ring_buffer_available_write_cached(
+    const struct ring_buffer* r,
+    const struct ring_buffer_view* v,
+    struct ring_buffer_index_cache* c);
+uint32_t ring_buffer_available_read_cached(
+    const struct ring_buffer* r,
+    const struct ring_buffer_view* v,
+    struct ring_buffer_index_cache* c);
+
+// Like ring_buffer_view_write / ring_buffer_view_read, but check for space
+// against the cached remote index first.
+long ring_buffer_view_write_cached(
+    struct ring_buffer* r,
+    struct ring_buffer_view* v,
+    struct ring_buffer_index_cache* c,
+    const void* data, uint32_t step_size, uint32_t steps);
+long ring_buffer_view_read_cached(
+    struct ring_buffer* r,
+    struct ring_buffer_view* v,
+    struct ring_buffer_index_cache* c,
+    void* data, uint32_t step_size, uint32_t steps);
+
 // Usage of ring_buffer as a waitable object.
-// These functions will back off if spinning too long.
+// These functions will back off if spinning too long: after a short spin they
+// sleep on the index word itself (a shared futex on Linux, so this works
+// between processes mapping the same ring). The waiter advertises itself in
+// write_waiters / read_waiters so that the other side only makes the wake
+// syscall when somebody may actually be asleep. Sleeps are bounded, so a peer
+// that never issues wakes (e.g. an older implementation) still makes progress.
 //
 // if |v| is null, it is assumed that the statically allocated ring buffer is
 // used.
 //
-// Returns true if ring buffer became available, false if timed out.
+// Returns true if ring buffer became available, false if timed out (only the
+// _until variants time out).
 bool ring_buffer_wait_write(
     const struct ring_buffer* r,
     const struct ring_buffer_view* v,
@@ -118,6 +321,78 @@ bool ring_buffer_wait_read(
     const struct ring_buffer_view* v,
     uint32_t bytes);
 
+// Deadlines are absolute times on the monotonic clock, in nanoseconds, as
+// returned by ring_buffer_monotonic_ns. RING_BUFFER_NO_DEADLINE never
+// passes. ring_buffer_deadline_after_ns gives the deadline |timeout_ns| from
+// now (saturating to RING_BUFFER_NO_DEADLINE).
+#define RING_BUFFER_NO_DEADLINE UINT64_MAX
+uint64_t ring_buffer_monotonic_ns();
+uint64_t ring_buffer_deadline_after_ns(uint64_t timeout_ns);
+
+// Same as ring_buffer_wait_write/wait_read, but give up once |deadline_ns|
+// has passed, returning false with errno=-ETIMEDOUT.
+bool ring_buffer_wait_write_until(
+    const struct ring_buffer* r,
+    const struct ring_buffer_view* v,
+    uint32_t bytes,
+    uint64_t deadline_ns);
+bool ring_buffer_wait_read_until(
+    const struct ring_buffer* r,
+    const struct ring_buffer_view* v,
+    uint32_t bytes,
+    uint64_t deadline_ns);
+
+// Adaptive wait policy for ring_buffer_wait_*.
+//
+// A wait spins for up to |spin_budget| pause iterations, then yields the CPU
+// |yields| times, then sleeps on the ring index (each sleep bounded by
+// |max_sleep_us|) until the ring becomes available. After every wait the spin
+// budget is retuned from what the wait actually took, staying within
+// [min_spins, max_spins]: it grows while the peer tends to respond within or
+// just past the spin window, and decays towards |min_spins| when waits end up
+// sleeping anyway, so an idle peer costs next to no CPU.
+//
+// Waits for reading also accumulate into the ring's read_live_count (waits
+// that did not need to sleep), read_yield_count and read_sleep_us_count.
+struct ring_buffer_wait_sample {
+    uint32_t spins;
+    uint32_t yields;
+    uint32_t sleep_us; // Nonzero iff the wait had to sleep
+};
+
+struct ring_buffer_wait_policy {
+    uint32_t spin_budget;
+    uint32_t min_spins;
+    uint32_t max_spins;
+    uint32_t yields;
+    uint32_t max_sleep_us;
+    // If set, replaces the builtin tuning: called after every wait with what
+    // it took, and returns the next spin budget (clamped to the bounds).
+    uint32_t (*tune)(void* opaque,
+                     const struct ring_buffer_wait_policy* policy,
+                     const struct ring_buffer_wait_sample* sample);
+    void* tune_opaque;
+};
+
+// Sets |p| to the defaults used by ring_buffer_wait_read/wait_write, each of
+// which keeps its own policy per calling thread.
+void ring_buffer_wait_policy_init(struct ring_buffer_wait_policy* p);
+
+// Same as ring_buffer_wait_write_until/wait_read_until, but wait and learn
+// according to |p| rather than the calling thread's default policy.
+bool ring_buffer_wait_write_with_policy(
+    const struct ring_buffer* r,
+    const struct ring_buffer_view* v,
+    uint32_t bytes,
+    struct ring_buffer_wait_policy* p,
+    uint64_t deadline_ns);
+bool ring_buffer_wait_read_with_policy(
+    const struct ring_buffer* r,
+    const struct ring_buffer_view* v,
+    uint32_t bytes,
+    struct ring_buffer_wait_policy* p,
+    uint64_t deadline_ns);
+
 // read/write fully, blocking if there is nothing to read/write.
 void ring_buffer_write_fully(
     struct ring_buffer* r,
@@ -182,6 +457,45 @@ int ring_buffer_copy_contents(
     uint32_t wanted_bytes,
     uint8_t* res);
 
+// Multi-producer / single-consumer mode.
+//
+// The ring's buffer is used as an array of fixed-size slots, each holding a
+// sequence number followed by a |payload_size|-byte entry (e.g. an
+// asg_type1_xfer descriptor). Any number of producer threads may enqueue
+// concurrently without locks: they claim slots by bumping write_pos with a
+// compare-and-swap, and each slot's sequence number tells the (single)
+// consumer when that particular slot has been filled, so a slow producer never
+// exposes a half-written entry and never blocks the others for longer than it
+// holds its own slot. read_pos tracks the consumer's position.
+//
+// Slots are |payload_size| + 4 bytes rounded up to a power of two, so e.g. an
+// 8-byte descriptor gives RING_BUFFER_SIZE / 16 = 128 slots. The slots live in
+// the ring's own buffer, so that is also the most there can be.
+//
+// No asg ring runs in this mode: to_host is still filled by one RingStream
+// through asg::ring<>, and nothing advertises or negotiates MPSC to the
+// host.
+//
+// Both sides must agree on |payload_size|, and the ring must only be used
+// through these functions once initialized with ring_buffer_mpsc_init.
+// Returns the number of slots, or 0 if a slot does not fit in the ring.
+uint32_t ring_buffer_mpsc_init(struct ring_buffer* r, uint32_t payload_size);
+
+// Copies |payload| into the next free slot. Returns false if the ring is
+// full. Safe to call from multiple threads / processes at once.
+bool ring_buffer_mpsc_try_enqueue(
+    struct ring_buffer* r, uint32_t payload_size, const void* payload);
+
+// Consumer only. Copies the oldest entry into |payload|. Returns false if
+// there is none ready yet.
+bool ring_buffer_mpsc_try_dequeue(
+    struct ring_buffer* r, uint32_t payload_size, void* payload);
+
+// Consumer only. Like ring_buffer_mpsc_try_dequeue, but waits as
+// ring_buffer_wait_read does until an entry is ready.
+void ring_buffer_mpsc_dequeue(
+    struct ring_buffer* r, uint32_t payload_size, void* payload);
+
 // Lockless synchronization where the consumer is allowed to hang up and go to
 // sleep. This can be considered a sort of asymmetric lock for two threads,
 // where the consumer can be more sleepy. It captures the pattern we usually use
@@ -226,3 +540,7 @@ void ring_buffer_consumer_hung_up(struct ring_buffer* r);
 
 // Convenient function to reschedule thread
 void ring_buffer_yield();
+
+// Wakes anybody sleeping in ring_buffer_wait_* on |pos| (r->write_pos or
+// r->read_pos). Only for code that publishes indices itself (base/ring.h).
+void ring_buffer_wake_index(const uint32_t* pos);
@@ -0,0 +1,212 @@
+// Copyright 2020 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "ring_buffer_copy.h"
+
+#include <string.h>
+
+// Streaming kernels need per-function target attributes and
+// __builtin_cpu_supports, so they are only built with GCC / Clang on x86.
+#if (defined(__i386__) || defined(__x86_64__)) && defined(__GNUC__)
+#define RING_BUFFER_COPY_NT 1
+#include <immintrin.h>
+#else
+#define RING_BUFFER_COPY_NT 0
+#endif
+
+static size_t s_nt_threshold = RING_BUFFER_COPY_NT_THRESHOLD_DEFAULT;
+
+#if RING_BUFFER_COPY_NT
+
+// Each kernel copies with plain memcpy up to the first |Align|-aligned
+// destination address, streams whole vectors from there, and finishes the
+// tail with memcpy. Loads are unaligned as the source has no alignment we can
+// rely on.
+#define RING_BUFFER_COPY_HEAD(align) \
+    uint8_t* d = (uint8_t*)dst; \
+    const uint8_t* s = (const uint8_t*)src; \
+    size_t head = (size_t)(-(uintptr_t)d) & ((align) - 1); \
+    if (head > bytes) head = bytes; \
+    memcpy(d, s, head); \
+    d += head; \
+    s += head; \
+    bytes -= head;
+
+#define RING_BUFFER_COPY_TAIL() \
+    memcpy(d, s, bytes); \
+    _mm_sfence();
+
+__attribute__((target("sse2")))
+static void ring_buffer_copy_sse2_nt(void* dst, const void* src, size_t bytes) {
+    RING_BUFFER_COPY_HEAD(16)
+    for (; bytes >= 64; bytes -= 64, d += 64, s += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i*)s);
+        __m128i b = _mm_loadu_si128((const __m128i*)(s + 16));
+        __m128i c = _mm_loadu_si128((const __m128i*)(s + 32));
+        __m128i e = _mm_loadu_si128((const __m128i*)(s + 48));
+        _mm_stream_si128((__m128i*)d, a);
+        _mm_stream_si128((__m128i*)(d + 16), b);
+        _mm_stream_si128((__m128i*)(d + 32), c);
+        _mm_stream_si128((__m128i*)(d + 48), e);
+    }
+    RING_BUFFER_COPY_TAIL()
+}
+
+__attribute__((target("avx2")))
+static void ring_buffer_copy_avx2_nt(void* dst, const void* src, size_t bytes) {
+    RING_BUFFER_COPY_HEAD(32)
+    for (; bytes >= 128; bytes -= 128, d += 128, s += 128) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)s);
+        __m256i b = _mm256_loadu_si256((const __m256i*)(s + 32));
+        __m256i c = _mm256_loadu_si256((const __m256i*)(s + 64));
+        __m256i e = _mm256_loadu_si256((const __m256i*)(s + 96));
+        _mm256_stream_si256((__m256i*)d, a);
+        _mm256_stream_si256((__m256i*)(d + 32), b);
+        _mm256_stream_si256((__m256i*)(d + 64), c);
+        _mm256_stream_si256((__m256i*)(d + 96), e);
+    }
+    RING_BUFFER_COPY_TAIL()
+}
+
+__attribute__((target("avx512f")))
+static void ring_buffer_copy_avx512_nt(void* dst, const void* src, size_t bytes) {
+    RING_BUFFER_COPY_HEAD(64)
+    for (; bytes >= 256; bytes -= 256, d += 256, s += 256) {
+        __m512i a = _mm512_loadu_si512((const void*)s);
+        __m512i b = _mm512_loadu_si512((const void*)(s + 64));
+        __m512i c = _mm512_loadu_si512((const void*)(s + 128));
+        __m512i e = _mm512_loadu_si512((const void*)(s + 192));
+        _mm512_stream_si512((__m512i*)d, a);
+        _mm512_stream_si512((__m512i*)(d + 64), b);
+        _mm512_stream_si512((__m512i*)(d + 128), c);
+        _mm512_stream_si512((__m512i*)(d + 192), e);
+    }
+    RING_BUFFER_COPY_TAIL()
+}
+
+#endif // RING_BUFFER_COPY_NT
+
+static void ring_buffer_copy_memcpy(void* dst, const void* src, size_t bytes) {
+    memcpy(dst, src, bytes);
+}
+
+bool ring_buffer_copy_kernel_supported(enum ring_buffer_copy_kernel kernel) {
+    switch (kernel) {
+        case RING_BUFFER_COPY_MEMCPY:
+            return true;
+#if RING_BUFFER_COPY_NT
+        case RING_BUFFER_COPY_SSE2_NT:
+            return __builtin_cpu_supports("sse2");
+        case RING_BUFFER_COPY_AVX2_NT:
+            return __builtin_cpu_supports("avx2");
+        case RING_BUFFER_COPY_AVX512_NT:
+            return __builtin_cpu_supports("avx512f");
+#endif
+        default:
+            return false;
+    }
+}
+
+static ring_buffer_copy_func ring_buffer_copy_kernel_func(
+    enum ring_buffer_copy_kernel kernel) {
+    if (!ring_buffer_copy_kernel_supported(kernel)) {
+        return ring_buffer_copy_memcpy;
+    }
+
+    switch (kernel) {
+#if RING_BUFFER_COPY_NT
+        case RING_BUFFER_COPY_SSE2_NT:
+            return ring_buffer_copy_sse2_nt;
+        case RING_BUFFER_COPY_AVX2_NT:
+            return ring_buffer_copy_avx2_nt;
+        case RING_BUFFER_COPY_AVX512_NT:
+            return ring_buffer_copy_avx512_nt;
+#endif
+        default:
+            return ring_buffer_copy_memcpy;
+    }
+}
+
+enum ring_buffer_copy_kernel ring_buffer_copy_dispatched_kernel() {
+    static const enum ring_buffer_copy_kernel kernel = []() {
+        if (ring_buffer_copy_kernel_supported(RING_BUFFER_COPY_AVX512_NT)) {
+            return RING_BUFFER_COPY_AVX512_NT;
+        }
+        if (ring_buffer_copy_kernel_supported(RING_BUFFER_COPY_AVX2_NT)) {
+            return RING_BUFFER_COPY_AVX2_NT;
+        }
+        if (ring_buffer_copy_kernel_supported(RING_BUFFER_COPY_SSE2_NT)) {
+            return RING_BUFFER_COPY_SSE2_NT;
+        }
+        return RING_BUFFER_COPY_MEMCPY;
+    }();
+    return kernel;
+}
+
+ring_buffer_copy_func ring_buffer_copy_for_threshold(size_t bytes, size_t nt_threshold) {
+    if (!nt_threshold) {
+        nt_threshold = __atomic_load_n(&s_nt_threshold, __ATOMIC_RELAXED);
+    }
+    if (bytes < nt_threshold) {
+        return ring_buffer_copy_memcpy;
+    }
+
+    static const ring_buffer_copy_func nt_copy =
+        ring_buffer_copy_kernel_func(ring_buffer_copy_dispatched_kernel());
+    return nt_copy;
+}
+
+ring_buffer_copy_func ring_buffer_copy_for(size_t bytes) {
+    return ring_buffer_copy_for_threshold(bytes, 0);
+}
+
+void ring_buffer_copy(void* dst, const void* src, size_t bytes) {
+    ring_buffer_copy_for(bytes)(dst, src, bytes);
+}
+
+size_t ring_buffer_copy_get_nt_threshold() {
+    return __atomic_load_n(&s_nt_threshold, __ATOMIC_RELAXED);
+}
+
+void ring_buffer_copy_set_nt_threshold(size_t bytes) {
+    __atomic_store_n(&s_nt_threshold, bytes, __ATOMIC_RELAXED);
+}
+
+size_t ring_buffer_copy_nt_threshold_for(uint32_t ring_size, uint32_t max_chunk_size) {
+    uint32_t chunk = ring_size / 2;
+    if (max_chunk_size && max_chunk_size < chunk) chunk = max_chunk_size;
+    size_t threshold = chunk / 2;
+    return threshold < RING_BUFFER_COPY_NT_THRESHOLD_MIN ?
+        RING_BUFFER_COPY_NT_THRESHOLD_MIN : threshold;
+}
+
+void ring_buffer_copy_with_kernel(
+    enum ring_buffer_copy_kernel kernel,
+    void* dst, const void* src, size_t bytes) {
+    ring_buffer_copy_kernel_func(kernel)(dst, src, bytes);
+}
+
+const char* ring_buffer_copy_kernel_name(enum ring_buffer_copy_kernel kernel) {
+    switch (kernel) {
+        case RING_BUFFER_COPY_MEMCPY:
+            return "memcpy";
+        case RING_BUFFER_COPY_SSE2_NT:
+            return "sse2-nt";
+        case RING_BUFFER_COPY_AVX2_NT:
+            return "avx2-nt";
+        case RING_BUFFER_COPY_AVX512_NT:
+            return "avx512-nt";
+        default:
+            return "unknown";
+    }
+}
@@ -0,0 +1,90 @@
+// Copyright 2020 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Copy kernels for moving payloads into rings.
+//
+// Small copies are plain memcpy. Copies of at least the non-temporal
+// threshold use streaming stores, picked at runtime from the best of
+// AVX-512, AVX2 and SSE2 the CPU supports, so that large payloads which the
+// other side reads exactly once do not evict everybody's working set from
+// the cache on their way through. Streaming copies are fenced before
+// returning, so it is always safe to publish a ring index right after.
+//
+// Only the producer streams. What the consumer copies out of a ring is about
+// to be used by it, so that is always memcpy, which leaves it in cache.
+
+enum ring_buffer_copy_kernel {
+    RING_BUFFER_COPY_MEMCPY = 0,
+    RING_BUFFER_COPY_SSE2_NT = 1,
+    RING_BUFFER_COPY_AVX2_NT = 2,
+    RING_BUFFER_COPY_AVX512_NT = 3,
+};
+
+// The lowest non-temporal threshold, in bytes. Below this, the data usually
+// still fits in cache and memcpy is faster (see
+// BenchmarkRingBufferCopyKernels for where this sits on a given machine).
+#define RING_BUFFER_COPY_NT_THRESHOLD_MIN (64 * 1024)
+
+// The process default threshold, for rings whose producer has not derived
+// one for its geometry with ring_buffer_copy_nt_threshold_for: that of a
+// 1 MiB ring.
+#define RING_BUFFER_COPY_NT_THRESHOLD_DEFAULT (256 * 1024)
+
+typedef void (*ring_buffer_copy_func)(void* dst, const void* src, size_t bytes);
+
+// Copies |bytes| from |src| into a ring at |dst|, with the dispatched kernel
+// if |bytes| is at least the threshold.
+void ring_buffer_copy(void* dst, const void* src, size_t bytes);
+
+// The kernel ring_buffer_copy picks for a copy of |bytes|. Producers that
+// copy one transfer in pieces, e.g. either side of the wrap, pick once for
+// the whole of it with this.
+ring_buffer_copy_func ring_buffer_copy_for(size_t bytes);
+
+// The same, for a ring with its own threshold |nt_threshold| (e.g. that of
+// its ring_buffer_view), or the process default if it is 0.
+ring_buffer_copy_func ring_buffer_copy_for_threshold(size_t bytes, size_t nt_threshold);
+
+// Gets / sets the process default threshold, the size at and above which
+// ring_buffer_copy uses streaming stores. Setting it to SIZE_MAX disables
+// them. Streams set their own per ring instead, so this is for tests and
+// benchmarks.
+size_t ring_buffer_copy_get_nt_threshold();
+void ring_buffer_copy_set_nt_threshold(size_t bytes);
+
+// The threshold for a producer that copies into a ring of |ring_size| bytes
+// at most |max_chunk_size| bytes at a time (0 for no limit but the ring's,
+// half of it): half the largest chunk, but no less than
+// RING_BUFFER_COPY_NT_THRESHOLD_MIN. A copy that large is a bulk transfer,
+// which the consumer gets to a chunk or more later; anything smaller is a
+// command or the tail of one, which it reads right away.
+size_t ring_buffer_copy_nt_threshold_for(uint32_t ring_size, uint32_t max_chunk_size);
+
+// The streaming kernel ring_buffer_copy dispatches to, or
+// RING_BUFFER_COPY_MEMCPY if the CPU has none.
+enum ring_buffer_copy_kernel ring_buffer_copy_dispatched_kernel();
+
+// Whether |kernel| can run on this CPU, and a way to run a specific one
+// regardless of size, for tests and benchmarks. Running an unsupported
+// kernel falls back to memcpy.
+bool ring_buffer_copy_kernel_supported(enum ring_buffer_copy_kernel kernel);
+void ring_buffer_copy_with_kernel(
+    enum ring_buffer_copy_kernel kernel,
+    void* dst, const void* src, size_t bytes);
+const char* ring_buffer_copy_kernel_name(enum ring_buffer_copy_kernel kernel);
@@ -15,6 +15,9 @@
 */
 #include "asg_ring_stream_client.h"
 
+#include "base/ring.h"
+#include "base/ring_buffer_copy.h"
+
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -28,7 +31,7 @@ static const size_t kFlushInterval = 10000;
 namespace asg {
 namespace client {
 
-RingStream::RingStream(void* sharedRegion, size_t ringXferBufferSize, DoorbellFunc doorbellFunc) :
+RingStream::RingStream(void* sharedRegion, size_t ringXferBufferSize, DoorbellFunc doorbellFunc, uint32_t hostVersion) :
     IOStream(kFlushInterval),
     m_doorbellFunc(doorbellFunc),
     m_tmpBuf(0),
@@ -42,16 +45,36 @@ RingStream::RingStream(void* sharedRegion, size_t ringXferBufferSize, DoorbellFu
     m_writeBufferMask(m_writeBufferSize - 1),
     m_buf(((unsigned char*)sharedRegion) + sizeof(struct asg_ring_storage)),
     m_writeStart(m_buf),
-    m_writeStep(4096),
     m_notifs(0),
     m_written(0),
     m_backoffIters(0),
-    m_backoffFactor(1) {
-
-    m_context = asg_context_create((char*)sharedRegion, (char*)sharedRegion + sizeof(struct asg_ring_storage), ringXferBufferSize);
+    m_backoffFactor(1),
+    m_timeoutNs(0),
+    m_pendingXferBytes(0),
+    m_batchMaxDescriptors(0),
+    m_batchMaxBytes(0),
+    m_usingLargeXfer(false),
+    m_payloadMinSize(0),
+    m_asyncQueued(0),
+    m_asyncCompleted(0),
+    m_asyncFailed(false),
+    m_asyncErrno(0) {
+
+    m_context = asg_context_create_versioned((char*)sharedRegion, (char*)sharedRegion + sizeof(struct asg_ring_storage), ringXferBufferSize, ASG_RING_LAYOUT_LATEST, hostVersion);
+
+    ring_buffer_producer_cache_init(
+        m_context.to_host_large_xfer.ring, &m_toHostLargeXferCache);
+    ring_buffer_consumer_cache_init(
+        m_context.from_host_large_xfer.ring, &m_fromHostLargeXferCache);
 }
 
 RingStream::~RingStream() {
+    drainAsyncWrites();
+    if (m_asyncSubmitter) {
+        m_asyncWrites.stop();
+        m_asyncSubmitter->wait();
+    }
+
     flush();
     ensureType3Finished();
     ensureType1Finished();
@@ -60,21 +83,30 @@ RingStream::~RingStream() {
 }
 
 size_t RingStream::idealAllocSize(size_t len) {
-    if (len > m_writeStep) return len;
-    return m_writeStep;
+    drainAsyncWrites();
+    updateGeometryLimits();
+    size_t step = m_geometry.stepSize();
+    if (len > step) return len;
+    return step;
 }
 
 void *RingStream::allocBuffer(size_t minSize) {
-    ensureType3Finished();
+    if (drainAsyncWrites() < 0) return nullptr;
+    if (!ensureType3Finished()) return nullptr;
 
-    if (!m_readBuf) {
-        m_readBuf = (unsigned char*)malloc(kReadSize);
-    }
+    // A reservation that was never committed is simply dropped.
+    m_usingLargeXfer = false;
 
+    size_t step = m_geometry.stepSize();
     size_t allocSize =
-        (m_writeStep < minSize ? minSize : m_writeStep);
+        (step < minSize ? minSize : step);
+
+    if (m_geometry.tmpBufThreshold() < allocSize) {
+        if (!m_usingTmpBuf) {
+            unsigned char* inPlace = reserveLargeXfer(allocSize);
+            if (inPlace) return inPlace;
+        }
 
-    if (m_writeStep < allocSize) {
         if (!m_tmpBuf) {
             m_tmpBufSize = allocSize * 2;
             m_tmpBuf = (unsigned char*)malloc(m_tmpBufSize);
@@ -107,14 +139,18 @@ int RingStream::commitBuffer(size_t size)
 {
     if (size == 0) return 0;
 
-    if (m_usingTmpBuf) {
-        writeFully(m_tmpBuf, size);
+    if (m_usingLargeXfer) {
+        m_usingLargeXfer = false;
+        return commitLargeXfer(size);
+    } else if (m_usingTmpBuf) {
+        int res = writeFully(m_tmpBuf, size);
         m_tmpBufXferSize = 0;
         m_usingTmpBuf = false;
-        return 0;
+        return res;
     } else {
         int res = type1Write(m_writeStart - m_buf, size);
         advanceWrite();
+        m_geometry.onType1Commit(size);
         return res;
     }
 }
@@ -133,69 +169,95 @@ const unsigned char *RingStream::readFully(void *ptr, size_t totalReadSize)
         return nullptr;
     }
 
-    // Advance buffered read if not yet consumed.
-    size_t remaining = totalReadSize;
-    size_t bufferedReadSize =
-        m_readLeft < remaining ? m_readLeft : remaining;
-
-    if (bufferedReadSize) {
-        memcpy(userReadBuf,
-               m_readBuf + (m_read - m_readLeft),
-               bufferedReadSize);
-        remaining -= bufferedReadSize;
-        m_readLeft -= bufferedReadSize;
-    }
-
-    if (!remaining) return userReadBuf;
-
-    // Read up to kReadSize bytes if all buffered read has been consumed.
-    size_t maxRead = m_readLeft ? 0 : kReadSize;
-    ssize_t actual = 0;
-
-    if (maxRead) {
-        actual = speculativeRead(m_readBuf, maxRead);
-
-        // Updated buffered read size.
-        if (actual > 0) {
-            m_read = m_readLeft = actual;
-        }
-
-        if (actual == 0) {
-            // ALOGD("%s: end of pipe", __FUNCTION__);
-            return NULL;
-        }
-    }
+    if (drainAsyncWrites() < 0) return nullptr;
+    if (submitType1Batch() < 0) return nullptr;
 
-    // Consume buffered read and read more if necessary.
+    size_t remaining = totalReadSize;
     while (remaining) {
-        bufferedReadSize = m_readLeft < remaining ? m_readLeft : remaining;
-        if (bufferedReadSize) {
-            memcpy(userReadBuf + (totalReadSize - remaining),
-                   m_readBuf + (m_read - m_readLeft),
-                   bufferedReadSize);
+        unsigned char* dst = userReadBuf + (totalReadSize - remaining);
+
+        // Consume buffered read first.
+        if (m_readLeft) {
+            size_t bufferedReadSize =
+                m_readLeft < remaining ? m_readLeft : remaining;
+            memcpy(dst, m_readBuf + (m_read - m_readLeft), bufferedReadSize);
             remaining -= bufferedReadSize;
             m_readLeft -= bufferedReadSize;
             continue;
         }
 
-        actual = speculativeRead(m_readBuf, kReadSize);
+        // If we want all there is, read it straight into |userReadBuf|.
+        // Only a reply that goes on past what we want is read ahead into
+        // m_readBuf, to spare the ring updates of the small reads that
+        // usually follow.
+        uint32_t readAvail =
+            ring_buffer_available_read_cached(
+                m_context.from_host_large_xfer.ring,
+                &m_context.from_host_large_xfer.view,
+                &m_fromHostLargeXferCache);
+
+        ssize_t actual;
+        if (remaining >= readAvail) {
+            actual = speculativeRead(dst, remaining);
+            if (actual > 0) remaining -= actual;
+        } else {
+            if (!m_readBuf) {
+                m_readBuf = (unsigned char*)malloc(kReadSize);
+            }
+            actual = speculativeRead(m_readBuf, kReadSize);
+            if (actual > 0) m_read = m_readLeft = actual;
+        }
 
-        if (actual == 0) {
+        if (actual <= 0) {
             // ALOGD("%s: Failed reading from pipe: %d", __FUNCTION__,  errno);
             return NULL;
         }
-
-        if (actual > 0) {
-            m_read = m_readLeft = actual;
-            continue;
-        }
     }
 
     resetBackoff();
     return userReadBuf;
 }
 
+ssize_t RingStream::peekReply(size_t maxLen, struct ring_buffer_spans* spans) {
+    spans->first = nullptr;
+    spans->first_len = 0;
+    spans->second = nullptr;
+    spans->second_len = 0;
+
+    if (!maxLen) return 0;
+    if (drainAsyncWrites() < 0) return -1;
+
+    // Anything readFully read ahead comes first.
+    if (m_readLeft) {
+        spans->first = m_readBuf + (m_read - m_readLeft);
+        spans->first_len = m_readLeft < maxLen ? m_readLeft : maxLen;
+        return spans->first_len;
+    }
+
+    ssize_t readAvail = waitForReadable();
+    if (readAvail < 0) return -1;
+
+    return ring_buffer_view_peek_read(
+        m_context.from_host_large_xfer.ring,
+        &m_context.from_host_large_xfer.view,
+        &m_fromHostLargeXferCache,
+        (size_t)readAvail < maxLen ? readAvail : maxLen,
+        spans);
+}
+
+void RingStream::releaseReply(size_t len) {
+    if (m_readLeft) {
+        m_readLeft -= len < m_readLeft ? len : m_readLeft;
+        return;
+    }
+
+    ring_buffer_consume_read(m_context.from_host_large_xfer.ring, len);
+    resetBackoff();
+}
+
 const unsigned char *RingStream::read(void *buf, size_t *inout_len) {
+    if (drainAsyncWrites() < 0) return nullptr;
+
     unsigned char* dst = (unsigned char*)buf;
     size_t wanted = *inout_len;
     ssize_t actual = speculativeRead(dst, wanted);
@@ -211,96 +273,208 @@ const unsigned char *RingStream::read(void *buf, size_t *inout_len) {
 
 int RingStream::writeFully(const void *buf, size_t size)
 {
-    ensureType3Finished();
-    ensureType1Finished();
+    if (writeFullyAsync(buf, size) < 0) return -1;
+    return ensureType3Finished() ? 0 : -1;
+}
 
-    m_context.ring_config->transfer_size = size;
-    m_context.ring_config->transfer_mode = 3;
+int RingStream::writeFullyAsync(const void *buf, size_t size)
+{
+    if (drainAsyncWrites() < 0) return -1;
+    return writeType3(buf, size);
+}
 
-    size_t sent = 0;
-    size_t preferredChunkSize = m_writeBufferSize / 4;
-    size_t chunkSize = size < preferredChunkSize ? size : preferredChunkSize;
-    const uint8_t* bufferBytes = (const uint8_t*)buf;
+int RingStream::writeFullyv(const struct iovec* iov, int iovcnt) {
+    if (writeFullyvAsync(iov, iovcnt) < 0) return -1;
+    return ensureType3Finished() ? 0 : -1;
+}
 
-    bool hostPinged = false;
-    while (sent < size) {
-        size_t remaining = size - sent;
-        size_t sendThisTime = remaining < chunkSize ? remaining : chunkSize;
+int RingStream::writeFullyvAsync(const struct iovec* iov, int iovcnt) {
+    if (drainAsyncWrites() < 0) return -1;
+    return writeType3v(iov, iovcnt);
+}
 
-        long sentChunks =
-            ring_buffer_view_write(
-                m_context.to_host_large_xfer.ring,
-                &m_context.to_host_large_xfer.view,
-                bufferBytes + sent, sendThisTime, 1);
+int RingStream::writeFullyAsync(const void* buf, size_t size, WriteToken* token) {
+    AsyncWrite write;
+    write.iov.push_back({ const_cast<void*>(buf), size });
+    return queueAsyncWrite(std::move(write), token);
+}
 
-        if (!hostPinged && *(m_context.host_state) != ASG_HOST_STATE_CAN_CONSUME &&
-            *(m_context.host_state) != ASG_HOST_STATE_RENDERING) {
-            notifyAvailable();
-            hostPinged = true;
-        }
+int RingStream::writeFullyvAsync(const struct iovec* iov, int iovcnt, WriteToken* token) {
+    AsyncWrite write;
+    write.iov.assign(iov, iov + iovcnt);
+    return queueAsyncWrite(std::move(write), token);
+}
 
-        if (sentChunks == 0) {
-            ring_buffer_yield();
-            backoff();
-        }
+int RingStream::queueAsyncWrite(AsyncWrite&& write, WriteToken* token) {
+    *token = 0;
 
-        sent += sentChunks * sendThisTime;
+    // Whatever we hold back shares the xfer buffer with the write, so it goes
+    // out first, and the next alloc has to get a new buffer, which waits for
+    // the write to be done with the xfer buffer.
+    if (hasIostreamBuf() || !m_pendingXfers.empty()) {
+        if (drainAsyncWrites() < 0) return -1;
+        if (commitIostreamBuf() < 0 || submitType1Batch() < 0) return -1;
+        rewind();
+    }
 
-        if (isInError()) {
+    if (isAsyncFailed()) return -1;
+
+    if (!m_asyncSubmitter) {
+        m_asyncSubmitter.reset(new android::base::FunctorThread([this]() {
+            runAsyncSubmitter();
+        }));
+        if (!m_asyncSubmitter->start()) {
+            m_asyncSubmitter.reset();
+            errno = EAGAIN;
             return -1;
         }
     }
 
-    bool isRenderingAfter = ASG_HOST_STATE_RENDERING == __atomic_load_n(m_context.host_state, __ATOMIC_ACQUIRE);
+    write.token = ++m_asyncQueued;
+    *token = write.token;
+    m_asyncWrites.send(std::move(write));
+    return 0;
+}
 
-    if (!isRenderingAfter) {
-        notifyAvailable();
-    }
+bool RingStream::isWriteComplete(WriteToken token) const {
+    return __atomic_load_n(&m_asyncCompleted, __ATOMIC_ACQUIRE) >= token;
+}
 
-    ensureType3Finished();
+int RingStream::waitForWrite(WriteToken token) {
+    if (token > m_asyncQueued) token = m_asyncQueued;
 
-    resetBackoff();
-    m_context.ring_config->transfer_mode = 1;
-    m_written += size;
+    android::base::AutoLock lock(m_asyncLock);
+    m_asyncCompletedCv.wait(&lock, [this, token]() {
+        return isWriteComplete(token);
+    });
 
-    float mb = (float)m_written / 1048576.0f;
-    if (mb > 100.0f) {
-        // ALOGD("%s: %f mb in %d notifs. %f mb/notif\n", __func__,
-        //       mb, m_notifs, m_notifs ? mb / (float)m_notifs : 0.0f);
-        m_notifs = 0;
-        m_written = 0;
+    if (m_asyncFailed) {
+        errno = m_asyncErrno;
+        return -1;
     }
     return 0;
 }
 
-int RingStream::writeFullyAsync(const void *buf, size_t size)
+// Waits for everything writeFullyAsync queued, which any other use of the
+// stream must do first, since the submitter drives the rings meanwhile. That
+// goes for the setters too, as it reads what they set; they leave a failure
+// for the next write to report.
+int RingStream::drainAsyncWrites() {
+    if (isWriteComplete(m_asyncQueued)) return isAsyncFailed() ? -1 : 0;
+    return waitForWrite(m_asyncQueued);
+}
+
+bool RingStream::isAsyncFailed() {
+    android::base::AutoLock lock(m_asyncLock);
+    if (m_asyncFailed) errno = m_asyncErrno;
+    return m_asyncFailed;
+}
+
+void RingStream::runAsyncSubmitter() {
+    AsyncWrite write;
+    while (m_asyncWrites.receive(&write)) {
+        // After a failure, the stream is unusable; later writes fail too.
+        bool failed = isAsyncFailed() ||
+            writeType3v(write.iov.data(), (int)write.iov.size()) < 0;
+        int err = errno;
+
+        android::base::AutoLock lock(m_asyncLock);
+        if (failed && !m_asyncFailed) {
+            m_asyncFailed = true;
+            m_asyncErrno = err;
+        }
+        __atomic_store_n(&m_asyncCompleted, write.token, __ATOMIC_RELEASE);
+        m_asyncCompletedCv.broadcastAndUnlock(&lock);
+    }
+}
+
+int RingStream::writeType3(const void *buf, size_t size)
 {
-    ensureType3Finished();
-    ensureType1Finished();
+    struct iovec iov = { const_cast<void*>(buf), size };
+    return writeType3v(&iov, 1);
+}
 
-    __atomic_store_n(&m_context.ring_config->transfer_size, size, __ATOMIC_RELEASE);
-    m_context.ring_config->transfer_mode = 3;
+// Copies |len| bytes gathered from |iov| at segment |*seg|, offset |*segOffset|
+// to |dst|, and advances the position past them.
+static void gatherIovec(ring_buffer_copy_func copy,
+                        uint8_t* dst, size_t len, const struct iovec* iov,
+                        int* seg, size_t* segOffset) {
+    while (len) {
+        size_t segLeft = iov[*seg].iov_len - *segOffset;
+        size_t todo = len < segLeft ? len : segLeft;
+        copy(dst, (const uint8_t*)iov[*seg].iov_base + *segOffset, todo);
+        dst += todo;
+        len -= todo;
+        *segOffset += todo;
+        if (*segOffset == iov[*seg].iov_len) {
+            ++*seg;
+            *segOffset = 0;
+        }
+    }
+}
+
+// Sends the |iovcnt| segments of |iov| as one type 3 transfer, returning once
+// they are all in to_host_large_xfer; the next transfer waits for the host to
+// finish.
+int RingStream::writeType3v(const struct iovec* iov, int iovcnt, uint32_t mode)
+{
+    size_t size = 0;
+    for (int i = 0; i < iovcnt; ++i) size += iov[i].iov_len;
+    if (!size) return 0;
+
+    if (mode == 3 && iovcnt == 1 && usePayloadCache(size)) {
+        return writePayload(iov[0].iov_base, size);
+    }
+
+    if (!ensureType3Finished()) return -1;
+    if (submitType1Batch() < 0) return -1;
+    if (!ensureType1Finished()) return -1;
 
+    __atomic_store_n(m_context.transfer_size, size, __ATOMIC_RELEASE);
+    m_context.ring_config->transfer_mode = mode;
+
+    updateGeometryLimits();
     size_t sent = 0;
-    size_t preferredChunkSize = m_writeBufferSize / 2;
+    size_t preferredChunkSize = m_geometry.chunkSize();
     size_t chunkSize = size < preferredChunkSize ? size : preferredChunkSize;
-    const uint8_t* bufferBytes = (const uint8_t*)buf;
+    bool stalled = false;
+    int seg = 0;
+    size_t segOffset = 0;
 
+    const bool useNotifyPos = hostUsesNotifyPos();
     bool pingedHost = false;
+    uint64_t deadline = stallDeadline();
 
     while (sent < size) {
         size_t remaining = size - sent;
         size_t sendThisTime = remaining < chunkSize ? remaining : chunkSize;
 
+        // Each chunk is gathered straight into the ring, all or nothing.
+        uint32_t oldPos = m_context.to_host_large_xfer.ring->write_pos;
+        struct ring_buffer_spans spans;
         long sentChunks =
-            ring_buffer_view_write(
+            ring_buffer_view_reserve_write(
                 m_context.to_host_large_xfer.ring,
                 &m_context.to_host_large_xfer.view,
-                bufferBytes + sent, sendThisTime, 1);
+                &m_toHostLargeXferCache,
+                sendThisTime, &spans) == sendThisTime;
+
+        if (sentChunks) {
+            ring_buffer_copy_func copy = ring_buffer_copy_for_threshold(
+                sendThisTime, m_context.to_host_large_xfer.view.nt_threshold);
+            gatherIovec(copy, spans.first, spans.first_len, iov, &seg, &segOffset);
+            gatherIovec(copy, spans.second, spans.second_len, iov, &seg, &segOffset);
+            ring_buffer_commit_write(m_context.to_host_large_xfer.ring, sendThisTime);
+        }
 
         uint32_t hostState = __atomic_load_n(m_context.host_state, __ATOMIC_ACQUIRE);
 
-        if (!pingedHost &&
+        if (useNotifyPos) {
+            if (sentChunks) {
+                notifyIfNeeded(m_context.to_host_large_xfer_notify_pos, oldPos,
+                               m_context.to_host_large_xfer.ring->write_pos);
+            }
+        } else if (!pingedHost &&
             hostState != ASG_HOST_STATE_CAN_CONSUME &&
             hostState != ASG_HOST_STATE_RENDERING) {
             pingedHost = true;
@@ -308,8 +482,12 @@ int RingStream::writeFullyAsync(const void *buf, size_t size)
         }
 
         if (sentChunks == 0) {
+            stalled = true;
+            if (timedOut(deadline)) return -1;
             ring_buffer_yield();
             backoff();
+        } else {
+            deadline = stallDeadline();
         }
 
         sent += sentChunks * sendThisTime;
@@ -322,12 +500,17 @@ int RingStream::writeFullyAsync(const void *buf, size_t size)
 
     bool isRenderingAfter = ASG_HOST_STATE_RENDERING == __atomic_load_n(m_context.host_state, __ATOMIC_ACQUIRE);
 
-    if (!isRenderingAfter) {
+    if (!useNotifyPos && !isRenderingAfter) {
         notifyAvailable();
     }
 
+    // The host goes by the mode to tell a payload cache transfer, so it has
+    // to hold until the host is done.
+    if (mode != 3 && !ensureType3Finished()) return -1;
+
     resetBackoff();
     m_context.ring_config->transfer_mode = 1;
+    m_geometry.onType3Write(stalled);
     m_written += size;
 
     float mb = (float)m_written / 1048576.0f;
@@ -354,51 +537,198 @@ const unsigned char *RingStream::commitBufferAndReadFully(
     }
 }
 
+int RingStream::flush() {
+    if (drainAsyncWrites() < 0) return -1;
+    int res = IOStream::flush();
+    if (submitType1Batch() < 0) return -1;
+    return res;
+}
+
 bool RingStream::isInError() const {
-    return 1 == m_context.ring_config->in_error;
+    return 1 == *m_context.in_error;
 }
 
 ssize_t RingStream::speculativeRead(unsigned char* readBuffer, size_t trySize) {
-    ensureType3Finished();
-    ensureType1Finished();
+    ssize_t readAvail = waitForReadable();
+    if (readAvail < 0) return -1;
+
+    uint32_t toRead = (size_t)readAvail > trySize ? trySize : readAvail;
+
+    long stepsRead = ring_buffer_view_read_cached(
+        m_context.from_host_large_xfer.ring,
+        &m_context.from_host_large_xfer.view,
+        &m_fromHostLargeXferCache,
+        readBuffer, toRead, 1);
+
+    if (isInError()) {
+        return -1;
+    }
+
+    return stepsRead * toRead;
+}
 
-    size_t actuallyRead = 0;
-    size_t readIters = 0;
+// Waits for the host to reply in from_host_large_xfer and returns how many
+// bytes it has written there so far, or -1 on error or timeout.
+ssize_t RingStream::waitForReadable() {
+    if (submitType1Batch() < 0) return -1;
+
+    // The host replies only once it has consumed what we sent, so when we can
+    // sleep until it does, there is no point spinning on it first; spinning
+    // would only take the CPU away from the host.
+    if (!m_replyWaitFunc) {
+        if (!ensureType3Finished()) return -1;
+        if (!ensureType1Finished()) return -1;
+    }
 
-    while (!actuallyRead) {
-        ++readIters;
+    const uint32_t maxSpins = 30;
+    uint32_t spins = 0;
+    uint64_t deadline = stallDeadline();
 
+    while (true) {
         uint32_t readAvail =
-            ring_buffer_available_read(
+            ring_buffer_available_read_cached(
                 m_context.from_host_large_xfer.ring,
-                &m_context.from_host_large_xfer.view);
+                &m_context.from_host_large_xfer.view,
+                &m_fromHostLargeXferCache);
 
-        if (!readAvail) {
-            ring_buffer_yield();
-            backoff();
+        if (readAvail) {
+            return isInError() ? -1 : readAvail;
+        }
+
+        if (timedOut(deadline)) return -1;
+        if (m_replyWaitFunc && ++spins >= maxSpins) {
+            spins = 0;
+            if (waitForReply() < 0) return -1;
             continue;
         }
+        ring_buffer_yield();
+        backoff();
+    }
+}
+
+void RingStream::notifyAvailable() {
+    m_doorbellFunc();
+    ++m_notifs;
+}
 
-        uint32_t toRead = readAvail > trySize ?  trySize : readAvail;
+void RingStream::setPayloadCache(size_t minSize) {
+    drainAsyncWrites();
+    const struct asg_ring_config* config = m_context.ring_config;
+    bool hostHasCache =
+        __atomic_load_n(&config->host_features, __ATOMIC_ACQUIRE) &
+        ASG_HOST_FEATURE_PAYLOAD_CACHE;
 
-        long stepsRead = ring_buffer_view_read(
-            m_context.from_host_large_xfer.ring,
-            &m_context.from_host_large_xfer.view,
-            readBuffer, toRead, 1);
+    m_payloadMinSize = hostHasCache ? minSize : 0;
+    m_payloadCache.reset(m_payloadMinSize ? config->payload_cache_size : 0);
+}
 
-        actuallyRead += stepsRead * toRead;
+bool RingStream::usePayloadCache(size_t size) const {
+    return m_payloadMinSize && size >= m_payloadMinSize &&
+           size <= m_payloadCache.capacity();
+}
 
-        if (isInError()) {
-            return -1;
-        }
+// Sends |size| bytes at |buf| by reference if the host's payload cache holds
+// them, and otherwise in full, for the host to add to it. Our own cache
+// mirrors the host's.
+int RingStream::writePayload(const void* buf, size_t size) {
+    asg::PayloadKey key = asg::hashPayload(buf, size);
+
+    struct asg_payload_ref ref;
+    memcpy(ref.hash, key.hash, sizeof(ref.hash));
+    ref.size = key.size;
+    ref.reserved = 0;
+
+    struct iovec iov[2] = {
+        { &ref, sizeof(ref) },
+        { const_cast<void*>(buf), size },
+    };
+
+    // As with stores below, our cache only changes once the host has the
+    // reference; touching it for one that failed would evict differently.
+    if (m_payloadCache.contains(key)) {
+        if (writeType3v(iov, 1, ASG_TRANSFER_MODE_PAYLOAD_REF) < 0) return -1;
+        m_payloadCache.touch(key);
+        return 0;
     }
 
-    return actuallyRead;
+    // Only once the host has it, so that we never refer to a store that
+    // failed.
+    if (writeType3v(iov, 2, ASG_TRANSFER_MODE_PAYLOAD_STORE) < 0) return -1;
+    m_payloadCache.insert(key, std::vector<uint8_t>());
+    return 0;
 }
 
-void RingStream::notifyAvailable() {
-    m_doorbellFunc();
-    ++m_notifs;
+void RingStream::setBatchSubmission(uint32_t maxDescriptors, uint32_t maxBytes) {
+    drainAsyncWrites();
+    submitType1Batch();
+    m_batchMaxDescriptors = maxBytes ? maxDescriptors : 0;
+    m_batchMaxBytes = maxDescriptors ? maxBytes : 0;
+}
+
+// Picks up the host's geometry bounds and the ring sizes, which the host and
+// the guest set up before the first write, and the streaming copy threshold
+// that goes with the largest chunk they allow.
+void RingStream::updateGeometryLimits() {
+    const struct asg_ring_config* config = m_context.ring_config;
+    TransferGeometry::Bounds bounds;
+    bounds.minStepSize = config->min_step_size;
+    bounds.maxStepSize = config->max_step_size;
+    bounds.minChunkSize = config->min_chunk_size;
+    bounds.maxChunkSize = config->max_chunk_size;
+    m_geometry.setLimits(bounds, config->flush_interval, m_writeBufferSize);
+
+    // Kept in the view rather than process wide, so that streams with other
+    // geometries, and the host's replies, each get their own.
+    m_context.to_host_large_xfer.view.nt_threshold =
+        ring_buffer_copy_nt_threshold_for(m_writeBufferSize, m_geometry.maxChunkSize());
+}
+
+void RingStream::setReplyWaitFunc(WaitFunc waitFunc) {
+    drainAsyncWrites();
+    m_replyWaitFunc = std::move(waitFunc);
+}
+
+// Asks the host to notify us of its next write to from_host_large_xfer, then
+// looks once more for anything it wrote before it could have seen that, and
+// sleeps in |m_replyWaitFunc| if there is nothing.
+int RingStream::waitForReply() {
+    struct ring_buffer* ring = m_context.from_host_large_xfer.ring;
+
+    __atomic_store_n(&m_context.ring_config->from_host_large_xfer_notify_pos,
+                     __atomic_load_n(&ring->write_pos, __ATOMIC_ACQUIRE),
+                     __ATOMIC_SEQ_CST);
+    __atomic_store_n(&m_context.ring_config->guest_state,
+                     ASG_GUEST_STATE_NEED_NOTIFY, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    int res = 0;
+    if (!ring_buffer_available_read(ring, &m_context.from_host_large_xfer.view)) {
+        res = m_replyWaitFunc();
+    }
+
+    __atomic_store_n(&m_context.ring_config->guest_state,
+                     ASG_GUEST_STATE_RUNNING, __ATOMIC_RELAXED);
+    return res;
+}
+
+// Whether the host publishes notify positions (ASG_HOST_FEATURE_NOTIFY_POS),
+// so that we only ring for the writes it is asleep waiting for; otherwise we
+// go by host_state.
+bool RingStream::hostUsesNotifyPos() const {
+    return __atomic_load_n(&m_context.ring_config->host_features, __ATOMIC_ACQUIRE) &
+           ASG_HOST_FEATURE_NOTIFY_POS;
+}
+
+// Rings the doorbell if the host asked to be notified of a write that moved
+// the write position from |oldPos| to |newPos|. The fence orders the write
+// position we just published before reading |notifyPos|, pairing with the
+// host's fence between publishing it and rereading the rings before it goes
+// to sleep: either it sees our write or we see its notify position.
+void RingStream::notifyIfNeeded(const uint32_t* notifyPos, uint32_t oldPos, uint32_t newPos) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (asg_need_notify(__atomic_load_n(notifyPos, __ATOMIC_RELAXED), newPos, oldPos)) {
+        notifyAvailable();
+    }
 }
 
 uint32_t RingStream::getRelativeBufferPos(uint32_t pos) {
@@ -434,29 +764,40 @@ void RingStream::ensureConsumerFinishing() {
     }
 }
 
-void RingStream::ensureType1Finished() {
+bool RingStream::ensureType1Finished() {
     uint32_t currAvailRead =
         ring_buffer_available_read(m_context.to_host, 0);
+    uint64_t deadline = stallDeadline();
 
     while (currAvailRead) {
         backoff();
         ring_buffer_yield();
-        currAvailRead = ring_buffer_available_read(m_context.to_host, 0);
+        uint32_t nextAvailRead = ring_buffer_available_read(m_context.to_host, 0);
         if (isInError()) {
-            return;
+            return false;
         }
+        if (nextAvailRead != currAvailRead) {
+            deadline = stallDeadline();
+        } else if (timedOut(deadline)) {
+            return false;
+        }
+        currAvailRead = nextAvailRead;
     }
+
+    return true;
 }
 
-void RingStream::ensureType3Finished() {
+bool RingStream::ensureType3Finished() {
     uint32_t availReadLarge =
         ring_buffer_available_read(
             m_context.to_host_large_xfer.ring,
             &m_context.to_host_large_xfer.view);
+    uint64_t deadline = stallDeadline();
+
     while (availReadLarge) {
         ring_buffer_yield();
         backoff();
-        availReadLarge =
+        uint32_t nextAvailReadLarge =
             ring_buffer_available_read(
                 m_context.to_host_large_xfer.ring,
                 &m_context.to_host_large_xfer.view);
@@ -465,15 +806,73 @@ void RingStream::ensureType3Finished() {
             notifyAvailable();
         }
         if (isInError()) {
-            return;
+            return false;
         }
+        if (nextAvailReadLarge != availReadLarge) {
+            deadline = stallDeadline();
+        } else if (timedOut(deadline)) {
+            return false;
+        }
+        availReadLarge = nextAvailReadLarge;
+    }
+
+    return true;
+}
+
+// Reserves |size| bytes at the write position of to_host_large_xfer for a
+// large command to be encoded into in place, sparing the copy through the tmp
+// buffer. Returns null, for the caller to fall back to the tmp buffer, if they
+// do not fit contiguously before the end of the xfer buffer (or at all).
+unsigned char* RingStream::reserveLargeXfer(size_t size) {
+    if (size > m_writeBufferSize) return nullptr;
+
+    // Type 1 data shares the xfer buffer, so the host must be done with it;
+    // our caller has already waited for any type 3 transfer to drain.
+    if (submitType1Batch() < 0 || !ensureType1Finished()) return nullptr;
+
+    struct ring_buffer_spans spans;
+    uint32_t reserved = ring_buffer_view_reserve_write(
+        m_context.to_host_large_xfer.ring,
+        &m_context.to_host_large_xfer.view,
+        &m_toHostLargeXferCache,
+        size, &spans);
+
+    if (reserved < size || spans.first_len < size) return nullptr;
+
+    m_usingLargeXfer = true;
+    return spans.first;
+}
+
+// Publishes |size| bytes encoded in place by reserveLargeXfer as a type 3
+// transfer, the way writeFully would have sent them.
+int RingStream::commitLargeXfer(size_t size) {
+    __atomic_store_n(m_context.transfer_size, size, __ATOMIC_RELEASE);
+    m_context.ring_config->transfer_mode = 3;
+
+    uint32_t oldPos = m_context.to_host_large_xfer.ring->write_pos;
+    ring_buffer_commit_write(m_context.to_host_large_xfer.ring, size);
+
+    if (hostUsesNotifyPos()) {
+        notifyIfNeeded(m_context.to_host_large_xfer_notify_pos, oldPos,
+                       m_context.to_host_large_xfer.ring->write_pos);
+    } else if (ASG_HOST_STATE_RENDERING !=
+               __atomic_load_n(m_context.host_state, __ATOMIC_ACQUIRE)) {
+        notifyAvailable();
     }
+
+    if (!ensureType3Finished()) return -1;
+
+    resetBackoff();
+    m_context.ring_config->transfer_mode = 1;
+    m_geometry.onType3Write(false);
+    m_written += size;
+
+    return isInError() ? -1 : 0;
 }
 
 int RingStream::type1Write(uint32_t bufferOffset, size_t size) {
-    ensureType3Finished();
+    if (!ensureType3Finished()) return -1;
 
-    size_t sent = 0;
     size_t sizeForRing = sizeof(struct asg_type1_xfer);
 
     struct asg_type1_xfer xfer = {
@@ -481,29 +880,71 @@ int RingStream::type1Write(uint32_t bufferOffset, size_t size) {
         (uint32_t)size,
     };
 
-    uint8_t* writeBufferBytes = (uint8_t*)(&xfer);
-
     uint32_t maxOutstanding = 1;
     uint32_t maxSteps = m_context.ring_config->buffer_size /
             m_context.ring_config->flush_interval;
 
     if (maxSteps > 1) maxOutstanding = maxSteps - 1;
 
-    uint32_t ringAvailReadNow = ring_buffer_available_read(m_context.to_host, 0);
+    // Descriptors still held back here keep their slots busy just like the
+    // ones the host has yet to consume, so count them both before moving on
+    // to the next slot.
+    uint32_t pendingForRing = (uint32_t)(m_pendingXfers.size() + 1) * sizeForRing;
+
+    asg::ring<> toHost(m_context.to_host);
+    uint32_t ringAvailReadNow = toHost.available_read();
+
+    uint64_t deadline = stallDeadline();
+    while (ringAvailReadNow + pendingForRing > maxOutstanding * sizeForRing) {
+        uint32_t nextAvailReadNow = toHost.available_read();
+        if (nextAvailReadNow != ringAvailReadNow) {
+            deadline = stallDeadline();
+        } else if (timedOut(deadline)) {
+            return -1;
+        }
+        ringAvailReadNow = nextAvailReadNow;
+    }
+
+    m_pendingXfers.push_back(xfer);
+    m_pendingXferBytes += size;
 
-    while (ringAvailReadNow >= maxOutstanding * sizeForRing) {
-        ringAvailReadNow = ring_buffer_available_read(m_context.to_host, 0);
+    uint32_t maxBatch = m_batchMaxDescriptors < maxOutstanding ?
+        m_batchMaxDescriptors : maxOutstanding;
+
+    if (m_pendingXfers.size() < maxBatch &&
+        m_pendingXferBytes < m_batchMaxBytes) {
+        return 0;
     }
 
+    return submitType1Batch();
+}
+
+// Publishes the held back type 1 descriptors with one update of the write
+// position, and rings the doorbell at most once for them.
+int RingStream::submitType1Batch() {
+    if (m_pendingXfers.empty()) return 0;
+
+    size_t sent = 0;
+    size_t sizeForRing = m_pendingXfers.size() * sizeof(struct asg_type1_xfer);
+    const uint8_t* writeBufferBytes = (const uint8_t*)m_pendingXfers.data();
+
+    asg::ring<> toHost(m_context.to_host);
+
+    const bool useNotifyPos = hostUsesNotifyPos();
     bool hostPinged = false;
+    uint64_t deadline = stallDeadline();
     while (sent < sizeForRing) {
 
-        long sentChunks = ring_buffer_write(
-            m_context.to_host,
-            writeBufferBytes + sent,
-            sizeForRing - sent, 1);
-
-        if (!hostPinged &&
+        uint32_t oldPos = m_context.to_host->write_pos;
+        long sentChunks =
+            toHost.write(writeBufferBytes + sent, sizeForRing - sent) ? 1 : 0;
+
+        if (useNotifyPos) {
+            if (sentChunks) {
+                notifyIfNeeded(m_context.to_host_notify_pos, oldPos,
+                               m_context.to_host->write_pos);
+            }
+        } else if (!hostPinged &&
             *(m_context.host_state) != ASG_HOST_STATE_CAN_CONSUME &&
             *(m_context.host_state) != ASG_HOST_STATE_RENDERING) {
             notifyAvailable();
@@ -511,6 +952,7 @@ int RingStream::type1Write(uint32_t bufferOffset, size_t size) {
         }
 
         if (sentChunks == 0) {
+            if (timedOut(deadline)) return -1;
             ring_buffer_yield();
             backoff();
         }
@@ -524,11 +966,13 @@ int RingStream::type1Write(uint32_t bufferOffset, size_t size) {
 
     bool isRenderingAfter = ASG_HOST_STATE_RENDERING == __atomic_load_n(m_context.host_state, __ATOMIC_ACQUIRE);
 
-    if (!isRenderingAfter) {
+    if (!useNotifyPos && !isRenderingAfter) {
         notifyAvailable();
     }
 
-    m_written += size;
+    m_written += m_pendingXferBytes;
+    m_pendingXfers.clear();
+    m_pendingXferBytes = 0;
 
     float mb = (float)m_written / 1048576.0f;
     if (mb > 100.0f) {
@@ -568,5 +1012,26 @@ void RingStream::resetBackoff() {
     m_backoffFactor = 1;
 }
 
+void RingStream::setTimeoutNs(uint64_t timeoutNs) {
+    drainAsyncWrites();
+    m_timeoutNs = timeoutNs;
+}
+
+// Deadline for the host to make progress, starting now.
+uint64_t RingStream::stallDeadline() const {
+    if (!m_timeoutNs) return RING_BUFFER_NO_DEADLINE;
+    return ring_buffer_deadline_after_ns(m_timeoutNs);
+}
+
+bool RingStream::timedOut(uint64_t deadline) {
+    if (deadline == RING_BUFFER_NO_DEADLINE ||
+        ring_buffer_monotonic_ns() < deadline) {
+        return false;
+    }
+    resetBackoff();
+    errno = ETIMEDOUT;
+    return true;
+}
+
 } // namespace client
 } // namespace asg
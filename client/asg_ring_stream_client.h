@@ -16,9 +16,17 @@
 #pragma once
 
 #include "client_iostream.h"
+#include "asg_transfer_geometry.h"
+#include "base/asg_payload_cache.h"
 #include "base/asg_types.h"
+#include "base/ConditionVariable.h"
+#include "base/FunctorThread.h"
+#include "base/Lock.h"
+#include "base/MessageChannel.h"
 
 #include <functional>
+#include <memory>
+#include <vector>
 
 typedef void (*ring_stream_client_doorbell_t)(void);
 
@@ -28,7 +36,12 @@ namespace client {
 class RingStream : public IOStream {
 public:
     using DoorbellFunc = std::function<void()>;
-    explicit RingStream(void* sharedRegion, size_t regionSize, DoorbellFunc);
+    using WaitFunc = std::function<int()>;
+    using WriteToken = uint64_t;
+    // |hostVersion| is the ring layout version the host returned from
+    // Ping(set_version); the stream runs the newest layout both support.
+    explicit RingStream(void* sharedRegion, size_t regionSize, DoorbellFunc,
+                        uint32_t hostVersion = ASG_RING_LAYOUT_V1);
     ~RingStream();
 
     virtual size_t idealAllocSize(size_t len);
@@ -38,23 +51,108 @@ public:
     virtual const unsigned char *read( void *buf, size_t *inout_len);
     virtual int writeFully(const void *buf, size_t len);
     virtual int writeFullyAsync(const void *buf, size_t len);
+    virtual int writeFullyv(const struct iovec* iov, int iovcnt);
+    virtual int writeFullyvAsync(const struct iovec* iov, int iovcnt);
     virtual const unsigned char *commitBufferAndReadFully(size_t size, void *buf, size_t len);
+    virtual int flush();
+
+    // Bounds how long reads and writes wait on the host without making any
+    // progress, in nanoseconds; 0 (the default) waits indefinitely. A call
+    // that runs out of time fails like on error (nullptr / -1) with errno set
+    // to ETIMEDOUT. Reads that time out, and writes that time out waiting
+    // for earlier transfers to drain, can be retried; a write that times out
+    // after it has started leaves the stream unusable, as with any other
+    // error.
+    void setTimeoutNs(uint64_t timeoutNs);
+
+    // Lets reads sleep instead of polling while the host has yet to reply:
+    // after a short spin, the stream marks itself ASG_GUEST_STATE_NEED_NOTIFY
+    // and calls |waitFunc|, which should block until the host's
+    // GuestNotifyFunc fires (or return at any time; spurious wake-ups are
+    // fine). Returning -1 fails the read. |waitFunc| is not bounded by
+    // setTimeoutNs, which is checked between waits.
+    void setReplyWaitFunc(WaitFunc waitFunc);
+
+    // Holds type 1 descriptors back to publish them together, with at most
+    // one doorbell per batch, instead of one at a time. A batch goes out on
+    // flush(), before any read or large write, and once it holds
+    // |maxDescriptors| descriptors or |maxBytes| bytes of data, whichever
+    // comes first; it never holds more than the xfer buffer has slots for.
+    // 0 for either turns batching off, which is the default.
+    void setBatchSubmission(uint32_t maxDescriptors, uint32_t maxBytes);
+
+    // Sends payloads of at least |minSize| bytes written with writeFully or
+    // writeFullyAsync (single buffer) through the host's payload cache, if
+    // it has one: one already sent and still in the cache goes as a
+    // reference, for the host to feed its consumer from there. Costs a hash
+    // of each such payload. 0 turns it off, which is the default. Call before
+    // sending anything, as it resets what we know of the host's cache.
+    void setPayloadCache(size_t minSize);
+
+    // Lets a decoder parse a reply in place instead of reading it out with
+    // readFully. Waits like readFully for the host to reply, then points
+    // |spans| at up to |maxLen| bytes of it, |second| being used if they wrap
+    // around the end of from_host_large_xfer, and returns how many there are,
+    // or -1 on error. They stay valid, and are returned again by the next
+    // peekReply, until releaseReply hands |len| of them back to the host. No
+    // other read may come in between.
+    ssize_t peekReply(size_t maxLen, struct ring_buffer_spans* spans);
+    void releaseReply(size_t len);
+
+    // Queues |len| bytes at |buf| to be sent as a type 3 transfer by a
+    // background submitter thread, started on first use, and returns right
+    // away with a |token| for the write. |buf| must stay valid and unchanged
+    // until isWriteComplete(token) or waitForWrite(token) says the write is
+    // done with it. Queued writes go out in order. Every other call on the
+    // stream, alloc included, first waits for all of them, as they share the
+    // xfer buffer; the caller is only free to do other work meanwhile. Once a
+    // write fails, every later one and the stream itself fail too. The
+    // two-argument writeFullyAsync is unaffected, and is done with |buf| when
+    // it returns.
+    int writeFullyAsync(const void* buf, size_t len, WriteToken* token);
+    // Likewise for the segments of |iov|, sent as one transfer like
+    // writeFullyv. |iov| itself is copied; the segments must stay valid.
+    int writeFullyvAsync(const struct iovec* iov, int iovcnt, WriteToken* token);
+    bool isWriteComplete(WriteToken token) const;
+    // Waits for the write |token| and all queued before it. Returns -1 with
+    // errno set if any failed.
+    int waitForWrite(WriteToken token);
 
 private:
     bool isInError() const;
     ssize_t speculativeRead(unsigned char* readBuffer, size_t trySize);
+    ssize_t waitForReadable();
     void notifyAvailable();
+    bool hostUsesNotifyPos() const;
+    int waitForReply();
+    void updateGeometryLimits();
+    void notifyIfNeeded(const uint32_t* notifyPos, uint32_t oldPos, uint32_t newPos);
     uint32_t getRelativeBufferPos(uint32_t pos);
     void advanceWrite();
+    uint64_t stallDeadline() const;
+    bool timedOut(uint64_t deadline);
     void ensureConsumerFinishing();
-    void ensureType1Finished();
-    void ensureType3Finished();
+    bool ensureType1Finished();
+    bool ensureType3Finished();
     int type1Write(uint32_t offset, size_t size);
+    int submitType1Batch();
+    unsigned char* reserveLargeXfer(size_t size);
+    int commitLargeXfer(size_t size);
+    int writeType3(const void* buf, size_t size);
+    int writeType3v(const struct iovec* iov, int iovcnt, uint32_t mode = 3);
+    bool usePayloadCache(size_t size) const;
+    int writePayload(const void* buf, size_t size);
+    struct AsyncWrite;
+    int queueAsyncWrite(AsyncWrite&& write, WriteToken* token);
+    int drainAsyncWrites();
+    bool isAsyncFailed();
+    void runAsyncSubmitter();
 
     void backoff();
     void resetBackoff();
 
     DoorbellFunc m_doorbellFunc;
+    WaitFunc m_replyWaitFunc;
     unsigned char* m_tmpBuf;
     size_t m_tmpBufSize;
     size_t m_tmpBufXferSize;
@@ -66,6 +164,11 @@ private:
 
     struct asg_context m_context;
 
+    // We are the producer of to_host_large_xfer and the consumer of
+    // from_host_large_xfer.
+    struct ring_buffer_index_cache m_toHostLargeXferCache;
+    struct ring_buffer_index_cache m_fromHostLargeXferCache;
+
     uint64_t m_ringOffset;
     uint64_t m_writeBufferOffset;
 
@@ -73,13 +176,45 @@ private:
     uint32_t m_writeBufferMask;
     unsigned char* m_buf;
     unsigned char* m_writeStart;
-    uint32_t m_writeStep;
+    TransferGeometry m_geometry;
 
     uint32_t m_notifs;
     uint32_t m_written;
 
     uint64_t m_backoffIters;
     uint64_t m_backoffFactor;
+
+    uint64_t m_timeoutNs;
+
+    // Type 1 descriptors not yet published, and the bytes they cover.
+    std::vector<struct asg_type1_xfer> m_pendingXfers;
+    size_t m_pendingXferBytes;
+    uint32_t m_batchMaxDescriptors;
+    uint32_t m_batchMaxBytes;
+
+    // Whether the current allocation was reserved in to_host_large_xfer.
+    bool m_usingLargeXfer;
+
+    // The keys of what the host's payload cache holds, and the smallest
+    // payload to send through it; 0 if we do not.
+    asg::PayloadCache m_payloadCache;
+    size_t m_payloadMinSize;
+
+    // Writes queued with a token, as segments. Tokens count up
+    // from 1; m_asyncCompleted is the last one done, written under
+    // m_asyncLock along with the failure state.
+    struct AsyncWrite {
+        std::vector<struct iovec> iov;
+        WriteToken token = 0;
+    };
+    android::base::MessageChannel<AsyncWrite, 16> m_asyncWrites;
+    std::unique_ptr<android::base::FunctorThread> m_asyncSubmitter;
+    WriteToken m_asyncQueued;
+    WriteToken m_asyncCompleted;
+    bool m_asyncFailed;
+    int m_asyncErrno;
+    android::base::Lock m_asyncLock;
+    android::base::ConditionVariable m_asyncCompletedCv;
 };
 
 } // namespace client
@@ -0,0 +1,78 @@
+/*
+* Copyright (C) 2021 The Android Open Source Project
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+#include "asg_transfer_geometry.h"
+
+namespace asg {
+namespace client {
+
+static uint32_t clampSize(uint32_t size, uint32_t lo, uint32_t hi) {
+    if (size < lo) return lo;
+    if (size > hi) return hi;
+    return size;
+}
+
+// A host bound of zero, or one beyond what the rings allow, leaves |cap|.
+static uint32_t boundedBy(uint32_t bound, uint32_t cap) {
+    return bound && bound < cap ? bound : cap;
+}
+
+void TransferGeometry::setLimits(
+    const Bounds& bounds, uint32_t slotSize, uint32_t largeXferSize) {
+    if (!slotSize) slotSize = kDefaultStepSize;
+
+    mMaxStepSize = boundedBy(bounds.maxStepSize, slotSize);
+    mMinStepSize = boundedBy(
+        bounds.minStepSize ? bounds.minStepSize : kDefaultMinStepSize,
+        mMaxStepSize);
+    mStepSize = clampSize(mStepSize, mMinStepSize, mMaxStepSize);
+
+    mMaxChunkSize = boundedBy(bounds.maxChunkSize, largeXferSize / 2);
+    mMinChunkSize = boundedBy(
+        bounds.minChunkSize ? bounds.minChunkSize : kDefaultMinChunkSize,
+        mMaxChunkSize);
+
+    // Start out where writeFully always used to chunk.
+    if (largeXferSize != mLargeXferSize) {
+        mLargeXferSize = largeXferSize;
+        mChunkSize = largeXferSize / 4;
+    }
+    mChunkSize = clampSize(mChunkSize, mMinChunkSize, mMaxChunkSize);
+}
+
+void TransferGeometry::onType1Commit(size_t size) {
+    uint32_t sample = size < mMaxStepSize ? (uint32_t)size : mMaxStepSize;
+    mAvgCommitSize8 += sample - mAvgCommitSize8 / 8;
+    uint32_t avg = mAvgCommitSize8 / 8;
+
+    // Hysteresis: right after doubling, commits that filled the old step fill
+    // half of the new one, which is between both thresholds.
+    if (avg * 4 >= mStepSize * 3 && mStepSize < mMaxStepSize) {
+        mStepSize = clampSize(mStepSize * 2, mMinStepSize, mMaxStepSize);
+    } else if (avg * 4 < mStepSize && mStepSize > mMinStepSize) {
+        mStepSize = clampSize(mStepSize / 2, mMinStepSize, mMaxStepSize);
+    }
+}
+
+void TransferGeometry::onType3Write(bool stalled) {
+    if (stalled) {
+        mChunkSize = clampSize(mChunkSize / 2, mMinChunkSize, mMaxChunkSize);
+    } else {
+        mChunkSize = clampSize(mChunkSize * 2, mMinChunkSize, mMaxChunkSize);
+    }
+}
+
+} // namespace client
+} // namespace asg
@@ -0,0 +1,90 @@
+/*
+* Copyright (C) 2021 The Android Open Source Project
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace asg {
+namespace client {
+
+// How the client cuts up what it sends, tuned at runtime from the traffic it
+// sees, within bounds set by the host (asg_ring_config's geometry fields):
+//
+// - The step: how many bytes of small writes are batched into one type 1
+//   descriptor. It doubles while commits keep filling it, so streams of small
+//   calls cost fewer descriptors and doorbells, and halves while they fall
+//   well short of it, e.g. when every call is flushed by a readback.
+//
+// - The tmp buffer threshold: allocations above it go through the tmp buffer
+//   as type 3 transfers instead of being written in place in a type 1 slot.
+//   That is the largest step allowed, as anything that fits a slot is cheaper
+//   to send in place.
+//
+// - The chunk: how many bytes of a type 3 transfer are published to
+//   to_host_large_xfer at a time. It halves after transfers where the host
+//   drained more slowly than we wrote, so that it can start on each piece
+//   sooner, and doubles after transfers where it kept up, so that large
+//   uploads take fewer index updates.
+class TransferGeometry {
+public:
+    // Zero fields leave that bound at the client's default.
+    struct Bounds {
+        uint32_t minStepSize = 0;
+        uint32_t maxStepSize = 0;
+        uint32_t minChunkSize = 0;
+        uint32_t maxChunkSize = 0;
+    };
+
+    static constexpr uint32_t kDefaultStepSize = 4096;
+    static constexpr uint32_t kDefaultMinStepSize = 512;
+    static constexpr uint32_t kDefaultMinChunkSize = 4096;
+
+    // Sets the bounds from the host's |bounds|, the type 1 slot size
+    // (flush_interval), which no step can exceed, and the size of
+    // to_host_large_xfer, half of which no chunk can exceed. The current
+    // step and chunk are clamped into them.
+    void setLimits(const Bounds& bounds, uint32_t slotSize, uint32_t largeXferSize);
+
+    uint32_t stepSize() const { return mStepSize; }
+    uint32_t tmpBufThreshold() const { return mMaxStepSize; }
+    uint32_t chunkSize() const { return mChunkSize; }
+    uint32_t maxChunkSize() const { return mMaxChunkSize; }
+
+    // Records a type 1 commit of |size| bytes.
+    void onType1Commit(size_t size);
+
+    // Records a type 3 transfer, |stalled| if we had to wait for the host to
+    // make room in to_host_large_xfer.
+    void onType3Write(bool stalled);
+
+private:
+    uint32_t mStepSize = kDefaultStepSize;
+    uint32_t mMinStepSize = kDefaultMinStepSize;
+    uint32_t mMaxStepSize = kDefaultStepSize;
+
+    uint32_t mChunkSize = 0;
+    uint32_t mMinChunkSize = kDefaultMinChunkSize;
+    uint32_t mMaxChunkSize = 0;
+
+    // Moving average of type 1 commit sizes, scaled by 8. Starts at half
+    // the step, where it neither grows nor shrinks.
+    uint32_t mAvgCommitSize8 = kDefaultStepSize * 4;
+    uint32_t mLargeXferSize = 0;
+};
+
+} // namespace client
+} // namespace asg
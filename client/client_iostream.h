@@ -18,6 +18,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <sys/uio.h>
 
 namespace asg {
 namespace client {
@@ -59,6 +60,19 @@ public:
         return writeFully(buf, len);
     }
 
+    // Write the |iovcnt| segments of |iov| as if they were one buffer, sparing
+    // the caller from gathering them first. Streams that can, send them in one
+    // transfer.
+    virtual int writeFullyv(const struct iovec* iov, int iovcnt) {
+        for (int i = 0; i < iovcnt; ++i) {
+            if (writeFully(iov[i].iov_base, iov[i].iov_len) < 0) return -1;
+        }
+        return 0;
+    }
+    virtual int writeFullyvAsync(const struct iovec* iov, int iovcnt) {
+        return writeFullyv(iov, iovcnt);
+    }
+
     virtual ~IOStream() {
 
         // NOTE: m_iostreamBuf is 'owned' by the child class thus we expect it to be released by it
@@ -67,7 +81,7 @@ public:
     virtual unsigned char *alloc(size_t len) {
 
         if (m_iostreamBuf && len > m_free) {
-            if (flush() < 0) {
+            if (commitIostreamBuf() < 0) {
                 return NULL; // we failed to flush so something is wrong
             }
         }
@@ -90,13 +104,7 @@ public:
     }
 
     virtual int flush() {
-
-        if (!m_iostreamBuf || m_free == m_bufsize) return 0;
-
-        int stat = commitBuffer(m_bufsize - m_free);
-        m_iostreamBuf = NULL;
-        m_free = 0;
-        return stat;
+        return commitIostreamBuf();
     }
 
     const unsigned char *readback(void *buf, size_t len) {
@@ -110,6 +118,23 @@ public:
     }
 
 protected:
+    // Commits what has been allocated so far. Unlike flush(), which
+    // subclasses may extend to push out whatever they hold back, this is
+    // also how alloc makes room.
+    int commitIostreamBuf() {
+
+        if (!m_iostreamBuf || m_free == m_bufsize) return 0;
+
+        int stat = commitBuffer(m_bufsize - m_free);
+        m_iostreamBuf = NULL;
+        m_free = 0;
+        return stat;
+    }
+
+    bool hasIostreamBuf() const {
+        return m_iostreamBuf != NULL;
+    }
+
     void rewind() {
         m_iostreamBuf = NULL;
         m_bufsize = m_bufsizeOrig;
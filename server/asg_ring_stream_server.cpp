@@ -13,9 +13,13 @@
 // limitations under the License.
 #include "asg_ring_stream_server.h"
 
+#include "base/ring.h"
+#include "base/ring_buffer_copy.h"
+
 #define EMUGL_DEBUG_LEVEL  0
 
 #include <assert.h>
+#include <errno.h>
 #include <memory.h>
 
 namespace asg {
@@ -24,10 +28,26 @@ namespace server {
 RingStream::RingStream(
         uint8_t* shared_buffer,
         size_t ring_xfer_buffer_size,
-        RingStream::UnavailableReadFunc unavailbleReadFunc) :
+        RingStream::UnavailableReadFunc unavailbleReadFunc,
+        uint32_t guest_version) :
     IOStream(128 * 1024),
-    mContext(asg_context_create((char*)shared_buffer, (char*)shared_buffer + sizeof(struct asg_ring_storage), ring_xfer_buffer_size)),
-    mUnavailableReadFunc(unavailbleReadFunc) { }
+    mContext(asg_context_create_versioned((char*)shared_buffer, (char*)shared_buffer + sizeof(struct asg_ring_storage), ring_xfer_buffer_size, guest_version, ASG_RING_LAYOUT_LATEST)),
+    mUnavailableReadFunc(unavailbleReadFunc) {
+    // Ask for a doorbell on the guest's first publish to each ring.
+    asg_host_publish_notify_pos(&mContext);
+    __atomic_fetch_or(&mContext.ring_config->host_features,
+                      ASG_HOST_FEATURE_NOTIFY_POS, __ATOMIC_RELEASE);
+
+    // Replies go in as large chunks as the ring has room for (see
+    // commitBuffer); there is no transfer geometry to bound them.
+    mContext.from_host_large_xfer.view.nt_threshold =
+        ring_buffer_copy_nt_threshold_for(mContext.from_host_large_xfer.view.size, 0);
+
+    ring_buffer_consumer_cache_init(
+        mContext.to_host_large_xfer.ring, &mToHostLargeXferCache);
+    ring_buffer_producer_cache_init(
+        mContext.from_host_large_xfer.ring, &mFromHostLargeXferCache);
+}
 
 RingStream::~RingStream() = default;
 
@@ -39,22 +59,38 @@ void* RingStream::allocBuffer(size_t minSize) {
 }
 
 int RingStream::commitBuffer(size_t size) {
+    if (mWriteBroken) {
+        errno = EPIPE;
+        return -1;
+    }
+
     size_t sent = 0;
     auto data = mWriteBuffer.data();
 
     size_t iters = 0;
     size_t backedOffIters = 0;
     const size_t kBackoffIters = 10000000ULL;
+    uint64_t deadline = stallDeadline();
     while (sent < size) {
         ++iters;
-        auto avail = ring_buffer_available_write(
+        auto avail = ring_buffer_available_write_cached(
             mContext.from_host_large_xfer.ring,
-            &mContext.from_host_large_xfer.view);
+            &mContext.from_host_large_xfer.view,
+            &mFromHostLargeXferCache);
 
         // Check if the guest process crashed.
         if (!avail) {
             if (*(mContext.host_state) == ASG_HOST_STATE_EXIT) {
                 return sent;
+            } else if (timedOut(deadline)) {
+                if (sent) {
+                    // The guest already has part of this reply, and would
+                    // take whatever we send next for the rest of it.
+                    __atomic_store_n(mContext.in_error, 1, __ATOMIC_RELEASE);
+                    mShouldExit = true;
+                    mWriteBroken = true;
+                }
+                return -1;
             } else {
                 ring_buffer_yield();
                 if (iters > kBackoffIters) {
@@ -68,12 +104,19 @@ int RingStream::commitBuffer(size_t size) {
         auto remaining = size - sent;
         auto todo = remaining < avail ? remaining : avail;
 
-        ring_buffer_view_write(
+        uint32_t oldPos = mContext.from_host_large_xfer.ring->write_pos;
+        ring_buffer_view_write_cached(
             mContext.from_host_large_xfer.ring,
             &mContext.from_host_large_xfer.view,
+            &mFromHostLargeXferCache,
             data + sent, todo, 1);
 
+        if (mGuestNotifyFunc) {
+            notifyGuestIfNeeded(oldPos, mContext.from_host_large_xfer.ring->write_pos);
+        }
+
         sent += todo;
+        deadline = stallDeadline();
     }
 
     if (backedOffIters > 0) {
@@ -98,6 +141,8 @@ const unsigned char* RingStream::readRaw(void* buf, size_t* inout_len) {
 
     *(mContext.host_state) = ASG_HOST_STATE_CAN_CONSUME;
 
+    uint64_t deadline = stallDeadline();
+
     while (count < wanted) {
 
         if (mReadBufferLeft) {
@@ -110,6 +155,15 @@ const unsigned char* RingStream::readRaw(void* buf, size_t* inout_len) {
             continue;
         }
 
+        if (mPayloadReplayLeft) {
+            size_t avail = std::min<size_t>(wanted - count, mPayloadReplayLeft);
+            memcpy(dst + count, mPayloadReplay, avail);
+            mPayloadReplay += avail;
+            mPayloadReplayLeft -= avail;
+            count += avail;
+            continue;
+        }
+
         mReadBuffer.clear();
 
         // no read buffer left...
@@ -123,12 +177,12 @@ const unsigned char* RingStream::readRaw(void* buf, size_t* inout_len) {
             return nullptr;
         }
 
-        ringAvailable =
-            ring_buffer_available_read(mContext.to_host, 0);
+        ringAvailable = asg::ring<>(mContext.to_host).available_read();
         ringLargeXferAvailable =
-            ring_buffer_available_read(
+            ring_buffer_available_read_cached(
                 mContext.to_host_large_xfer.ring,
-                &mContext.to_host_large_xfer.view);
+                &mContext.to_host_large_xfer.view,
+                &mToHostLargeXferCache);
 
         auto current = dst + count;
         auto ptrEnd = dst + wanted;
@@ -139,7 +193,7 @@ const unsigned char* RingStream::readRaw(void* buf, size_t* inout_len) {
                 mContext.ring_config->transfer_mode;
             switch (transferMode) {
                 case 1:
-                    type1Read(ringAvailable, dst, &count, &current, ptrEnd);
+                    type1Read(dst, &count, &current, ptrEnd);
                     break;
                 case 2:
                     // type2Read(ringAvailable, &count, &current, ptrEnd);
@@ -158,15 +212,20 @@ const unsigned char* RingStream::readRaw(void* buf, size_t* inout_len) {
             type3Read(ringLargeXferAvailable,
                       &count, &current, ptrEnd);
             inLargeXfer = true;
-            if (0 == __atomic_load_n(&mContext.ring_config->transfer_size, __ATOMIC_ACQUIRE)) {
+            if (0 == __atomic_load_n(mContext.transfer_size, __ATOMIC_ACQUIRE)) {
                 inLargeXfer = false;
             }
         } else {
-            if (inLargeXfer && 0 != __atomic_load_n(&mContext.ring_config->transfer_size, __ATOMIC_ACQUIRE)) {
+            // Nothing was read yet (count > 0 returns above).
+            if (timedOut(deadline)) {
+                return nullptr;
+            }
+
+            if (inLargeXfer && 0 != __atomic_load_n(mContext.transfer_size, __ATOMIC_ACQUIRE)) {
                 continue;
             }
 
-            if (inLargeXfer && 0 == __atomic_load_n(&mContext.ring_config->transfer_size, __ATOMIC_ACQUIRE)) {
+            if (inLargeXfer && 0 == __atomic_load_n(mContext.transfer_size, __ATOMIC_ACQUIRE)) {
                 inLargeXfer = false;
             }
 
@@ -181,6 +240,12 @@ const unsigned char* RingStream::readRaw(void* buf, size_t* inout_len) {
                 return nullptr;
             }
 
+            // Ask for a doorbell, unless the guest sent something after we
+            // last looked.
+            if (asg_host_prepare_to_sleep(&mContext)) {
+                continue;
+            }
+
             int unavailReadResult = mUnavailableReadFunc();
 
             if (-1 == unavailReadResult) {
@@ -201,75 +266,211 @@ const unsigned char* RingStream::readRaw(void* buf, size_t* inout_len) {
 }
 
 void RingStream::type1Read(
-    uint32_t available,
     char* begin,
     size_t* count, char** current, const char* ptrEnd) {
 
-    uint32_t xferTotal = available / sizeof(struct asg_type1_xfer);
+    // Decode the next descriptor instead of copying out everything that is
+    // queued.
+    asg::ring<> toHost(mContext.to_host);
+    struct asg_type1_xfer xfer;
 
-    if (mType1Xfers.size() < xferTotal) {
-        mType1Xfers.resize(xferTotal * 2);
+    if (!toHost.peek(&xfer, sizeof(xfer))) {
+        return;
     }
 
-    auto xfersPtr = mType1Xfers.data();
-
-    ring_buffer_copy_contents(
-        mContext.to_host, 0, xferTotal * sizeof(struct asg_type1_xfer), (uint8_t*)xfersPtr);
-
-    for (uint32_t i = 0; i < xferTotal; ++i) {
-        if (*current + xfersPtr[i].size > ptrEnd) {
-            // Save in a temp buffer or we'll get stuck
-            if (begin == *current && i == 0) {
-                const char* src = mContext.buffer + xfersPtr[i].offset;
-                mReadBuffer.resize_noinit(xfersPtr[i].size);
-                memcpy(mReadBuffer.data(), src, xfersPtr[i].size);
-                mReadBufferLeft = xfersPtr[i].size;
-                ring_buffer_advance_read(
-                        mContext.to_host, sizeof(struct asg_type1_xfer), 1);
-            }
-            return;
+    const char* src = mContext.buffer + xfer.offset;
+
+    if (*current + xfer.size > ptrEnd) {
+        // Save in a temp buffer or we'll get stuck
+        if (begin == *current) {
+            mReadBuffer.resize_noinit(xfer.size);
+            memcpy(mReadBuffer.data(), src, xfer.size);
+            mReadBufferLeft = xfer.size;
+            toHost.consume(sizeof(xfer));
         }
-        const char* src = mContext.buffer + xfersPtr[i].offset;
-        memcpy(*current, src, xfersPtr[i].size);
-        ring_buffer_advance_read(
-                mContext.to_host, sizeof(struct asg_type1_xfer), 1);
-        *current += xfersPtr[i].size;
-        *count += xfersPtr[i].size;
-
-        // TODO: Figure out why running multiple xfers here can result in data
-        // corruption.
         return;
     }
+
+    memcpy(*current, src, xfer.size);
+    toHost.consume(sizeof(xfer));
+    *current += xfer.size;
+    *count += xfer.size;
+}
+
+// Copies out what |spans| describe, in order.
+static void copySpans(char* dst, const struct ring_buffer_spans& spans) {
+    memcpy(dst, spans.first, spans.first_len);
+    if (spans.second_len) {
+        memcpy(dst + spans.first_len, spans.second, spans.second_len);
+    }
 }
 
 void RingStream::type3Read(
     uint32_t available,
     size_t* count, char** current, const char* ptrEnd) {
 
-    uint32_t xferTotal = __atomic_load_n(&mContext.ring_config->transfer_size, __ATOMIC_ACQUIRE);
+    if (!mPayloadStoring) {
+        uint32_t transferMode =
+            __atomic_load_n(&mContext.ring_config->transfer_mode, __ATOMIC_ACQUIRE);
+        if (transferMode == ASG_TRANSFER_MODE_PAYLOAD_STORE ||
+            transferMode == ASG_TRANSFER_MODE_PAYLOAD_REF) {
+            payloadRefRead(transferMode, available);
+            return;
+        }
+    }
+
+    uint32_t xferTotal = __atomic_load_n(mContext.transfer_size, __ATOMIC_ACQUIRE);
     uint32_t maxCanRead = ptrEnd - *current;
     uint32_t ringAvail = available;
     uint32_t actuallyRead = std::min(ringAvail, std::min(xferTotal, maxCanRead));
 
     // Decrement transfer_size before letting the guest proceed in ring_buffer funcs or we will race
     // to the next time the guest sets transfer_size
-    __atomic_fetch_sub(&mContext.ring_config->transfer_size, actuallyRead, __ATOMIC_RELEASE);
+    __atomic_fetch_sub(mContext.transfer_size, actuallyRead, __ATOMIC_RELEASE);
 
-    ring_buffer_read_fully_with_abort(
+    // Both the consumer and the payload cache take the bytes straight from
+    // shared memory; the guest gets the space back once they have.
+    // |available| was just observed, so this cannot come up short.
+    struct ring_buffer_spans spans;
+    ring_buffer_view_peek_read(
             mContext.to_host_large_xfer.ring,
             &mContext.to_host_large_xfer.view,
-            *current, actuallyRead,
-            1, &mContext.ring_config->in_error);
+            &mToHostLargeXferCache,
+            actuallyRead, &spans);
+    copySpans(*current, spans);
+
+    if (mPayloadStoring) {
+        mPayloadStoreContents.insert(mPayloadStoreContents.end(),
+                                     spans.first, spans.first + spans.first_len);
+        if (spans.second_len) {
+            mPayloadStoreContents.insert(mPayloadStoreContents.end(),
+                                         spans.second, spans.second + spans.second_len);
+        }
+        if (mPayloadStoreContents.size() == mPayloadStoreKey.size) {
+            mPayloadCache.insert(mPayloadStoreKey, std::move(mPayloadStoreContents));
+            mPayloadStoreContents = std::vector<uint8_t>();
+            mPayloadStoring = false;
+        }
+    }
+
+    ring_buffer_consume_read(mContext.to_host_large_xfer.ring, actuallyRead);
 
     *current += actuallyRead;
     *count += actuallyRead;
 }
 
+// Reads the asg_payload_ref that starts a transfer in one of the payload cache
+// modes, over as many calls as the guest's chunks take to carry it. The
+// payload of a store then goes to the consumer as in any type 3 transfer, and
+// into the cache on the way; that of a reference comes from the cache, ahead
+// of anything the guest sends after it.
+void RingStream::payloadRefRead(uint32_t transferMode, uint32_t available) {
+    uint32_t wanted = sizeof(mPayloadRef) - mPayloadRefRead;
+    uint32_t actuallyRead = std::min(available, wanted);
+
+    __atomic_fetch_sub(mContext.transfer_size, actuallyRead, __ATOMIC_RELEASE);
+    struct ring_buffer_spans spans;
+    ring_buffer_view_peek_read(
+            mContext.to_host_large_xfer.ring,
+            &mContext.to_host_large_xfer.view,
+            &mToHostLargeXferCache,
+            actuallyRead, &spans);
+    copySpans((char*)&mPayloadRef + mPayloadRefRead, spans);
+    ring_buffer_consume_read(mContext.to_host_large_xfer.ring, actuallyRead);
+
+    mPayloadRefRead += actuallyRead;
+    if (mPayloadRefRead < sizeof(mPayloadRef)) return;
+    mPayloadRefRead = 0;
+
+    asg::PayloadKey key;
+    memcpy(key.hash, mPayloadRef.hash, sizeof(key.hash));
+    key.size = mPayloadRef.size;
+
+    if (transferMode == ASG_TRANSFER_MODE_PAYLOAD_STORE) {
+        mPayloadStoring = true;
+        mPayloadStoreKey = key;
+        mPayloadStoreContents.clear();
+        mPayloadStoreContents.reserve(key.size);
+        return;
+    }
+
+    const std::vector<uint8_t>* contents = mPayloadCache.find(key);
+    if (!contents || contents->size() != key.size) {
+        fprintf(stderr, "%s: error: guest referred to a payload we do not hold\n",
+                __func__);
+        __atomic_store_n(mContext.in_error, 1, __ATOMIC_RELEASE);
+        mShouldExit = true;
+        return;
+    }
+
+    mPayloadReplay = contents->data();
+    mPayloadReplayLeft = key.size;
+}
+
 int RingStream::writeFully(const void* buf, size_t len) {
     void* dstBuf = alloc(len);
     memcpy(dstBuf, buf, len);
-    flush();
-    return 0;
+    return flush() < 0 ? -1 : 0;
+}
+
+void RingStream::setTimeoutNs(uint64_t timeoutNs) {
+    mTimeoutNs = timeoutNs;
+}
+
+void RingStream::setPayloadCacheSize(uint32_t bytes) {
+    mPayloadCache.reset(bytes);
+    mContext.ring_config->payload_cache_size = bytes;
+    if (bytes) {
+        __atomic_fetch_or(&mContext.ring_config->host_features,
+                          ASG_HOST_FEATURE_PAYLOAD_CACHE, __ATOMIC_RELEASE);
+    } else {
+        __atomic_fetch_and(&mContext.ring_config->host_features,
+                           ~(uint32_t)ASG_HOST_FEATURE_PAYLOAD_CACHE, __ATOMIC_RELEASE);
+    }
+}
+
+void RingStream::setGuestNotifyFunc(GuestNotifyFunc guestNotifyFunc) {
+    mGuestNotifyFunc = std::move(guestNotifyFunc);
+}
+
+void RingStream::setGeometryBounds(uint32_t minStepSize, uint32_t maxStepSize,
+                                   uint32_t minChunkSize, uint32_t maxChunkSize) {
+    mContext.ring_config->min_step_size = minStepSize;
+    mContext.ring_config->max_step_size = maxStepSize;
+    mContext.ring_config->min_chunk_size = minChunkSize;
+    mContext.ring_config->max_chunk_size = maxChunkSize;
+}
+
+// The fence pairs with the guest's between publishing its state and notify
+// position and checking the ring once more before it sleeps, as for the
+// guest -> host direction in asg_need_notify.
+void RingStream::notifyGuestIfNeeded(uint32_t oldPos, uint32_t newPos) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&mContext.ring_config->guest_state, __ATOMIC_RELAXED) !=
+        ASG_GUEST_STATE_NEED_NOTIFY) {
+        return;
+    }
+    if (asg_need_notify(
+            __atomic_load_n(&mContext.ring_config->from_host_large_xfer_notify_pos,
+                            __ATOMIC_RELAXED),
+            newPos, oldPos)) {
+        mGuestNotifyFunc();
+    }
+}
+
+// Deadline for the guest to make progress, starting now.
+uint64_t RingStream::stallDeadline() const {
+    if (!mTimeoutNs) return RING_BUFFER_NO_DEADLINE;
+    return ring_buffer_deadline_after_ns(mTimeoutNs);
+}
+
+bool RingStream::timedOut(uint64_t deadline) const {
+    if (deadline == RING_BUFFER_NO_DEADLINE ||
+        ring_buffer_monotonic_ns() < deadline) {
+        return false;
+    }
+    errno = ETIMEDOUT;
+    return true;
 }
 
 const unsigned char *RingStream::readFully( void *buf, size_t len) {
@@ -13,6 +13,7 @@
 // limitations under the License.
 #pragma once
 
+#include "base/asg_payload_cache.h"
 #include "base/asg_types.h"
 #include "base/ring_buffer.h"
 #include "base/SmallVector.h"
@@ -31,11 +32,15 @@ public:
     using Buffer =
         android::base::SmallFixedVector<unsigned char, 512>;
     using UnavailableReadFunc = std::function<int()>;
+    using GuestNotifyFunc = std::function<void()>;
 
+    // |guest_version| is the ring layout version the guest advertised with
+    // Ping(set_version); the stream runs the newest layout both support.
     RingStream(
         uint8_t* shared_buffer,
         size_t ring_xfer_buffer_size,
-        UnavailableReadFunc unavailableReadFunc);
+        UnavailableReadFunc unavailableReadFunc,
+        uint32_t guest_version = ASG_RING_LAYOUT_V1);
     ~RingStream();
 
     int writeFully(const void* buf, size_t len) override;
@@ -43,28 +48,81 @@ public:
 
     void printStats();
 
+    // Bounds how long reads and writes wait on the guest without making any
+    // progress, in nanoseconds; 0 (the default) waits indefinitely. A read
+    // that runs out of time returns nullptr and a write -1, with errno set
+    // to ETIMEDOUT. Reads that time out, and writes that time out before
+    // any of their bytes went out, can be retried; a write that times out
+    // mid-transfer leaves the stream unusable: it is marked in error for the
+    // guest, reads return nullptr and later writes fail with EPIPE.
+    void setTimeoutNs(uint64_t timeoutNs);
+
+    // Called when a write to from_host_large_xfer lands while the guest is
+    // asleep waiting for it, to wake the guest up (the host -> guest
+    // doorbell). Without one, the guest has to poll for replies.
+    void setGuestNotifyFunc(GuestNotifyFunc guestNotifyFunc);
+
+    // Bounds the step and chunk sizes the guest picks (see
+    // asg_ring_config); zero leaves a bound to the guest. Call before the
+    // guest starts sending.
+    void setGeometryBounds(uint32_t minStepSize, uint32_t maxStepSize,
+                           uint32_t minChunkSize, uint32_t maxChunkSize);
+
+    // Keeps up to |bytes| of the large payloads the guest stores, so that it
+    // can send them again by reference (ASG_HOST_FEATURE_PAYLOAD_CACHE); 0,
+    // the default, keeps none. Call before the guest starts sending.
+    void setPayloadCacheSize(uint32_t bytes);
+
 protected:
     virtual void* allocBuffer(size_t minSize) override final;
     virtual int commitBuffer(size_t size) override final;
     virtual const unsigned char* readRaw(void* buf, size_t* inout_len) override final;
 
-    void type1Read(uint32_t available, char* begin, size_t* count, char** current, const char* ptrEnd);
+    void type1Read(char* begin, size_t* count, char** current, const char* ptrEnd);
     void type3Read(uint32_t available, size_t* count, char** current, const char* ptrEnd);
+    void payloadRefRead(uint32_t transferMode, uint32_t available);
+
+    // Notifies the guest if it is asleep waiting for the write that moved
+    // from_host_large_xfer's write position from |oldPos| to |newPos|.
+    void notifyGuestIfNeeded(uint32_t oldPos, uint32_t newPos);
+
+    uint64_t stallDeadline() const;
+    bool timedOut(uint64_t deadline) const;
 
     struct asg_context mContext;
+
+    // We are the consumer of to_host_large_xfer and the producer of
+    // from_host_large_xfer.
+    struct ring_buffer_index_cache mToHostLargeXferCache;
+    struct ring_buffer_index_cache mFromHostLargeXferCache;
     UnavailableReadFunc mUnavailableReadFunc;
+    GuestNotifyFunc mGuestNotifyFunc;
 
-    std::vector<asg_type1_xfer> mType1Xfers;
     std::vector<asg_type2_xfer> mType2Xfers;
 
     Buffer mReadBuffer;
     Buffer mWriteBuffer;
     size_t mReadBufferLeft = 0;
 
+    // The payload cache, the asg_payload_ref being read, which comes in
+    // pieces if the guest's chunks are smaller, the payload being stored, if
+    // any, and what is left to feed the consumer of the last one referred to.
+    asg::PayloadCache mPayloadCache;
+    struct asg_payload_ref mPayloadRef;
+    uint32_t mPayloadRefRead = 0;
+    bool mPayloadStoring = false;
+    asg::PayloadKey mPayloadStoreKey;
+    std::vector<uint8_t> mPayloadStoreContents;
+    const uint8_t* mPayloadReplay = nullptr;
+    size_t mPayloadReplayLeft = 0;
+
     size_t mXmits = 0;
     size_t mTotalRecv = 0;
     bool mBenchmarkEnabled = false;
     bool mShouldExit = false;
+    // Set once a write failed partway through a reply.
+    bool mWriteBroken = false;
+    uint64_t mTimeoutNs = 0;
 };
 
 } // namespace server
@@ -1,5 +1,10 @@
+#include "base/asg_doorbell.h"
+#include "base/asg_payload_cache.h"
+#include "base/asg_shared_region.h"
 #include "base/asg_types.h"
+#include "base/ring.h"
 #include "base/ring_buffer.h"
+#include "base/ring_buffer_copy.h"
 #include "base/FunctorThread.h"
 #include "base/MessageChannel.h"
 
@@ -9,17 +14,30 @@
 #include <gtest/gtest.h>
 #include <inttypes.h>
 
+#ifdef __linux__
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
 #include <chrono>
 #include <functional>
 #include <random>
+#include <thread>
 #include <vector>
 
 using android::base::MessageChannel;
 using android::base::FunctorThread;
 
 // Benchmark that tests how fast we can dump kSends * kSendSizeBytes of data into a sink,
-// with kSends packets.
-TEST(ASG, BenchmarkBasicSend) {
+// with kSends packets. |notifyPos| picks whether the client rings the doorbell
+// by the server's notify positions or, as with hosts that predate them, by
+// its host_state, and |batch| whether it publishes descriptors in batches.
+static void runBasicSend(bool notifyPos, bool batch) {
     static constexpr size_t kRingXferSize = 16384;
     static constexpr size_t kRingStepSize = 4096;
     static constexpr size_t kSends = 1024 * 50;
@@ -55,6 +73,12 @@ TEST(ASG, BenchmarkBasicSend) {
 
     asg::client::RingStream clientStream(sharedBufPtr, kRingXferSize, doorbell);
     asg::server::RingStream serverStream(sharedBufPtr, kRingXferSize, unavailRead);
+    if (!notifyPos) {
+        context.ring_config->host_features &= ~ASG_HOST_FEATURE_NOTIFY_POS;
+    }
+    if (batch) {
+        clientStream.setBatchSubmission(kRingXferSize / kRingStepSize, 1 << 20);
+    }
 
     FunctorThread clientTestThread([&clientStream]() {
         for (uint32_t i = 0; i < kSends; ++i) {
@@ -104,12 +128,1279 @@ TEST(ASG, BenchmarkBasicSend) {
     auto end = std::chrono::high_resolution_clock::now();
 
     std::chrono::duration<float> duration = end - start;
-    fprintf(stderr, "%s: Sent %zu bytes in %f seconds with %u doorbells and %zu packets. %f MB/s bandwidth, %f Hz doorbells, packet:doorbell ratio %f\n", __func__,
+    fprintf(stderr, "%s: %s%s: Sent %zu bytes in %f seconds with %u doorbells and %zu packets. %f MB/s bandwidth, %f Hz doorbells, packet:doorbell ratio %f, %f doorbells/MB\n", __func__,
+            notifyPos ? "notify pos" : "host state",
+            batch ? ", batched" : "",
             kSends * kSendSizeBytes,
             duration.count(),
             doorbells,
             kSends,
             ((float)kSends * kSendSizeBytes / 1048576.0) / duration.count(),
             (float)doorbells / duration.count(),
-            (float)kSends / (float)doorbells);
+            (float)kSends / (float)doorbells,
+            (float)doorbells / ((float)kSends * kSendSizeBytes / 1048576.0f));
+}
+
+TEST(ASG, BenchmarkBasicSend) {
+    runBasicSend(true, false);
+    runBasicSend(false, false);
+    runBasicSend(true, true);
+    runBasicSend(false, true);
+}
+
+// Benchmark of a workload that alternates between bursts of tiny calls and
+// multi-megabyte uploads, with the client's geometry adapting to it, or pinned
+// by the host to what the client always used before (4 KiB steps and chunks
+// of a quarter of the ring).
+static void runMixedTraffic(bool adaptive) {
+    static constexpr size_t kRingXferSize = 1 << 20;
+    static constexpr size_t kRingStepSize = 16384;
+    static constexpr size_t kRounds = 16;
+    static constexpr size_t kTinyCalls = 4096;
+    static constexpr size_t kTinySizeBytes = 64;
+    static constexpr size_t kUploadSizeBytes = 4 << 20;
+
+    std::vector<uint8_t> sharedBuf(sizeof(struct asg_ring_storage) + kRingXferSize, 0);
+    uint8_t* sharedBufPtr = sharedBuf.data();
+
+    struct asg_context context =
+        asg_context_create((char*)sharedBufPtr, (char*)sharedBufPtr + sizeof(struct asg_ring_storage), kRingXferSize);
+
+    context.ring_config->buffer_size = kRingXferSize;
+    context.ring_config->flush_interval = kRingStepSize;
+    context.ring_config->host_consumed_pos = 0;
+    context.ring_config->transfer_mode = 1;
+    context.ring_config->in_error = 0;
+
+    MessageChannel<int, 1> doorbellChannel;
+    uint32_t doorbells = 0;
+    auto doorbell = [&doorbellChannel, &doorbells]() {
+        doorbellChannel.trySend(0);
+        ++doorbells;
+    };
+    auto unavailRead = [&doorbellChannel]() {
+        int item;
+        doorbellChannel.receive(&item);
+        return 0;
+    };
+
+    asg::client::RingStream clientStream(sharedBufPtr, kRingXferSize, doorbell);
+    asg::server::RingStream serverStream(sharedBufPtr, kRingXferSize, unavailRead);
+    if (!adaptive) {
+        serverStream.setGeometryBounds(4096, 4096, kRingXferSize / 4, kRingXferSize / 4);
+    }
+
+    std::vector<uint8_t> upload(kUploadSizeBytes, 0xff);
+    FunctorThread clientTestThread([&clientStream, &upload]() {
+        for (size_t i = 0; i < kRounds; ++i) {
+            for (size_t j = 0; j < kTinyCalls; ++j) {
+                memset(clientStream.alloc(kTinySizeBytes), 0xff, kTinySizeBytes);
+            }
+            memcpy(clientStream.alloc(kUploadSizeBytes), upload.data(), kUploadSizeBytes);
+        }
+        clientStream.flush();
+    });
+
+    size_t wanted = kRounds * (kTinyCalls * kTinySizeBytes + kUploadSizeBytes);
+    FunctorThread serverTestThread([&serverStream, wanted]() {
+        std::vector<uint8_t> readBuf(1 << 20);
+        for (size_t read = 0; read < wanted;) {
+            size_t chunk = std::min(readBuf.size(), wanted - read);
+            read += serverStream.read(readBuf.data(), chunk);
+        }
+    });
+
+    auto start = std::chrono::high_resolution_clock::now();
+    serverTestThread.start();
+    clientTestThread.start();
+    clientTestThread.wait();
+    serverTestThread.wait();
+    auto end = std::chrono::high_resolution_clock::now();
+
+    std::chrono::duration<float> duration = end - start;
+    float mb = (float)wanted / 1048576.0f;
+    fprintf(stderr, "%s: %s geometry: %f MB/s, %f doorbells/MB\n", __func__,
+            adaptive ? "adaptive" : "fixed",
+            mb / duration.count(), doorbells / mb);
+}
+
+TEST(ASG, BenchmarkMixedTraffic) {
+    runMixedTraffic(false);
+    runMixedTraffic(true);
+}
+
+// Large commands encoded straight into the xfer buffer through alloc(), versus
+// encoded into a heap buffer and copied over by writeFully(), which is what
+// alloc() and flush() used to do for anything bigger than a step.
+static void runLargeCommands(bool inPlace) {
+    static constexpr size_t kRingXferSize = 1 << 20;
+    static constexpr size_t kRingStepSize = 16384;
+    static constexpr size_t kCommandSizeBytes = 128 * 1024;
+    static constexpr size_t kCommands = 4096;
+
+    std::vector<uint8_t> sharedBuf(sizeof(struct asg_ring_storage) + kRingXferSize, 0);
+    uint8_t* sharedBufPtr = sharedBuf.data();
+
+    struct asg_context context =
+        asg_context_create((char*)sharedBufPtr, (char*)sharedBufPtr + sizeof(struct asg_ring_storage), kRingXferSize);
+
+    context.ring_config->buffer_size = kRingXferSize;
+    context.ring_config->flush_interval = kRingStepSize;
+    context.ring_config->host_consumed_pos = 0;
+    context.ring_config->transfer_mode = 1;
+    context.ring_config->in_error = 0;
+
+    MessageChannel<int, 1> doorbellChannel;
+    auto doorbell = [&doorbellChannel]() { doorbellChannel.trySend(0); };
+    auto unavailRead = [&doorbellChannel]() {
+        int item;
+        doorbellChannel.receive(&item);
+        return 0;
+    };
+
+    asg::client::RingStream clientStream(sharedBufPtr, kRingXferSize, doorbell);
+    asg::server::RingStream serverStream(sharedBufPtr, kRingXferSize, unavailRead);
+
+    FunctorThread clientTestThread([&clientStream, inPlace]() {
+        std::vector<uint8_t> staging(kCommandSizeBytes);
+        for (size_t i = 0; i < kCommands; ++i) {
+            if (inPlace) {
+                memset(clientStream.alloc(kCommandSizeBytes), (int)i, kCommandSizeBytes);
+                clientStream.flush();
+            } else {
+                memset(staging.data(), (int)i, kCommandSizeBytes);
+                clientStream.writeFully(staging.data(), kCommandSizeBytes);
+            }
+        }
+    });
+
+    size_t wanted = kCommands * kCommandSizeBytes;
+    FunctorThread serverTestThread([&serverStream, wanted]() {
+        std::vector<uint8_t> readBuf(kCommandSizeBytes);
+        for (size_t read = 0; read < wanted;) {
+            size_t chunk = std::min(readBuf.size(), wanted - read);
+            read += serverStream.read(readBuf.data(), chunk);
+        }
+    });
+
+    auto start = std::chrono::high_resolution_clock::now();
+    serverTestThread.start();
+    clientTestThread.start();
+    clientTestThread.wait();
+    serverTestThread.wait();
+    auto end = std::chrono::high_resolution_clock::now();
+
+    std::chrono::duration<float> duration = end - start;
+    fprintf(stderr, "%s: %s: %f MB/s, %f us/command\n", __func__,
+            inPlace ? "in place" : "copied",
+            ((float)wanted / 1048576.0f) / duration.count(),
+            duration.count() * 1e6f / (float)kCommands);
+}
+
+TEST(ASG, BenchmarkLargeCommands) {
+    runLargeCommands(false);
+    runLargeCommands(true);
+}
+
+// Uploads of 1 MiB payloads, with and without the payload cache, cycling
+// through a set of them that fits in the host's cache or all different (so
+// that the cache only costs the hashing).
+static void runPayloadCacheUploads(bool useCache, bool repeated) {
+    static constexpr size_t kRingXferSize = 1 << 20;
+    static constexpr size_t kRingStepSize = 16384;
+    static constexpr size_t kUploadSizeBytes = 1 << 20;
+    static constexpr size_t kDistinctUploads = 8;
+    static constexpr size_t kUploads = 512;
+
+    std::vector<uint8_t> sharedBuf(sizeof(struct asg_ring_storage) + kRingXferSize, 0);
+    uint8_t* sharedBufPtr = sharedBuf.data();
+
+    struct asg_context context =
+        asg_context_create((char*)sharedBufPtr, (char*)sharedBufPtr + sizeof(struct asg_ring_storage), kRingXferSize);
+
+    context.ring_config->buffer_size = kRingXferSize;
+    context.ring_config->flush_interval = kRingStepSize;
+    context.ring_config->host_consumed_pos = 0;
+    context.ring_config->transfer_mode = 1;
+    context.ring_config->in_error = 0;
+
+    MessageChannel<int, 1> doorbellChannel;
+    auto doorbell = [&doorbellChannel]() { doorbellChannel.trySend(0); };
+    auto unavailRead = [&doorbellChannel]() {
+        int item;
+        doorbellChannel.receive(&item);
+        return 0;
+    };
+
+    asg::server::RingStream serverStream(sharedBufPtr, kRingXferSize, unavailRead);
+    asg::client::RingStream clientStream(sharedBufPtr, kRingXferSize, doorbell);
+    if (useCache) {
+        serverStream.setPayloadCacheSize(16 * kUploadSizeBytes);
+        clientStream.setPayloadCache(64 * 1024);
+    }
+
+    std::vector<std::vector<uint8_t>> uploads(kDistinctUploads);
+    for (size_t i = 0; i < kDistinctUploads; ++i) {
+        uploads[i].resize(kUploadSizeBytes, (uint8_t)i);
+    }
+
+    FunctorThread clientTestThread([&clientStream, &uploads, repeated]() {
+        for (size_t i = 0; i < kUploads; ++i) {
+            std::vector<uint8_t>& upload = uploads[i % kDistinctUploads];
+            // Changing the first word each time keeps them all different.
+            if (!repeated) memcpy(upload.data(), &i, sizeof(i));
+            clientStream.writeFully(upload.data(), kUploadSizeBytes);
+        }
+        clientStream.flush();
+    });
+
+    size_t wanted = kUploads * kUploadSizeBytes;
+    FunctorThread serverTestThread([&serverStream, wanted]() {
+        std::vector<uint8_t> readBuf(1 << 20);
+        for (size_t read = 0; read < wanted;) {
+            size_t chunk = std::min(readBuf.size(), wanted - read);
+            read += serverStream.read(readBuf.data(), chunk);
+        }
+    });
+
+    uint32_t startPos = context.to_host_large_xfer.ring->write_pos;
+    auto start = std::chrono::high_resolution_clock::now();
+    serverTestThread.start();
+    clientTestThread.start();
+    clientTestThread.wait();
+    serverTestThread.wait();
+    auto end = std::chrono::high_resolution_clock::now();
+    uint32_t ringBytes = context.to_host_large_xfer.ring->write_pos - startPos;
+
+    std::chrono::duration<float> duration = end - start;
+    fprintf(stderr, "%s: %s, %s: %f MB/s, %f MB through the ring\n", __func__,
+            useCache ? "cache" : "no cache",
+            repeated ? "repeated" : "all different",
+            ((float)wanted / 1048576.0f) / duration.count(),
+            (float)ringBytes / 1048576.0f);
+}
+
+TEST(ASG, BenchmarkPayloadCache) {
+    static constexpr size_t kHashSizeBytes = 1 << 20;
+    static constexpr size_t kHashes = 1024;
+
+    std::vector<uint8_t> data(kHashSizeBytes, 0x5a);
+    uint64_t sink = 0;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < kHashes; ++i) {
+        data[0] = (uint8_t)i;
+        sink += asg::hashPayload(data.data(), data.size()).hash[0];
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<float> duration = end - start;
+    fprintf(stderr, "%s: hashPayload: %f MB/s (%" PRIx64 ")\n", __func__,
+            ((float)(kHashes * kHashSizeBytes) / 1048576.0f) / duration.count(),
+            sink);
+
+    runPayloadCacheUploads(false, true);
+    runPayloadCacheUploads(true, true);
+    runPayloadCacheUploads(false, false);
+    runPayloadCacheUploads(true, false);
+}
+
+// Commands made of a header and several payloads, gathered into a staging
+// buffer and sent with writeFully, or sent as they are with writeFullyv.
+static void runGatheredCommands(bool vectored) {
+    static constexpr size_t kRingXferSize = 1 << 20;
+    static constexpr size_t kRingStepSize = 16384;
+    static constexpr size_t kHeaderSizeBytes = 64;
+    static constexpr size_t kPayloads = 4;
+    static constexpr size_t kPayloadSizeBytes = 64 * 1024;
+    static constexpr size_t kCommandSizeBytes = kHeaderSizeBytes + kPayloads * kPayloadSizeBytes;
+    static constexpr size_t kCommands = 4096;
+
+    std::vector<uint8_t> sharedBuf(sizeof(struct asg_ring_storage) + kRingXferSize, 0);
+    uint8_t* sharedBufPtr = sharedBuf.data();
+
+    struct asg_context context =
+        asg_context_create((char*)sharedBufPtr, (char*)sharedBufPtr + sizeof(struct asg_ring_storage), kRingXferSize);
+
+    context.ring_config->buffer_size = kRingXferSize;
+    context.ring_config->flush_interval = kRingStepSize;
+    context.ring_config->host_consumed_pos = 0;
+    context.ring_config->transfer_mode = 1;
+    context.ring_config->in_error = 0;
+
+    MessageChannel<int, 1> doorbellChannel;
+    auto doorbell = [&doorbellChannel]() { doorbellChannel.trySend(0); };
+    auto unavailRead = [&doorbellChannel]() {
+        int item;
+        doorbellChannel.receive(&item);
+        return 0;
+    };
+
+    asg::client::RingStream clientStream(sharedBufPtr, kRingXferSize, doorbell);
+    asg::server::RingStream serverStream(sharedBufPtr, kRingXferSize, unavailRead);
+
+    FunctorThread clientTestThread([&clientStream, vectored]() {
+        std::vector<uint8_t> header(kHeaderSizeBytes, 0x11);
+        std::vector<uint8_t> payload(kPayloadSizeBytes, 0x22);
+        std::vector<uint8_t> staging(kCommandSizeBytes);
+
+        struct iovec iov[1 + kPayloads];
+        iov[0] = { header.data(), kHeaderSizeBytes };
+        for (size_t i = 1; i <= kPayloads; ++i) {
+            iov[i] = { payload.data(), kPayloadSizeBytes };
+        }
+
+        for (size_t i = 0; i < kCommands; ++i) {
+            if (vectored) {
+                clientStream.writeFullyv(iov, 1 + kPayloads);
+            } else {
+                uint8_t* dst = staging.data();
+                for (const struct iovec& seg : iov) {
+                    memcpy(dst, seg.iov_base, seg.iov_len);
+                    dst += seg.iov_len;
+                }
+                clientStream.writeFully(staging.data(), kCommandSizeBytes);
+            }
+        }
+    });
+
+    size_t wanted = kCommands * kCommandSizeBytes;
+    FunctorThread serverTestThread([&serverStream, wanted]() {
+        std::vector<uint8_t> readBuf(kCommandSizeBytes);
+        for (size_t read = 0; read < wanted;) {
+            size_t chunk = std::min(readBuf.size(), wanted - read);
+            read += serverStream.read(readBuf.data(), chunk);
+        }
+    });
+
+    auto start = std::chrono::high_resolution_clock::now();
+    serverTestThread.start();
+    clientTestThread.start();
+    clientTestThread.wait();
+    serverTestThread.wait();
+    auto end = std::chrono::high_resolution_clock::now();
+
+    std::chrono::duration<float> duration = end - start;
+    fprintf(stderr, "%s: %s: %f MB/s, %f us/command\n", __func__,
+            vectored ? "writeFullyv" : "staged",
+            ((float)wanted / 1048576.0f) / duration.count(),
+            duration.count() * 1e6f / (float)kCommands);
+}
+
+TEST(ASG, BenchmarkGatheredCommands) {
+    runGatheredCommands(false);
+    runGatheredCommands(true);
+}
+
+// Uploads encoded into two alternating buffers and sent with writeFully, or
+// queued with the token-returning writeFullyAsync so that encoding the next
+// one overlaps sending the last.
+static void runAsyncUploads(bool async) {
+    static constexpr size_t kRingXferSize = 1 << 20;
+    static constexpr size_t kRingStepSize = 16384;
+    static constexpr size_t kUploadSizeBytes = 1 << 20;
+    static constexpr size_t kUploads = 512;
+
+    std::vector<uint8_t> sharedBuf(sizeof(struct asg_ring_storage) + kRingXferSize, 0);
+    uint8_t* sharedBufPtr = sharedBuf.data();
+
+    struct asg_context context =
+        asg_context_create((char*)sharedBufPtr, (char*)sharedBufPtr + sizeof(struct asg_ring_storage), kRingXferSize);
+
+    context.ring_config->buffer_size = kRingXferSize;
+    context.ring_config->flush_interval = kRingStepSize;
+    context.ring_config->host_consumed_pos = 0;
+    context.ring_config->transfer_mode = 1;
+    context.ring_config->in_error = 0;
+
+    MessageChannel<int, 1> doorbellChannel;
+    auto doorbell = [&doorbellChannel]() { doorbellChannel.trySend(0); };
+    auto unavailRead = [&doorbellChannel]() {
+        int item;
+        doorbellChannel.receive(&item);
+        return 0;
+    };
+
+    asg::client::RingStream clientStream(sharedBufPtr, kRingXferSize, doorbell);
+    asg::server::RingStream serverStream(sharedBufPtr, kRingXferSize, unavailRead);
+
+    FunctorThread clientTestThread([&clientStream, async]() {
+        std::vector<uint8_t> bufs[2] = {
+            std::vector<uint8_t>(kUploadSizeBytes),
+            std::vector<uint8_t>(kUploadSizeBytes),
+        };
+        asg::client::RingStream::WriteToken tokens[2] = { 0, 0 };
+
+        for (size_t i = 0; i < kUploads; ++i) {
+            std::vector<uint8_t>& buf = bufs[i % 2];
+            if (async) clientStream.waitForWrite(tokens[i % 2]);
+
+            for (size_t j = 0; j < kUploadSizeBytes; ++j) {
+                buf[j] = (uint8_t)(i * 31 + j * 7);
+            }
+
+            if (async) {
+                clientStream.writeFullyAsync(buf.data(), kUploadSizeBytes, &tokens[i % 2]);
+            } else {
+                clientStream.writeFully(buf.data(), kUploadSizeBytes);
+            }
+        }
+        clientStream.flush();
+    });
+
+    size_t wanted = kUploads * kUploadSizeBytes;
+    FunctorThread serverTestThread([&serverStream, wanted]() {
+        std::vector<uint8_t> readBuf(1 << 20);
+        for (size_t read = 0; read < wanted;) {
+            size_t chunk = std::min(readBuf.size(), wanted - read);
+            read += serverStream.read(readBuf.data(), chunk);
+        }
+    });
+
+    auto start = std::chrono::high_resolution_clock::now();
+    serverTestThread.start();
+    clientTestThread.start();
+    clientTestThread.wait();
+    serverTestThread.wait();
+    auto end = std::chrono::high_resolution_clock::now();
+
+    std::chrono::duration<float> duration = end - start;
+    fprintf(stderr, "%s: %s: %f MB/s\n", __func__,
+            async ? "async" : "sync",
+            ((float)wanted / 1048576.0f) / duration.count());
+}
+
+TEST(ASG, BenchmarkAsyncUploads) {
+    runAsyncUploads(false);
+    runAsyncUploads(true);
+}
+
+// Large replies decoded by the guest (here, summed up): copied out twice, as
+// readFully used to through its read-ahead buffer, read straight into the
+// caller's buffer, or decoded in place with peekReply.
+enum class ReplyRead { Copied, Direct, InPlace };
+
+static void runReadback(ReplyRead how) {
+    static constexpr size_t kRingXferSize = 1 << 20;
+    static constexpr size_t kRingStepSize = 16384;
+    static constexpr size_t kReplySizeBytes = 256 * 1024;
+    static constexpr size_t kReplies = 2048;
+
+    std::vector<uint8_t> sharedBuf(sizeof(struct asg_ring_storage) + kRingXferSize, 0);
+    uint8_t* sharedBufPtr = sharedBuf.data();
+
+    struct asg_context context =
+        asg_context_create((char*)sharedBufPtr, (char*)sharedBufPtr + sizeof(struct asg_ring_storage), kRingXferSize);
+
+    context.ring_config->buffer_size = kRingXferSize;
+    context.ring_config->flush_interval = kRingStepSize;
+    context.ring_config->host_consumed_pos = 0;
+    context.ring_config->transfer_mode = 1;
+    context.ring_config->in_error = 0;
+
+    // Both sides sleep while waiting on the other, so that neither spins
+    // the other off the CPU.
+    MessageChannel<int, 1> doorbellChannel;
+    MessageChannel<int, 1> replyChannel;
+    auto doorbell = [&doorbellChannel]() { doorbellChannel.trySend(0); };
+    auto unavailRead = [&doorbellChannel]() {
+        int item;
+        doorbellChannel.receive(&item);
+        return 0;
+    };
+
+    asg::client::RingStream clientStream(sharedBufPtr, kRingXferSize, doorbell);
+    asg::server::RingStream serverStream(sharedBufPtr, kRingXferSize, unavailRead);
+    clientStream.setReplyWaitFunc([&replyChannel]() {
+        int item;
+        replyChannel.receive(&item);
+        return 0;
+    });
+    serverStream.setGuestNotifyFunc([&replyChannel]() { replyChannel.trySend(0); });
+
+    FunctorThread serverTestThread([&serverStream]() {
+        uint32_t request;
+        for (size_t i = 0; i < kReplies; ++i) {
+            serverStream.read(&request, sizeof(request));
+            memset(serverStream.alloc(kReplySizeBytes), 1, kReplySizeBytes);
+            serverStream.flush();
+        }
+    });
+
+    uint64_t sum = 0;
+    FunctorThread clientTestThread([&clientStream, &sum, how]() {
+        std::vector<uint8_t> staging(kReplySizeBytes);
+        std::vector<uint8_t> reply(kReplySizeBytes);
+        auto decode = [&sum](const uint8_t* buf, size_t len) {
+            uint64_t partial = 0;
+            for (size_t i = 0; i < len; ++i) partial += buf[i];
+            sum += partial;
+        };
+
+        for (size_t i = 0; i < kReplies; ++i) {
+            memcpy(clientStream.alloc(sizeof(uint32_t)), &i, sizeof(uint32_t));
+            clientStream.flush();
+
+            switch (how) {
+                case ReplyRead::Copied:
+                    clientStream.readFully(staging.data(), kReplySizeBytes);
+                    memcpy(reply.data(), staging.data(), kReplySizeBytes);
+                    decode(reply.data(), kReplySizeBytes);
+                    break;
+                case ReplyRead::Direct:
+                    clientStream.readFully(reply.data(), kReplySizeBytes);
+                    decode(reply.data(), kReplySizeBytes);
+                    break;
+                case ReplyRead::InPlace:
+                    for (size_t left = kReplySizeBytes; left;) {
+                        struct ring_buffer_spans spans;
+                        ssize_t len = clientStream.peekReply(left, &spans);
+                        if (len <= 0) return;
+                        decode(spans.first, spans.first_len);
+                        decode(spans.second, spans.second_len);
+                        clientStream.releaseReply(len);
+                        left -= len;
+                    }
+                    break;
+            }
+        }
+    });
+
+    auto start = std::chrono::high_resolution_clock::now();
+    serverTestThread.start();
+    clientTestThread.start();
+    clientTestThread.wait();
+    serverTestThread.wait();
+    auto end = std::chrono::high_resolution_clock::now();
+
+    EXPECT_EQ(kReplies * kReplySizeBytes, sum);
+
+    std::chrono::duration<float> duration = end - start;
+    fprintf(stderr, "%s: %s: %f MB/s\n", __func__,
+            how == ReplyRead::Copied ? "copied twice" :
+            how == ReplyRead::Direct ? "direct" : "in place",
+            ((float)(kReplies * kReplySizeBytes) / 1048576.0f) / duration.count());
+}
+
+TEST(ASG, BenchmarkReadback) {
+    runReadback(ReplyRead::Copied);
+    runReadback(ReplyRead::Direct);
+    runReadback(ReplyRead::InPlace);
+}
+
+// Benchmark that measures the cost of the ring index protocol itself by
+// pushing kSteps of kStepSize bytes through a view, writing and reading
+// alternately on one thread so that scheduling does not dominate.
+TEST(ASG, BenchmarkRingBufferViewThroughput) {
+    static constexpr size_t kRingXferSize = 16384;
+    static constexpr size_t kStepSize = 64;
+    static constexpr size_t kSteps = 1024 * 1024 * 8;
+
+    std::vector<uint8_t> sharedBuf(sizeof(struct ring_buffer) + kRingXferSize, 0);
+    struct ring_buffer* r = (struct ring_buffer*)sharedBuf.data();
+    struct ring_buffer_view v;
+    ring_buffer_view_init(r, &v, sharedBuf.data() + sizeof(struct ring_buffer), kRingXferSize);
+
+    uint8_t src[kStepSize];
+    uint8_t dst[kStepSize];
+    memset(src, 0xff, kStepSize);
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < kSteps; ++i) {
+        ring_buffer_view_write(r, &v, src, kStepSize, 1);
+        ring_buffer_view_read(r, &v, dst, kStepSize, 1);
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+
+    EXPECT_EQ(0, memcmp(src, dst, kStepSize));
+
+    std::chrono::duration<float> duration = end - start;
+    fprintf(stderr, "%s: Moved %zu bytes in %zu steps in %f seconds. %f MB/s, %f ns/step\n", __func__,
+            kSteps * kStepSize,
+            kSteps,
+            duration.count(),
+            ((float)kSteps * kStepSize / 1048576.0) / duration.count(),
+            duration.count() * 1e9 / (float)kSteps);
+}
+
+#ifdef __linux__
+
+// Transfers sized so that most of them straddle the end of the ring, through
+// a plain view (split copies) and a double-mapped one (single copies).
+static void runRingBufferWrappingTransfers(const char* name, bool doubleMapped) {
+    static constexpr uint32_t kRingXferSize = 65536;
+    static constexpr size_t kStepSize = 24576;
+    static constexpr size_t kSteps = 1024 * 64;
+
+    struct ring_buffer r;
+    struct ring_buffer_view v;
+    std::vector<uint8_t> plainBuf;
+    uint8_t* buf;
+    if (doubleMapped) {
+        buf = ring_buffer_double_map_create(kRingXferSize, nullptr);
+        ASSERT_NE(nullptr, buf);
+    } else {
+        plainBuf.resize(kRingXferSize);
+        buf = plainBuf.data();
+    }
+    ring_buffer_view_init(&r, &v, buf, kRingXferSize);
+    if (doubleMapped) v.flags |= RING_BUFFER_VIEW_DOUBLE_MAPPED;
+
+    std::vector<uint8_t> src(kStepSize, 0xff);
+    std::vector<uint8_t> dst(kStepSize);
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < kSteps; ++i) {
+        ring_buffer_view_write(&r, &v, src.data(), kStepSize, 1);
+        ring_buffer_view_read(&r, &v, dst.data(), kStepSize, 1);
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+
+    EXPECT_EQ(src, dst);
+    if (doubleMapped) ring_buffer_double_unmap(buf, kRingXferSize);
+
+    std::chrono::duration<float> duration = end - start;
+    fprintf(stderr, "%s: Moved %f MB in %f seconds. %f MB/s\n", name,
+            (float)kSteps * kStepSize / 1048576.0,
+            duration.count(),
+            ((float)kSteps * kStepSize / 1048576.0) / duration.count());
+}
+
+TEST(ASG, BenchmarkRingBufferDoubleMappedView) {
+    runRingBufferWrappingTransfers("split", false);
+    runRingBufferWrappingTransfers("double mapped", true);
+}
+
+#endif // __linux__
+
+// Cost per type1 descriptor going through the to_host ring with the C API
+// versus the inlined asg::ring<> fast paths.
+TEST(ASG, BenchmarkRingDescriptors) {
+    static constexpr size_t kDescriptors = 1024 * 1024 * 16;
+
+    struct ring_buffer r;
+    ring_buffer_init(&r);
+    struct asg_type1_xfer xfer = { 0, 0 };
+    struct asg_type1_xfer got;
+    uint64_t sum = 0;
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < kDescriptors; ++i) {
+        xfer.offset = i;
+        ring_buffer_write(&r, &xfer, sizeof(xfer), 1);
+        ring_buffer_read(&r, &got, sizeof(got), 1);
+        sum += got.offset;
+    }
+    auto mid = std::chrono::high_resolution_clock::now();
+
+    asg::ring<> ring(&r);
+    for (size_t i = 0; i < kDescriptors; ++i) {
+        xfer.offset = i;
+        ring.write(&xfer, sizeof(xfer));
+        ring.read(&got, sizeof(got));
+        sum += got.offset;
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+
+    EXPECT_EQ((uint64_t)kDescriptors * (kDescriptors - 1), sum);
+
+    std::chrono::duration<float> cApi = mid - start;
+    std::chrono::duration<float> inlined = end - mid;
+    fprintf(stderr, "%s: ns/descriptor: C API %f, asg::ring<> %f\n", __func__,
+            cApi.count() * 1e9 / (float)kDescriptors,
+            inlined.count() * 1e9 / (float)kDescriptors);
+}
+
+// Copy bandwidth of each kernel over a range of sizes, to find where the
+// streaming kernels start beating memcpy (which is what
+// RING_BUFFER_COPY_NT_THRESHOLD_MIN should sit at). Each size copies
+// between the same two buffers over and over, as a ring would.
+TEST(ASG, BenchmarkRingBufferCopyKernels) {
+    static constexpr size_t kMinSize = 4096;
+    static constexpr size_t kMaxSize = 16 * 1024 * 1024;
+    static constexpr size_t kBytesPerSize = 512 * 1024 * 1024;
+
+    std::vector<uint8_t> src(kMaxSize, 0xff);
+    std::vector<uint8_t> dst(kMaxSize, 0);
+
+    fprintf(stderr, "%s: GB/s (dispatched: %s, threshold %zu)\n%10s", __func__,
+            ring_buffer_copy_kernel_name(ring_buffer_copy_dispatched_kernel()),
+            ring_buffer_copy_get_nt_threshold(), "size");
+    for (int k = RING_BUFFER_COPY_MEMCPY; k <= RING_BUFFER_COPY_AVX512_NT; ++k) {
+        fprintf(stderr, " %10s", ring_buffer_copy_kernel_name((enum ring_buffer_copy_kernel)k));
+    }
+    fprintf(stderr, "\n");
+
+    for (size_t size = kMinSize; size <= kMaxSize; size *= 4) {
+        fprintf(stderr, "%10zu", size);
+        for (int k = RING_BUFFER_COPY_MEMCPY; k <= RING_BUFFER_COPY_AVX512_NT; ++k) {
+            auto kernel = (enum ring_buffer_copy_kernel)k;
+            if (!ring_buffer_copy_kernel_supported(kernel)) {
+                fprintf(stderr, " %10s", "-");
+                continue;
+            }
+
+            size_t iters = kBytesPerSize / size;
+            auto start = std::chrono::high_resolution_clock::now();
+            for (size_t i = 0; i < iters; ++i) {
+                ring_buffer_copy_with_kernel(kernel, dst.data(), src.data(), size);
+            }
+            auto end = std::chrono::high_resolution_clock::now();
+
+            std::chrono::duration<float> duration = end - start;
+            fprintf(stderr, " %10.2f",
+                    (float)iters * size / 1e9 / duration.count());
+        }
+        fprintf(stderr, "\n");
+    }
+
+    EXPECT_EQ(0, memcmp(src.data(), dst.data(), kMaxSize));
+}
+
+// Benchmark that streams data between two threads through a view with and
+// without the cached remote index. Every reload of the other side's index is
+// a potential cache line transfer between cores, so we report those per MB.
+static void runRingBufferViewTwoThreads(const char* name, bool cached) {
+    static constexpr size_t kRingXferSize = 16384;
+    static constexpr size_t kStepSize = 256;
+    static constexpr size_t kSteps = 1024 * 256;
+
+    std::vector<uint8_t> sharedBuf(sizeof(struct ring_buffer) + kRingXferSize, 0);
+    struct ring_buffer* r = (struct ring_buffer*)sharedBuf.data();
+    struct ring_buffer_view v;
+    ring_buffer_view_init(r, &v, sharedBuf.data() + sizeof(struct ring_buffer), kRingXferSize);
+
+    struct ring_buffer_index_cache producerCache;
+    struct ring_buffer_index_cache consumerCache;
+    ring_buffer_producer_cache_init(r, &producerCache);
+    ring_buffer_consumer_cache_init(r, &consumerCache);
+
+    uint64_t producerRemoteLoads = 0;
+    uint64_t consumerRemoteLoads = 0;
+
+    FunctorThread producer([&]() {
+        uint8_t src[kStepSize];
+        memset(src, 0xff, kStepSize);
+        for (size_t i = 0; i < kSteps; ++i) {
+            while (true) {
+                long res = cached ?
+                    ring_buffer_view_write_cached(r, &v, &producerCache, src, kStepSize, 1) :
+                    ring_buffer_view_write(r, &v, src, kStepSize, 1);
+                if (!cached) ++producerRemoteLoads;
+                if (res) break;
+                std::this_thread::yield();
+            }
+        }
+    });
+
+    FunctorThread consumer([&]() {
+        uint8_t dst[kStepSize];
+        for (size_t i = 0; i < kSteps; ++i) {
+            while (true) {
+                long res = cached ?
+                    ring_buffer_view_read_cached(r, &v, &consumerCache, dst, kStepSize, 1) :
+                    ring_buffer_view_read(r, &v, dst, kStepSize, 1);
+                if (!cached) ++consumerRemoteLoads;
+                if (res) break;
+                std::this_thread::yield();
+            }
+        }
+    });
+
+    auto start = std::chrono::high_resolution_clock::now();
+    consumer.start();
+    producer.start();
+    producer.wait();
+    consumer.wait();
+    auto end = std::chrono::high_resolution_clock::now();
+
+    if (cached) {
+        producerRemoteLoads = producerCache.refreshes;
+        consumerRemoteLoads = consumerCache.refreshes;
+    }
+
+    float mb = (float)kSteps * kStepSize / 1048576.0f;
+    std::chrono::duration<float> duration = end - start;
+    fprintf(stderr, "%s: Moved %f MB in %f seconds. %f MB/s. Remote index loads per MB: producer %f consumer %f\n",
+            name,
+            mb,
+            duration.count(),
+            mb / duration.count(),
+            (float)producerRemoteLoads / mb,
+            (float)consumerRemoteLoads / mb);
+}
+
+TEST(ASG, BenchmarkRingBufferViewRemoteIndexLoads) {
+    runRingBufferViewTwoThreads("uncached", false);
+    runRingBufferViewTwoThreads("cached", true);
+}
+
+// False sharing between the fields each side keeps writing: the guest setting
+// up transfers in asg_ring_config while the host updates its state, in the v1
+// layout (all in to_host's state / config[]) versus v2 (own 128-byte lines).
+static void runRingLayoutFalseSharing(uint32_t layout) {
+    static constexpr size_t kIters = 1024 * 1024 * 16;
+
+    char* storage = (char*)aligned_alloc(
+        ADDRESS_SPACE_GRAPHICS_PAGE_SIZE, sizeof(struct asg_ring_storage));
+    memset(storage, 0, sizeof(struct asg_ring_storage));
+    struct asg_context context = asg_context_create_versioned(
+        storage, nullptr, 0, layout, layout);
+
+    FunctorThread guest([&context]() {
+        for (uint32_t i = 0; i < kIters; ++i) {
+            __atomic_store_n(&context.ring_config->transfer_mode, i, __ATOMIC_RELAXED);
+            __atomic_store_n(&context.ring_config->guest_write_pos, i, __ATOMIC_RELEASE);
+        }
+    });
+
+    FunctorThread host([&context]() {
+        for (uint32_t i = 0; i < kIters; ++i) {
+            __atomic_store_n(context.host_consumed_pos, i, __ATOMIC_RELAXED);
+            __atomic_store_n((uint32_t*)context.host_state, i, __ATOMIC_RELEASE);
+        }
+    });
+
+    auto start = std::chrono::high_resolution_clock::now();
+    guest.start();
+    host.start();
+    guest.wait();
+    host.wait();
+    auto end = std::chrono::high_resolution_clock::now();
+
+    std::chrono::duration<float> duration = end - start;
+    fprintf(stderr, "%s: layout v%u: %f ns/iteration\n", __func__, layout,
+            duration.count() * 1e9 / (float)kIters);
+    free(storage);
+}
+
+// The same for the ring indices: the producer publishing write_pos and
+// polling read_pos while the consumer does the opposite, with the indices
+// where struct ring_buffer has them (adjacent 64-byte lines of one 128-byte
+// pair) versus 128 bytes apart.
+static void runRingIndexFalseSharing(const char* name, size_t readPosOffset) {
+    static constexpr size_t kIters = 1024 * 1024 * 16;
+
+    char* storage = (char*)aligned_alloc(ASG_RING_LINE_SIZE, 4 * ASG_RING_LINE_SIZE);
+    memset(storage, 0, 4 * ASG_RING_LINE_SIZE);
+    uint32_t* writePos = (uint32_t*)(storage + offsetof(struct ring_buffer, write_pos));
+    uint32_t* readPos = (uint32_t*)(storage + readPosOffset);
+
+    FunctorThread producer([writePos, readPos]() {
+        uint32_t seen = 0;
+        for (uint32_t i = 0; i < kIters; ++i) {
+            seen += __atomic_load_n(readPos, __ATOMIC_ACQUIRE);
+            __atomic_store_n(writePos, i, __ATOMIC_RELEASE);
+        }
+        return (intptr_t)seen;
+    });
+
+    FunctorThread consumer([writePos, readPos]() {
+        uint32_t seen = 0;
+        for (uint32_t i = 0; i < kIters; ++i) {
+            seen += __atomic_load_n(writePos, __ATOMIC_ACQUIRE);
+            __atomic_store_n(readPos, i, __ATOMIC_RELEASE);
+        }
+        return (intptr_t)seen;
+    });
+
+    auto start = std::chrono::high_resolution_clock::now();
+    producer.start();
+    consumer.start();
+    producer.wait();
+    consumer.wait();
+    auto end = std::chrono::high_resolution_clock::now();
+
+    std::chrono::duration<float> duration = end - start;
+    fprintf(stderr, "%s: indices %s: %f ns/iteration\n", __func__, name,
+            duration.count() * 1e9 / (float)kIters);
+    free(storage);
+}
+
+TEST(ASG, BenchmarkRingLayoutFalseSharing) {
+    runRingLayoutFalseSharing(ASG_RING_LAYOUT_V1);
+    runRingLayoutFalseSharing(ASG_RING_LAYOUT_V2);
+
+    runRingIndexFalseSharing("as in ring_buffer", offsetof(struct ring_buffer, read_pos));
+    runRingIndexFalseSharing("128 bytes apart",
+                             offsetof(struct ring_buffer, write_pos) + ASG_RING_LINE_SIZE);
+}
+
+// First-touch and steady-state cost of writing through a large xfer buffer,
+// on the heap versus SharedRegions that are prefaulted and / or backed by huge
+// pages (where the machine has any; otherwise they fall back to base pages).
+static void runXferBufferTouch(const char* name, uint8_t* buf, size_t size) {
+    static constexpr size_t kStride = 64;
+    static constexpr size_t kPasses = 4;
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < size; i += kStride) buf[i] = (uint8_t)i;
+    auto mid = std::chrono::high_resolution_clock::now();
+    for (size_t pass = 0; pass < kPasses; ++pass) {
+        for (size_t i = 0; i < size; i += kStride) buf[i] += (uint8_t)pass;
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+
+    std::chrono::duration<float> first = mid - start;
+    std::chrono::duration<float> steady = end - mid;
+    float lines = (float)(size / kStride);
+    fprintf(stderr, "%s: %-22s first touch %f ns/line, steady %f ns/line\n",
+            __func__, name, first.count() * 1e9 / lines,
+            steady.count() * 1e9 / lines / (float)kPasses);
 }
+
+TEST(ASG, BenchmarkSharedRegionFirstTouch) {
+    static constexpr size_t kRingXferSize = 64 * 1024 * 1024;
+
+    uint8_t* heap = (uint8_t*)malloc(kRingXferSize);
+    runXferBufferTouch("heap", heap, kRingXferSize);
+    free(heap);
+
+    struct {
+        const char* name;
+        bool populate;
+        size_t hugePageSize;
+    } configs[] = {
+        { "memfd", false, 0 },
+        { "memfd populated", true, 0 },
+        { "memfd 2M populated", true, 2 * 1024 * 1024 },
+    };
+
+    for (size_t i = 0; i < sizeof(configs) / sizeof(configs[0]); ++i) {
+        asg::SharedRegion::Options options;
+        options.populate = configs[i].populate;
+        options.hugePageSize = configs[i].hugePageSize;
+        auto region = asg::SharedRegion::create(kRingXferSize, options);
+        if (!region) {
+            fprintf(stderr, "%s: %s: unavailable (%s)\n", __func__,
+                    configs[i].name, strerror(errno));
+            continue;
+        }
+        if (configs[i].hugePageSize &&
+            region->pageSize() != configs[i].hugePageSize) {
+            fprintf(stderr, "%s: %s: no huge pages, fell back to %zu byte pages\n",
+                    __func__, configs[i].name, region->pageSize());
+        }
+        runXferBufferTouch(configs[i].name, region->xferBuffer(), kRingXferSize);
+    }
+}
+
+#ifdef __linux__
+
+static const char* doorbellKindName(asg::Doorbell::Kind kind) {
+    switch (kind) {
+        case asg::Doorbell::Kind::Eventfd:
+            return "eventfd";
+        case asg::Doorbell::Kind::Futex:
+            return "futex";
+        case asg::Doorbell::Kind::Pipe:
+            return "pipe";
+        case asg::Doorbell::Kind::UnixSocket:
+            return "unix socket";
+    }
+    return "unknown";
+}
+
+static double processCpuNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// For each kind of doorbell: the cost of ringing one whose waiter is awake
+// (what the client pays on every flush that finds the host busy), and the
+// wake-up latency and CPU time (both processes) per doorbell when ping-ponging
+// between a waiting parent and child process.
+TEST(ASG, BenchmarkDoorbells) {
+    static constexpr uint32_t kRings = 100000;
+    static constexpr uint32_t kPings = 20000;
+
+    uint32_t* futexWords = (uint32_t*)mmap(
+        nullptr, 4096, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    ASSERT_NE(MAP_FAILED, (void*)futexWords);
+
+    asg::Doorbell::Kind kinds[] = {
+        asg::Doorbell::Kind::Eventfd,
+        asg::Doorbell::Kind::Futex,
+        asg::Doorbell::Kind::Pipe,
+        asg::Doorbell::Kind::UnixSocket,
+    };
+
+    for (size_t i = 0; i < sizeof(kinds) / sizeof(kinds[0]); ++i) {
+        futexWords[0] = futexWords[16] = 0;
+        auto ping = asg::Doorbell::create(kinds[i], &futexWords[0]);
+        auto pong = asg::Doorbell::create(kinds[i], &futexWords[16]);
+        ASSERT_NE(nullptr, ping);
+        ASSERT_NE(nullptr, pong);
+
+        auto start = std::chrono::high_resolution_clock::now();
+        for (uint32_t j = 0; j < kRings; ++j) ping->ring();
+        auto end = std::chrono::high_resolution_clock::now();
+        ping->wait();
+        std::chrono::duration<double> awake = end - start;
+
+        pid_t pid = fork();
+        ASSERT_GE(pid, 0);
+        if (pid == 0) {
+            for (uint32_t j = 0; j < kPings; ++j) {
+                ping->wait();
+                pong->ring();
+            }
+            _exit(0);
+        }
+
+        double cpuStart = processCpuNs();
+        start = std::chrono::high_resolution_clock::now();
+        for (uint32_t j = 0; j < kPings; ++j) {
+            ping->ring();
+            pong->wait();
+        }
+        end = std::chrono::high_resolution_clock::now();
+        double parentCpu = processCpuNs() - cpuStart;
+
+        int status = 0;
+        struct rusage usage;
+        ASSERT_EQ(pid, wait4(pid, &status, 0, &usage));
+        double childCpu =
+            (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1e9 +
+            (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1e3;
+
+        std::chrono::duration<double> pingPong = end - start;
+        fprintf(stderr,
+                "%s: %-11s ring while awake %8.1f ns, wake-up latency %8.1f ns, "
+                "CPU %8.1f ns per doorbell\n",
+                __func__, doorbellKindName(kinds[i]),
+                awake.count() * 1e9 / kRings,
+                pingPong.count() * 1e9 / (2 * kPings),
+                (parentCpu + childCpu) / (2 * kPings));
+    }
+
+    munmap(futexWords, 4096);
+}
+
+// Client and server in separate processes sharing a SharedRegion (memfd), as
+// guest and host do, rather than as two threads on a heap buffer.
+//
+// Each side can be pinned to a CPU with ASG_BENCHMARK_CLIENT_CPU and
+// ASG_BENCHMARK_SERVER_CPU (unpinned if unset), and the doorbell picked with
+// ASG_BENCHMARK_DOORBELL=eventfd|futex|pipe|unix (eventfd by default).
+struct CrossProcessStats {
+    uint32_t futexWord;
+    uint32_t unused0[15];
+    uint32_t replyFutexWord;
+    uint32_t unused1[15];
+    uint64_t doorbells;
+};
+
+static int envInt(const char* name, int def) {
+    const char* val = getenv(name);
+    return val && *val ? atoi(val) : def;
+}
+
+static asg::Doorbell::Kind envDoorbellKind() {
+    const char* val = getenv("ASG_BENCHMARK_DOORBELL");
+    if (!val) return asg::Doorbell::Kind::Eventfd;
+    if (!strcmp(val, "futex")) return asg::Doorbell::Kind::Futex;
+    if (!strcmp(val, "pipe")) return asg::Doorbell::Kind::Pipe;
+    if (!strcmp(val, "unix")) return asg::Doorbell::Kind::UnixSocket;
+    return asg::Doorbell::Kind::Eventfd;
+}
+
+static void pinToCpu(int cpu) {
+    if (cpu < 0) return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set)) {
+        fprintf(stderr, "pinToCpu: cannot pin to CPU %d: %s\n", cpu, strerror(errno));
+    }
+}
+
+struct CrossProcessResult {
+    float seconds;
+    uint64_t doorbells;
+    float clientCpuSeconds;
+};
+
+static float cpuSeconds(const struct rusage& usage) {
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+           (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1e-6f;
+}
+
+// Runs |client| in a forked process and |server| in this one over a fresh
+// region, and returns the seconds until both are done, the client's doorbells
+// and the CPU time it took. With |replyDoorbell|, the client sleeps on a second
+// doorbell, rung by the server, while waiting for replies instead of polling.
+static CrossProcessResult runCrossProcess(
+    size_t ringXferSize, size_t ringStepSize,
+    const std::function<void(asg::client::RingStream&)>& client,
+    const std::function<void(asg::server::RingStream&)>& server,
+    bool replyDoorbell = false) {
+    CrossProcessStats* stats = (CrossProcessStats*)mmap(
+        nullptr, sizeof(CrossProcessStats), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    EXPECT_NE(MAP_FAILED, (void*)stats);
+    memset(stats, 0, sizeof(*stats));
+
+    asg::SharedRegion::Options options;
+    options.populate = true;
+    auto region = asg::SharedRegion::create(ringXferSize, options);
+    EXPECT_NE(nullptr, region);
+    auto doorbell = asg::Doorbell::create(envDoorbellKind(), &stats->futexWord);
+    EXPECT_NE(nullptr, doorbell);
+    auto replyBell = asg::Doorbell::create(envDoorbellKind(), &stats->replyFutexWord);
+    EXPECT_NE(nullptr, replyBell);
+
+    struct asg_context context = asg_context_create(
+        (char*)region->data(), (char*)region->xferBuffer(), ringXferSize);
+    context.ring_config->buffer_size = ringXferSize;
+    context.ring_config->flush_interval = ringStepSize;
+    context.ring_config->host_consumed_pos = 0;
+    context.ring_config->transfer_mode = 1;
+    context.ring_config->in_error = 0;
+
+    asg::server::RingStream serverStream(
+        region->data(), ringXferSize, doorbell->unavailableReadFunc());
+    if (replyDoorbell) {
+        serverStream.setGuestNotifyFunc(replyBell->doorbellFunc());
+    }
+
+    struct rusage childrenBefore;
+    getrusage(RUSAGE_CHILDREN, &childrenBefore);
+
+    cpu_set_t oldSet;
+    sched_getaffinity(0, sizeof(oldSet), &oldSet);
+
+    auto start = std::chrono::high_resolution_clock::now();
+    pid_t pid = fork();
+    EXPECT_GE(pid, 0);
+    if (pid == 0) {
+        pinToCpu(envInt("ASG_BENCHMARK_CLIENT_CPU", -1));
+        asg::Doorbell* bell = doorbell.get();
+        asg::client::RingStream clientStream(
+            region->data(), ringXferSize, [stats, bell]() {
+                __atomic_fetch_add(&stats->doorbells, 1, __ATOMIC_RELAXED);
+                bell->ring();
+            });
+        if (replyDoorbell) {
+            clientStream.setReplyWaitFunc(replyBell->unavailableReadFunc());
+        }
+        client(clientStream);
+        clientStream.flush();
+        _exit(0);
+    }
+
+    pinToCpu(envInt("ASG_BENCHMARK_SERVER_CPU", -1));
+    server(serverStream);
+
+    int status = 0;
+    EXPECT_EQ(pid, waitpid(pid, &status, 0));
+    auto end = std::chrono::high_resolution_clock::now();
+    EXPECT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    sched_setaffinity(0, sizeof(oldSet), &oldSet);
+
+    struct rusage childrenAfter;
+    getrusage(RUSAGE_CHILDREN, &childrenAfter);
+
+    CrossProcessResult result;
+    std::chrono::duration<float> duration = end - start;
+    result.seconds = duration.count();
+    result.doorbells = __atomic_load_n(&stats->doorbells, __ATOMIC_RELAXED);
+    result.clientCpuSeconds = cpuSeconds(childrenAfter) - cpuSeconds(childrenBefore);
+    munmap(stats, sizeof(CrossProcessStats));
+    return result;
+}
+
+TEST(ASG, BenchmarkCrossProcess) {
+    static constexpr size_t kRingXferSize = 16384;
+    static constexpr size_t kRingStepSize = 4096;
+    static constexpr size_t kSends = 1024 * 50;
+    static constexpr size_t kSendSizeBytes = 384;
+    static constexpr size_t kLargeSends = 4;
+    static constexpr size_t kLargeSizeBytes = 1024 * 1024;
+    static constexpr uint32_t kRoundTrips = 10000;
+    static constexpr uint32_t kSlowRoundTrips = 1000;
+    static constexpr uint32_t kHostWorkUs = 200;
+
+    fprintf(stderr, "%s: client CPU %d, server CPU %d, doorbell %s\n", __func__,
+            envInt("ASG_BENCHMARK_CLIENT_CPU", -1),
+            envInt("ASG_BENCHMARK_SERVER_CPU", -1),
+            doorbellKindName(envDoorbellKind()));
+
+    // Small packets through type 1 transfers.
+    CrossProcessResult res = runCrossProcess(
+        kRingXferSize, kRingStepSize,
+        [](asg::client::RingStream& stream) {
+            for (size_t i = 0; i < kSends; ++i) {
+                memset(stream.alloc(kSendSizeBytes), 0xff, kSendSizeBytes);
+            }
+        },
+        [](asg::server::RingStream& stream) {
+            std::vector<uint8_t> buf(kSendSizeBytes * 16);
+            size_t wanted = kSends * kSendSizeBytes;
+            for (size_t read = 0; read < wanted;) {
+                size_t chunk = std::min(buf.size(), wanted - read);
+                read += stream.read(buf.data(), chunk);
+            }
+        });
+    float mb = (float)(kSends * kSendSizeBytes) / 1048576.0f;
+    fprintf(stderr, "%s: small writes: %f MB/s, %f doorbells/s, %f doorbells/MB\n",
+            __func__, mb / res.seconds, res.doorbells / res.seconds, res.doorbells / mb);
+
+    // Large type 3 transfers.
+    res = runCrossProcess(
+        kRingXferSize, kRingStepSize,
+        [](asg::client::RingStream& stream) {
+            std::vector<uint8_t> data(kLargeSizeBytes, 0xff);
+            for (size_t i = 0; i < kLargeSends; ++i) {
+                stream.writeFully(data.data(), data.size());
+            }
+        },
+        [](asg::server::RingStream& stream) {
+            std::vector<uint8_t> buf(kLargeSizeBytes);
+            size_t wanted = kLargeSends * kLargeSizeBytes;
+            for (size_t read = 0; read < wanted;) {
+                size_t chunk = std::min(buf.size(), wanted - read);
+                read += stream.read(buf.data(), chunk);
+            }
+        });
+    mb = (float)(kLargeSends * kLargeSizeBytes) / 1048576.0f;
+    fprintf(stderr, "%s: large writes: %f MB/s, %f doorbells/s, %f doorbells/MB\n",
+            __func__, mb / res.seconds, res.doorbells / res.seconds, res.doorbells / mb);
+
+    // Latency of a small request and its reply, and the client's CPU time
+    // per round trip, with the client polling for the reply or sleeping on
+    // the reply doorbell, and the server replying right away or after
+    // kHostWorkUs of (sleeping) work.
+    for (uint32_t hostWorkUs : { 0u, kHostWorkUs }) {
+        for (bool replyDoorbell : { false, true }) {
+            uint32_t roundTrips = hostWorkUs ? kSlowRoundTrips : kRoundTrips;
+            res = runCrossProcess(
+                kRingXferSize, kRingStepSize,
+                [roundTrips](asg::client::RingStream& stream) {
+                    std::vector<uint8_t> reply(kSendSizeBytes);
+                    for (size_t i = 0; i < roundTrips; ++i) {
+                        memset(stream.alloc(kSendSizeBytes), 0xff, kSendSizeBytes);
+                        stream.readback(reply.data(), kSendSizeBytes);
+                    }
+                },
+                [roundTrips, hostWorkUs](asg::server::RingStream& stream) {
+                    std::vector<uint8_t> buf(kSendSizeBytes);
+                    for (size_t i = 0; i < roundTrips; ++i) {
+                        for (size_t read = 0; read < kSendSizeBytes;) {
+                            read += stream.read(buf.data() + read, kSendSizeBytes - read);
+                        }
+                        if (hostWorkUs) usleep(hostWorkUs);
+                        stream.writeFully(buf.data(), kSendSizeBytes);
+                    }
+                },
+                replyDoorbell);
+            fprintf(stderr, "%s: round trips (host work %u us, %s): %f us each, "
+                    "client CPU %f us each, %f doorbells/round trip\n",
+                    __func__, hostWorkUs, replyDoorbell ? "reply doorbell" : "polling",
+                    res.seconds * 1e6 / roundTrips,
+                    res.clientCpuSeconds * 1e6 / roundTrips,
+                    (float)res.doorbells / roundTrips);
+        }
+    }
+}
+
+#endif // __linux__
@@ -1,16 +1,32 @@
+#include "base/asg_doorbell.h"
+#include "base/asg_payload_cache.h"
+#include "base/asg_shared_region.h"
 #include "base/asg_types.h"
+#include "base/ring.h"
 #include "base/ring_buffer.h"
+#include "base/ring_buffer_copy.h"
 #include "base/FunctorThread.h"
 #include "base/MessageChannel.h"
 
 #include "client/asg_ring_stream_client.h"
+#include "client/asg_transfer_geometry.h"
 #include "server/asg_ring_stream_server.h"
 
 #include <gtest/gtest.h>
 #include <inttypes.h>
 
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#include <chrono>
 #include <functional>
 #include <random>
+#include <thread>
 #include <vector>
 
 using android::base::MessageChannel;
@@ -268,3 +284,2190 @@ TEST(ASG, RandomTraffic) {
     clientTestThread.wait();
     serverTestThread.wait();
 }
+
+// Litmus-style checks for the ring index protocol. These run the producer and
+// consumer on separate threads with no other synchronization, so any missing
+// acquire/release pairing shows up as the consumer observing a published
+// index before the bytes it guards (message passing), or as both sides
+// owning the sync state at once (mutual exclusion).
+TEST(ASG, RingBufferMessagePassingLitmus) {
+    static constexpr size_t kRingXferSize = 4096;
+    static constexpr uint32_t kMessages = 1 << 18;
+    static constexpr uint32_t kWordsPerMessage = 3;
+
+    std::vector<uint8_t> sharedBuf(sizeof(struct ring_buffer) + kRingXferSize, 0);
+    struct ring_buffer* r = (struct ring_buffer*)sharedBuf.data();
+    struct ring_buffer_view v;
+    ring_buffer_view_init(r, &v, sharedBuf.data() + sizeof(struct ring_buffer), kRingXferSize);
+
+    FunctorThread producer([r, &v]() {
+        uint32_t msg[kWordsPerMessage];
+        for (uint32_t i = 0; i < kMessages; ++i) {
+            for (uint32_t j = 0; j < kWordsPerMessage; ++j) {
+                msg[j] = i * kWordsPerMessage + j;
+            }
+            while (!ring_buffer_view_write(r, &v, msg, sizeof(msg), 1)) {
+                std::this_thread::yield();
+            }
+        }
+    });
+
+    uint32_t mismatches = 0;
+    FunctorThread consumer([r, &v, &mismatches]() {
+        uint32_t msg[kWordsPerMessage];
+        for (uint32_t i = 0; i < kMessages; ++i) {
+            while (!ring_buffer_view_read(r, &v, msg, sizeof(msg), 1)) {
+                std::this_thread::yield();
+            }
+            for (uint32_t j = 0; j < kWordsPerMessage; ++j) {
+                if (msg[j] != i * kWordsPerMessage + j) ++mismatches;
+            }
+        }
+    });
+
+    consumer.start();
+    producer.start();
+    producer.wait();
+    consumer.wait();
+
+    EXPECT_EQ(0u, mismatches);
+    EXPECT_EQ(0u, ring_buffer_available_read(r, &v));
+}
+
+TEST(ASG, RingBufferStaticMessagePassingLitmus) {
+    static constexpr uint32_t kMessages = 1 << 18;
+
+    struct ring_buffer r;
+    ring_buffer_init(&r);
+
+    FunctorThread producer([&r]() {
+        for (uint32_t i = 0; i < kMessages; ++i) {
+            uint64_t msg = ((uint64_t)i << 32) | ~i;
+            while (!ring_buffer_write(&r, &msg, sizeof(msg), 1)) {
+                std::this_thread::yield();
+            }
+        }
+    });
+
+    uint32_t mismatches = 0;
+    FunctorThread consumer([&r, &mismatches]() {
+        for (uint32_t i = 0; i < kMessages; ++i) {
+            uint64_t msg;
+            while (!ring_buffer_read(&r, &msg, sizeof(msg), 1)) {
+                std::this_thread::yield();
+            }
+            if (msg != (((uint64_t)i << 32) | ~i)) ++mismatches;
+        }
+    });
+
+    consumer.start();
+    producer.start();
+    producer.wait();
+    consumer.wait();
+
+    EXPECT_EQ(0u, mismatches);
+}
+
+TEST(ASG, RingBufferSyncStateLitmus) {
+    static constexpr uint32_t kRounds = 1 << 16;
+
+    struct ring_buffer r;
+    ring_buffer_init(&r);
+    ring_buffer_sync_init(&r);
+
+    // Plain (non-atomic) data handed from owner to owner through the sync
+    // state only.
+    uint32_t owner = 0;
+    uint32_t handoffs = 0;
+    uint32_t violations = 0;
+    bool consumerDone = false;
+
+    // Only the producer can take the channel back from a hung up consumer,
+    // so it keeps going until the consumer has finished all its rounds.
+    FunctorThread producer([&]() {
+        while (!__atomic_load_n(&consumerDone, __ATOMIC_ACQUIRE)) {
+            if (ring_buffer_producer_acquire(&r) ||
+                ring_buffer_producer_acquire_from_hangup(&r)) {
+                owner = 1;
+                ++handoffs;
+                std::this_thread::yield();
+                if (owner != 1) ++violations;
+                ring_buffer_producer_idle(&r);
+            }
+            std::this_thread::yield();
+        }
+    });
+
+    uint32_t consumerRounds = 0;
+    FunctorThread consumer([&]() {
+        while (consumerRounds < kRounds) {
+            if (ring_buffer_consumer_hangup(&r)) {
+                owner = 2;
+                ++handoffs;
+                std::this_thread::yield();
+                if (owner != 2) ++violations;
+                ring_buffer_consumer_hung_up(&r);
+                ++consumerRounds;
+            }
+            std::this_thread::yield();
+        }
+        __atomic_store_n(&consumerDone, true, __ATOMIC_RELEASE);
+    });
+
+    consumer.start();
+    producer.start();
+    producer.wait();
+    consumer.wait();
+
+    EXPECT_EQ(0u, violations);
+    EXPECT_EQ(kRounds, consumerRounds);
+    EXPECT_LE(2 * kRounds - 1, handoffs);
+}
+
+TEST(ASG, RingBufferCachedIndex) {
+    static constexpr size_t kRingXferSize = 1024;
+    static constexpr uint32_t kStepSize = 24;
+    static constexpr uint32_t kRounds = 1000;
+
+    std::vector<uint8_t> sharedBuf(sizeof(struct ring_buffer) + kRingXferSize, 0);
+    struct ring_buffer* r = (struct ring_buffer*)sharedBuf.data();
+    struct ring_buffer_view v;
+    ring_buffer_view_init(r, &v, sharedBuf.data() + sizeof(struct ring_buffer), kRingXferSize);
+
+    struct ring_buffer_index_cache producerCache;
+    struct ring_buffer_index_cache consumerCache;
+    ring_buffer_producer_cache_init(r, &producerCache);
+    ring_buffer_consumer_cache_init(r, &consumerCache);
+
+    uint8_t src[kStepSize];
+    uint8_t dst[kStepSize];
+    uint32_t written = 0;
+    uint32_t read = 0;
+
+    for (uint32_t round = 0; round < kRounds; ++round) {
+        // Fill the ring completely, then drain it, so positions wrap at
+        // different offsets every round.
+        while (true) {
+            memset(src, (uint8_t)written, kStepSize);
+            if (!ring_buffer_view_write_cached(r, &v, &producerCache, src, kStepSize, 1)) break;
+            ++written;
+        }
+        EXPECT_LT(ring_buffer_available_write(r, &v), kStepSize);
+
+        while (ring_buffer_available_read_cached(r, &v, &consumerCache)) {
+            ASSERT_EQ(1, ring_buffer_view_read_cached(r, &v, &consumerCache, dst, kStepSize, 1));
+            memset(src, (uint8_t)read, kStepSize);
+            EXPECT_EQ(0, memcmp(src, dst, kStepSize));
+            ++read;
+        }
+    }
+
+    EXPECT_EQ(written, read);
+
+    // The remote index is reloaded about once per fill and once per drain, not
+    // once per step.
+    uint32_t stepsPerFill = written / kRounds;
+    EXPECT_GT(stepsPerFill, 10u);
+    EXPECT_LE(producerCache.refreshes, 2 * kRounds);
+    EXPECT_LE(consumerCache.refreshes, 2 * kRounds);
+}
+
+TEST(ASG, RingBufferWritevReadv) {
+    static constexpr size_t kRingXferSize = 256;
+
+    std::vector<uint8_t> sharedBuf(sizeof(struct ring_buffer) + kRingXferSize, 0);
+    struct ring_buffer* r = (struct ring_buffer*)sharedBuf.data();
+    struct ring_buffer_view v;
+    ring_buffer_view_init(r, &v, sharedBuf.data() + sizeof(struct ring_buffer), kRingXferSize);
+
+    uint32_t header = 0xabcd1234;
+    std::vector<uint8_t> payload(100, 0x5a);
+    std::vector<uint8_t> big(200, 0x77);
+
+    // Move the positions so that the gathered write wraps around the end.
+    std::vector<uint8_t> filler(200);
+    EXPECT_EQ(1, ring_buffer_view_write(r, &v, filler.data(), filler.size(), 1));
+    EXPECT_EQ(1, ring_buffer_view_read(r, &v, filler.data(), filler.size(), 1));
+
+    uint32_t writePosBefore = r->write_pos;
+    struct ring_buffer_iovec out[] = {
+        { &header, sizeof(header) },
+        { payload.data(), (uint32_t)payload.size() },
+        { big.data(), (uint32_t)big.size() },
+    };
+
+    // Only the first two segments fit; they are published together.
+    EXPECT_EQ(2, ring_buffer_writev(r, &v, out, 3));
+    EXPECT_EQ(writePosBefore + sizeof(header) + payload.size(), r->write_pos);
+
+    uint32_t headerIn = 0;
+    std::vector<uint8_t> payloadIn(payload.size());
+    struct ring_buffer_iovec in[] = {
+        { &headerIn, sizeof(headerIn) },
+        { payloadIn.data(), (uint32_t)payloadIn.size() },
+    };
+    EXPECT_EQ(2, ring_buffer_readv(r, &v, in, 2));
+    EXPECT_EQ(header, headerIn);
+    EXPECT_EQ(payload, payloadIn);
+    EXPECT_EQ(0u, ring_buffer_available_read(r, &v));
+
+    // Statically allocated ring.
+    struct ring_buffer sr;
+    ring_buffer_init(&sr);
+    EXPECT_EQ(2, ring_buffer_writev(&sr, nullptr, out, 2));
+    headerIn = 0;
+    EXPECT_EQ(2, ring_buffer_readv(&sr, nullptr, in, 2));
+    EXPECT_EQ(header, headerIn);
+    EXPECT_EQ(payload, payloadIn);
+}
+
+TEST(ASG, RingBufferMultiStepPublishesOnce) {
+    struct ring_buffer r;
+    ring_buffer_init(&r);
+
+    uint64_t items[8] = { 0, 1, 2, 3, 4, 5, 6, 7 };
+    EXPECT_EQ(8, ring_buffer_write(&r, items, sizeof(uint64_t), 8));
+    EXPECT_EQ(sizeof(items), r.write_pos);
+
+    // Asking for more than fits transfers the whole steps that do.
+    std::vector<uint8_t> big(RING_BUFFER_SIZE);
+    EXPECT_EQ((long)(RING_BUFFER_SIZE / 512 - 1), ring_buffer_write(&r, big.data(), 512, 4));
+
+    uint64_t itemsIn[8];
+    EXPECT_EQ(8, ring_buffer_read(&r, itemsIn, sizeof(uint64_t), 8));
+    EXPECT_EQ(0, memcmp(items, itemsIn, sizeof(items)));
+}
+
+TEST(ASG, RingBufferReserveCommitPeekConsume) {
+    static constexpr size_t kRingXferSize = 256;
+
+    std::vector<uint8_t> sharedBuf(sizeof(struct ring_buffer) + kRingXferSize, 0);
+    struct ring_buffer* r = (struct ring_buffer*)sharedBuf.data();
+    struct ring_buffer_view v;
+    uint8_t* buf = sharedBuf.data() + sizeof(struct ring_buffer);
+    ring_buffer_view_init(r, &v, buf, kRingXferSize);
+
+    std::vector<uint8_t> filler(200);
+    EXPECT_EQ(1, ring_buffer_view_write(r, &v, filler.data(), filler.size(), 1));
+    EXPECT_EQ(1, ring_buffer_view_read(r, &v, filler.data(), filler.size(), 1));
+
+    // A reservation that wraps comes back as two spans inside the buffer.
+    struct ring_buffer_spans spans;
+    EXPECT_EQ(100u, ring_buffer_view_reserve_write(r, &v, nullptr, 100, &spans));
+    EXPECT_EQ(buf + 200, spans.first);
+    EXPECT_EQ(56u, spans.first_len);
+    EXPECT_EQ(buf, spans.second);
+    EXPECT_EQ(44u, spans.second_len);
+    memset(spans.first, 0x11, spans.first_len);
+    memset(spans.second, 0x22, spans.second_len);
+
+    // Nothing is visible until commit.
+    EXPECT_EQ(0u, ring_buffer_available_read(r, &v));
+    ring_buffer_commit_write(r, 100);
+    EXPECT_EQ(100u, ring_buffer_available_read(r, &v));
+
+    // Reservations are capped by free space.
+    EXPECT_EQ(kRingXferSize - 1 - 100,
+              ring_buffer_view_reserve_write(r, &v, nullptr, kRingXferSize, &spans));
+
+    struct ring_buffer_index_cache consumerCache;
+    ring_buffer_consumer_cache_init(r, &consumerCache);
+
+    EXPECT_EQ(100u, ring_buffer_view_peek_read(r, &v, &consumerCache, 1000, &spans));
+    EXPECT_EQ(buf + 200, spans.first);
+    EXPECT_EQ(56u, spans.first_len);
+    EXPECT_EQ(44u, spans.second_len);
+    for (uint32_t i = 0; i < spans.first_len; ++i) EXPECT_EQ(0x11, spans.first[i]);
+    for (uint32_t i = 0; i < spans.second_len; ++i) EXPECT_EQ(0x22, spans.second[i]);
+
+    ring_buffer_consume_read(r, 56);
+    EXPECT_EQ(44u, ring_buffer_view_peek_read(r, &v, &consumerCache, 44, &spans));
+    EXPECT_EQ(buf, spans.first);
+    EXPECT_EQ(nullptr, spans.second);
+    ring_buffer_consume_read(r, 44);
+    EXPECT_EQ(0u, ring_buffer_available_read(r, &v));
+
+    // Statically allocated ring.
+    struct ring_buffer sr;
+    ring_buffer_init(&sr);
+    EXPECT_EQ(8u, ring_buffer_view_reserve_write(&sr, nullptr, nullptr, 8, &spans));
+    EXPECT_EQ(sr.buf, spans.first);
+    memcpy(spans.first, "asgring", 8);
+    ring_buffer_commit_write(&sr, 8);
+    EXPECT_EQ(8u, ring_buffer_view_peek_read(&sr, nullptr, nullptr, 8, &spans));
+    EXPECT_STREQ("asgring", (const char*)spans.first);
+    ring_buffer_consume_read(&sr, 8);
+}
+
+TEST(ASG, RingBufferCopyContentsWrapsAtReadPos) {
+    struct ring_buffer r;
+    ring_buffer_init(&r);
+
+    // Leave read_pos 8 bytes before the end, with 16 bytes queued.
+    std::vector<uint8_t> filler(RING_BUFFER_SIZE - 8);
+    EXPECT_EQ(1, ring_buffer_write(&r, filler.data(), filler.size(), 1));
+    EXPECT_EQ(1, ring_buffer_read(&r, filler.data(), filler.size(), 1));
+
+    uint64_t items[2] = { 0x1111111111111111ULL, 0x2222222222222222ULL };
+    EXPECT_EQ(2, ring_buffer_write(&r, items, sizeof(uint64_t), 2));
+
+    uint64_t copied[2] = { 0, 0 };
+    EXPECT_EQ(0, ring_buffer_copy_contents(&r, nullptr, sizeof(copied), (uint8_t*)copied));
+    EXPECT_EQ(items[0], copied[0]);
+    EXPECT_EQ(items[1], copied[1]);
+}
+
+TEST(ASG, RingBufferWaitPolicy) {
+    struct ring_buffer r;
+    ring_buffer_init(&r);
+
+    struct ring_buffer_wait_policy policy;
+    ring_buffer_wait_policy_init(&policy);
+    policy.spin_budget = 4096;
+    policy.min_spins = 64;
+    policy.max_spins = 8192;
+
+    // Data that is already there is a live wait with no spins, which
+    // pulls the budget down.
+    uint32_t val = 1;
+    ring_buffer_write(&r, &val, sizeof(val), 1);
+    EXPECT_TRUE(ring_buffer_wait_read_with_policy(
+        &r, nullptr, sizeof(val), &policy, RING_BUFFER_NO_DEADLINE));
+    EXPECT_EQ(4096u - 4096u / 8, policy.spin_budget);
+    EXPECT_EQ(1u, r.read_live_count);
+    EXPECT_EQ(0u, r.read_yield_count);
+    EXPECT_EQ(0u, r.read_sleep_us_count);
+    ring_buffer_read(&r, &val, sizeof(val), 1);
+
+    // A peer that only shows up after a while makes the wait sleep; the
+    // budget heads for the minimum and the sleep is accounted for.
+    for (int i = 0; i < 64; ++i) {
+        std::thread producer([&r]() {
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+            uint32_t v = 2;
+            ring_buffer_write(&r, &v, sizeof(v), 1);
+        });
+        EXPECT_TRUE(ring_buffer_wait_read_with_policy(
+        &r, nullptr, sizeof(val), &policy, RING_BUFFER_NO_DEADLINE));
+        producer.join();
+        ring_buffer_read(&r, &val, sizeof(val), 1);
+        EXPECT_EQ(2u, val);
+    }
+    EXPECT_GT(128u, policy.spin_budget);
+    EXPECT_LE(policy.min_spins, policy.spin_budget);
+    EXPECT_LT(64u * 1000u, r.read_sleep_us_count);
+    EXPECT_LE(64u * policy.yields, r.read_yield_count);
+
+    // A tuning hook sees every wait and overrides the budget, subject to
+    // the policy's bounds.
+    struct Hook {
+        uint32_t calls = 0;
+        static uint32_t tune(void* opaque,
+                             const struct ring_buffer_wait_policy*,
+                             const struct ring_buffer_wait_sample* sample) {
+            Hook* hook = (Hook*)opaque;
+            ++hook->calls;
+            return sample->sleep_us ? 0 : 1000000;
+        }
+    } hook;
+    policy.tune = Hook::tune;
+    policy.tune_opaque = &hook;
+
+    ring_buffer_write(&r, &val, sizeof(val), 1);
+    EXPECT_TRUE(ring_buffer_wait_read_with_policy(
+        &r, nullptr, sizeof(val), &policy, RING_BUFFER_NO_DEADLINE));
+    EXPECT_EQ(1u, hook.calls);
+    EXPECT_EQ(policy.max_spins, policy.spin_budget);
+
+    EXPECT_TRUE(ring_buffer_wait_write_with_policy(
+        &r, nullptr, sizeof(val), &policy, RING_BUFFER_NO_DEADLINE));
+    EXPECT_EQ(2u, hook.calls);
+}
+
+TEST(ASG, RingBufferWaitDeadline) {
+    static constexpr uint64_t kTimeoutNs = 20000000ULL;
+
+    struct ring_buffer r;
+    ring_buffer_init(&r);
+
+    // Nothing to read: gives up at the deadline, not much later.
+    uint64_t start = ring_buffer_monotonic_ns();
+    errno = 0;
+    EXPECT_FALSE(ring_buffer_wait_read_until(
+        &r, nullptr, 1, ring_buffer_deadline_after_ns(kTimeoutNs)));
+    uint64_t elapsed = ring_buffer_monotonic_ns() - start;
+    EXPECT_EQ(-ETIMEDOUT, errno);
+    EXPECT_LE(kTimeoutNs, elapsed);
+    EXPECT_GT(kTimeoutNs * 25, elapsed);
+
+    // Full ring: same for writing; a deadline in the past still succeeds
+    // if there is nothing to wait for.
+    std::vector<uint8_t> fill(RING_BUFFER_SIZE - 1);
+    EXPECT_EQ(1, ring_buffer_write(&r, fill.data(), fill.size(), 1));
+    EXPECT_FALSE(ring_buffer_wait_write_until(
+        &r, nullptr, 1, ring_buffer_deadline_after_ns(kTimeoutNs)));
+    EXPECT_TRUE(ring_buffer_wait_read_until(&r, nullptr, fill.size(), 0));
+
+    EXPECT_EQ(RING_BUFFER_NO_DEADLINE,
+              ring_buffer_deadline_after_ns(RING_BUFFER_NO_DEADLINE - 1));
+}
+
+// With nobody on the other end, both streams give up after their timeout
+// instead of hanging, and stay usable afterwards unless a reply was cut short.
+TEST(ASG, RingStreamTimeouts) {
+    static constexpr size_t kRingXferSize = 16384;
+    static constexpr size_t kRingStepSize = 4096;
+    static constexpr uint64_t kTimeoutNs = 20000000ULL;
+
+    std::vector<uint8_t> sharedBuf(sizeof(struct asg_ring_storage) + kRingXferSize, 0);
+    uint8_t* sharedBufPtr = sharedBuf.data();
+
+    struct asg_context context =
+        asg_context_create((char*)sharedBufPtr, (char*)sharedBufPtr + sizeof(struct asg_ring_storage), kRingXferSize);
+
+    context.ring_config->buffer_size = kRingXferSize;
+    context.ring_config->flush_interval = kRingStepSize;
+    context.ring_config->host_consumed_pos = 0;
+    context.ring_config->transfer_mode = 1;
+    context.ring_config->in_error = 0;
+
+    asg::client::RingStream clientStream(sharedBufPtr, kRingXferSize, []() {});
+    asg::server::RingStream serverStream(sharedBufPtr, kRingXferSize, []() { return 0; });
+    clientStream.setTimeoutNs(kTimeoutNs);
+    serverStream.setTimeoutNs(kTimeoutNs);
+
+    uint8_t byte;
+    errno = 0;
+    EXPECT_EQ(nullptr, clientStream.readFully(&byte, 1));
+    EXPECT_EQ(ETIMEDOUT, errno);
+
+    errno = 0;
+    EXPECT_EQ(0u, serverStream.read(&byte, 1));
+    EXPECT_EQ(ETIMEDOUT, errno);
+
+    // Both directions still work.
+    auto buf = clientStream.alloc(16);
+    memset(buf, 0xab, 16);
+    EXPECT_EQ(0, clientStream.flush());
+
+    std::vector<uint8_t> got(16);
+    size_t read = 0;
+    while (read < got.size()) {
+        read += serverStream.read(got.data() + read, got.size() - read);
+    }
+    EXPECT_EQ(std::vector<uint8_t>(16, 0xab), got);
+
+    buf = serverStream.alloc(16);
+    memset(buf, 0xcd, 16);
+    EXPECT_EQ(16, serverStream.flush());
+    EXPECT_NE(nullptr, clientStream.readFully(got.data(), got.size()));
+    EXPECT_EQ(std::vector<uint8_t>(16, 0xcd), got);
+
+    // A type 3 transfer the host stops consuming: the whole of it fits in
+    // to_host_large_xfer, so only the wait for the host to finish it can
+    // time out.
+    std::vector<uint8_t> large(kRingXferSize / 4, 0xef);
+    errno = 0;
+    EXPECT_EQ(-1, clientStream.writeFully(large.data(), large.size()));
+    EXPECT_EQ(ETIMEDOUT, errno);
+
+    got.assign(large.size(), 0);
+    read = 0;
+    while (read < got.size()) {
+        read += serverStream.read(got.data() + read, got.size() - read);
+    }
+    EXPECT_EQ(large, got);
+
+    // A reply that finds from_host_large_xfer full times out before sending
+    // anything, and can be retried once the guest reads.
+    std::vector<uint8_t> reply(
+        ring_buffer_available_write(context.from_host_large_xfer.ring,
+                                    &context.from_host_large_xfer.view),
+        0x5a);
+    buf = serverStream.alloc(reply.size());
+    memcpy(buf, reply.data(), reply.size());
+    EXPECT_EQ((int)reply.size(), serverStream.flush());
+
+    buf = serverStream.alloc(16);
+    memset(buf, 0xcd, 16);
+    errno = 0;
+    EXPECT_EQ(-1, serverStream.flush());
+    EXPECT_EQ(ETIMEDOUT, errno);
+    EXPECT_EQ(0u, *context.in_error);
+
+    got.assign(reply.size(), 0);
+    EXPECT_NE(nullptr, clientStream.readFully(got.data(), got.size()));
+    EXPECT_EQ(reply, got);
+
+    buf = serverStream.alloc(16);
+    memset(buf, 0xcd, 16);
+    EXPECT_EQ(16, serverStream.flush());
+    got.assign(16, 0);
+    EXPECT_NE(nullptr, clientStream.readFully(got.data(), got.size()));
+    EXPECT_EQ(std::vector<uint8_t>(16, 0xcd), got);
+
+    // One that times out after part of it went out breaks the stream, as the
+    // guest would take the next reply for the rest of this one.
+    reply.assign(kRingXferSize * 2, 0x5a);
+    buf = serverStream.alloc(reply.size());
+    memcpy(buf, reply.data(), reply.size());
+    errno = 0;
+    EXPECT_EQ(-1, serverStream.flush());
+    EXPECT_EQ(ETIMEDOUT, errno);
+    EXPECT_EQ(1u, *context.in_error);
+
+    buf = serverStream.alloc(16);
+    memset(buf, 0xcd, 16);
+    errno = 0;
+    EXPECT_EQ(-1, serverStream.flush());
+    EXPECT_EQ(EPIPE, errno);
+}
+
+// The guest publishing after the host last found the rings empty, but before
+// the host asked for a doorbell, rings none: only the host's second look
+// before sleeping keeps it from sleeping on that data.
+TEST(ASG, RingStreamHostSleepRecheck) {
+    static constexpr size_t kRingXferSize = 16384;
+    static constexpr size_t kRingStepSize = 4096;
+
+    std::vector<uint8_t> sharedBuf(sizeof(struct asg_ring_storage) + kRingXferSize, 0);
+    uint8_t* sharedBufPtr = sharedBuf.data();
+
+    struct asg_context context =
+        asg_context_create((char*)sharedBufPtr, (char*)sharedBufPtr + sizeof(struct asg_ring_storage), kRingXferSize);
+
+    context.ring_config->buffer_size = kRingXferSize;
+    context.ring_config->flush_interval = kRingStepSize;
+    context.ring_config->host_consumed_pos = 0;
+    context.ring_config->transfer_mode = 1;
+    context.ring_config->in_error = 0;
+
+    uint32_t rings = 0;
+    asg::client::RingStream clientStream(sharedBufPtr, kRingXferSize, [&rings]() { ++rings; });
+    asg::server::RingStream serverStream(sharedBufPtr, kRingXferSize, []() { return 0; });
+
+    auto send = [&clientStream]() {
+        auto buf = clientStream.alloc(16);
+        memset(buf, 0xab, 16);
+        EXPECT_EQ(0, clientStream.flush());
+    };
+
+    auto receive = [&serverStream]() {
+        std::vector<uint8_t> got(16);
+        size_t read = 0;
+        while (read < got.size()) {
+            read += serverStream.read(got.data() + read, got.size() - read);
+        }
+        EXPECT_EQ(std::vector<uint8_t>(16, 0xab), got);
+    };
+
+    // The host reads what the guest sent without running dry, so its notify
+    // position stays where it was.
+    send();
+    EXPECT_EQ(1u, rings);
+    receive();
+    EXPECT_EQ(0u, asg::ring<>(context.to_host).available_read());
+
+    // The host has found the rings empty; the guest publishes before the host
+    // asks for a doorbell, and so rings none.
+    send();
+    EXPECT_EQ(1u, rings);
+    EXPECT_NE(0u, asg::ring<>(context.to_host).available_read());
+
+    // The host must not sleep now, as nothing would wake it for that.
+    EXPECT_TRUE(asg_host_prepare_to_sleep(&context));
+    EXPECT_EQ(ASG_HOST_STATE_NEED_NOTIFY, *context.host_state);
+    receive();
+
+    // With the rings really empty it may, and the next publish rings.
+    EXPECT_FALSE(asg_host_prepare_to_sleep(&context));
+    send();
+    EXPECT_EQ(2u, rings);
+    receive();
+}
+
+TEST(ASG, RingStreamNotifyPos) {
+    static constexpr size_t kRingXferSize = 16384;
+    static constexpr size_t kRingStepSize = 4096;
+    static constexpr uint64_t kTimeoutNs = 20000000ULL;
+
+    // Publishes that cross the notify position ring, wrapping included.
+    EXPECT_TRUE(asg_need_notify(0, 8, 0));
+    EXPECT_TRUE(asg_need_notify(8, 16, 8));
+    EXPECT_TRUE(asg_need_notify(12, 16, 8));
+    EXPECT_FALSE(asg_need_notify(16, 16, 8));
+    EXPECT_FALSE(asg_need_notify(0, 16, 8));
+    EXPECT_TRUE(asg_need_notify(0xfffffff8u, 8, 0xfffffff8u));
+    EXPECT_FALSE(asg_need_notify(0xfffffff0u, 8, 0xfffffff8u));
+
+    std::vector<uint8_t> sharedBuf(sizeof(struct asg_ring_storage) + kRingXferSize, 0);
+    uint8_t* sharedBufPtr = sharedBuf.data();
+
+    struct asg_context context =
+        asg_context_create((char*)sharedBufPtr, (char*)sharedBufPtr + sizeof(struct asg_ring_storage), kRingXferSize);
+
+    context.ring_config->buffer_size = kRingXferSize;
+    context.ring_config->flush_interval = kRingStepSize;
+    context.ring_config->host_consumed_pos = 0;
+    context.ring_config->transfer_mode = 1;
+    context.ring_config->in_error = 0;
+
+    uint32_t rings = 0;
+    asg::client::RingStream clientStream(sharedBufPtr, kRingXferSize, [&rings]() { ++rings; });
+    asg::server::RingStream serverStream(sharedBufPtr, kRingXferSize, []() { return 0; });
+    serverStream.setTimeoutNs(kTimeoutNs);
+    EXPECT_TRUE(context.ring_config->host_features & ASG_HOST_FEATURE_NOTIFY_POS);
+
+    auto send = [&clientStream]() {
+        auto buf = clientStream.alloc(16);
+        memset(buf, 0xab, 16);
+        EXPECT_EQ(0, clientStream.flush());
+    };
+
+    auto receive = [&serverStream](size_t size) {
+        std::vector<uint8_t> got(size);
+        size_t read = 0;
+        while (read < size) {
+            read += serverStream.read(got.data() + read, size - read);
+        }
+
+        // Run dry, which is when the server asks for a doorbell.
+        uint8_t byte;
+        EXPECT_EQ(0u, serverStream.read(&byte, 1));
+    };
+
+    // The server starts out wanting a doorbell for the first write only.
+    send();
+    send();
+    EXPECT_EQ(1u, rings);
+
+    // And once it has run dry, for the first write after that.
+    receive(32);
+    send();
+    send();
+    EXPECT_EQ(2u, rings);
+
+    receive(32);
+    std::vector<uint8_t> large(64, 0xcd);
+    EXPECT_EQ(0, clientStream.writeFullyAsync(large.data(), large.size()));
+    EXPECT_EQ(3u, rings);
+    receive(64);
+
+    // Without the feature, the client rings for every write while the server
+    // is not rendering.
+    context.ring_config->host_features &= ~ASG_HOST_FEATURE_NOTIFY_POS;
+    send();
+    send();
+    EXPECT_LE(5u, rings);
+    receive(32);
+}
+
+TEST(ASG, RingStreamReplyWait) {
+    static constexpr size_t kRingXferSize = 16384;
+    static constexpr size_t kRingStepSize = 4096;
+
+    std::vector<uint8_t> sharedBuf(sizeof(struct asg_ring_storage) + kRingXferSize, 0);
+    uint8_t* sharedBufPtr = sharedBuf.data();
+
+    struct asg_context context =
+        asg_context_create((char*)sharedBufPtr, (char*)sharedBufPtr + sizeof(struct asg_ring_storage), kRingXferSize);
+
+    context.ring_config->buffer_size = kRingXferSize;
+    context.ring_config->flush_interval = kRingStepSize;
+    context.ring_config->host_consumed_pos = 0;
+    context.ring_config->transfer_mode = 1;
+    context.ring_config->in_error = 0;
+
+    asg::client::RingStream clientStream(sharedBufPtr, kRingXferSize, []() {});
+    asg::server::RingStream serverStream(sharedBufPtr, kRingXferSize, []() { return 0; });
+
+    uint32_t notifies = 0;
+    serverStream.setGuestNotifyFunc([&notifies]() { ++notifies; });
+
+    auto reply = [&serverStream](uint8_t val) {
+        memset(serverStream.alloc(16), val, 16);
+        EXPECT_EQ(16, serverStream.flush());
+    };
+
+    // The host replies while the guest sleeps, which wakes it.
+    uint32_t waits = 0;
+    clientStream.setReplyWaitFunc([&]() {
+        ++waits;
+        EXPECT_EQ((uint32_t)ASG_GUEST_STATE_NEED_NOTIFY, context.ring_config->guest_state);
+        reply(0xab);
+        return 0;
+    });
+
+    std::vector<uint8_t> got(16);
+    EXPECT_NE(nullptr, clientStream.readFully(got.data(), got.size()));
+    EXPECT_EQ(std::vector<uint8_t>(16, 0xab), got);
+    EXPECT_EQ(1u, waits);
+    EXPECT_EQ(1u, notifies);
+    EXPECT_EQ((uint32_t)ASG_GUEST_STATE_RUNNING, context.ring_config->guest_state);
+
+    // Replies to a guest that is not asleep notify nobody.
+    reply(0xcd);
+    EXPECT_NE(nullptr, clientStream.readFully(got.data(), got.size()));
+    EXPECT_EQ(std::vector<uint8_t>(16, 0xcd), got);
+    EXPECT_EQ(1u, waits);
+    EXPECT_EQ(1u, notifies);
+
+    // A failing wait fails the read.
+    clientStream.setReplyWaitFunc([]() { return -1; });
+    EXPECT_EQ(nullptr, clientStream.readFully(got.data(), got.size()));
+}
+
+TEST(ASG, RingStreamReplyInPlace) {
+    static constexpr size_t kRingXferSize = 16384;
+    static constexpr size_t kRingStepSize = 4096;
+
+    std::vector<uint8_t> sharedBuf(sizeof(struct asg_ring_storage) + kRingXferSize, 0);
+    uint8_t* sharedBufPtr = sharedBuf.data();
+
+    struct asg_context context =
+        asg_context_create((char*)sharedBufPtr, (char*)sharedBufPtr + sizeof(struct asg_ring_storage), kRingXferSize);
+
+    context.ring_config->buffer_size = kRingXferSize;
+    context.ring_config->flush_interval = kRingStepSize;
+    context.ring_config->host_consumed_pos = 0;
+    context.ring_config->transfer_mode = 1;
+    context.ring_config->in_error = 0;
+
+    asg::client::RingStream clientStream(sharedBufPtr, kRingXferSize, []() {});
+    asg::server::RingStream serverStream(sharedBufPtr, kRingXferSize, []() { return 0; });
+    const struct ring_buffer* fromHost = context.from_host_large_xfer.ring;
+
+    auto reply = [&serverStream](size_t size, uint8_t first) {
+        uint8_t* buf = (uint8_t*)serverStream.alloc(size);
+        for (size_t i = 0; i < size; ++i) buf[i] = (uint8_t)(first + i);
+        EXPECT_EQ((int)size, serverStream.flush());
+    };
+
+    auto expectReply = [](const uint8_t* got, size_t size, uint8_t first) {
+        for (size_t i = 0; i < size; ++i) {
+            if ((uint8_t)(first + i) != got[i]) {
+                ADD_FAILURE() << "mismatch at " << i;
+                break;
+            }
+        }
+    };
+
+    // Reading all there is takes it straight off the ring.
+    std::vector<uint8_t> got(12000);
+    reply(12000, 1);
+    EXPECT_NE(nullptr, clientStream.readFully(got.data(), 12000));
+    expectReply(got.data(), 12000, 1);
+    EXPECT_EQ(12000u, fromHost->read_pos);
+
+    // A reply that wraps is peeked at in two spans, and stays there until it
+    // is released.
+    reply(8000, 2);
+    struct ring_buffer_spans spans;
+    EXPECT_EQ(8000, clientStream.peekReply(got.size(), &spans));
+    EXPECT_EQ(kRingXferSize - 12000, spans.first_len);
+    EXPECT_EQ(8000 - spans.first_len, spans.second_len);
+    expectReply(spans.first, spans.first_len, 2);
+    expectReply(spans.second, spans.second_len, (uint8_t)(2 + spans.first_len));
+
+    EXPECT_EQ(100, clientStream.peekReply(100, &spans));
+    expectReply(spans.first, 100, 2);
+    clientStream.releaseReply(100);
+    EXPECT_EQ(12100u, fromHost->read_pos);
+
+    EXPECT_NE(nullptr, clientStream.readFully(got.data(), 7900));
+    expectReply(got.data(), 7900, 102);
+    EXPECT_EQ(20000u, fromHost->read_pos);
+
+    // Reading part of a reply reads the rest ahead, which peekReply then
+    // returns first.
+    reply(32, 3);
+    EXPECT_NE(nullptr, clientStream.readFully(got.data(), 4));
+    EXPECT_EQ(20032u, fromHost->read_pos);
+    EXPECT_EQ(28, clientStream.peekReply(64, &spans));
+    EXPECT_EQ(nullptr, spans.second);
+    expectReply(spans.first, 28, 7);
+    clientStream.releaseReply(28);
+
+    // Failing to get a reply fails the peek.
+    clientStream.setTimeoutNs(1000000);
+    EXPECT_EQ(-1, clientStream.peekReply(64, &spans));
+    EXPECT_EQ(ETIMEDOUT, errno);
+}
+
+TEST(ASG, RingStreamAsyncWrites) {
+    static constexpr size_t kRingXferSize = 65536;
+    static constexpr size_t kRingStepSize = 4096;
+    static constexpr size_t kWriteSize = 3 * kRingXferSize;
+
+    std::vector<uint8_t> sharedBuf(sizeof(struct asg_ring_storage) + kRingXferSize, 0);
+    uint8_t* sharedBufPtr = sharedBuf.data();
+
+    struct asg_context context =
+        asg_context_create((char*)sharedBufPtr, (char*)sharedBufPtr + sizeof(struct asg_ring_storage), kRingXferSize);
+
+    context.ring_config->buffer_size = kRingXferSize;
+    context.ring_config->flush_interval = kRingStepSize;
+    context.ring_config->host_consumed_pos = 0;
+    context.ring_config->transfer_mode = 1;
+    context.ring_config->in_error = 0;
+
+    asg::client::RingStream clientStream(sharedBufPtr, kRingXferSize, []() { });
+    asg::server::RingStream serverStream(sharedBufPtr, kRingXferSize, []() { return 0; });
+
+    auto receive = [&serverStream](size_t size, uint8_t val) {
+        std::vector<uint8_t> got(size);
+        size_t read = 0;
+        while (read < size) {
+            read += serverStream.read(got.data() + read, size - read);
+        }
+        EXPECT_EQ(std::vector<uint8_t>(size, val), got);
+    };
+
+    // The host holds off until all the writes are queued, so none of them
+    // can complete before.
+    MessageChannel<int, 1> queued;
+    std::thread host([&receive, &queued]() {
+        int item;
+        queued.receive(&item);
+        receive(100, 1);
+        for (uint8_t i = 0; i < 3; ++i) receive(kWriteSize, 2 + i);
+        receive(100, 5);
+    });
+
+    // What was allocated before goes out first.
+    memset(clientStream.alloc(100), 1, 100);
+
+    std::vector<std::vector<uint8_t>> bufs;
+    std::vector<asg::client::RingStream::WriteToken> tokens(3);
+    for (uint8_t i = 0; i < 3; ++i) {
+        bufs.emplace_back(kWriteSize, 2 + i);
+        EXPECT_EQ(0, clientStream.writeFullyAsync(bufs[i].data(), kWriteSize, &tokens[i]));
+        EXPECT_LT(0u, tokens[i]);
+        if (i) {
+            EXPECT_LT(tokens[i - 1], tokens[i]);
+        }
+    }
+    EXPECT_FALSE(clientStream.isWriteComplete(tokens[0]));
+    queued.send(0);
+
+    EXPECT_EQ(0, clientStream.waitForWrite(tokens[1]));
+    EXPECT_TRUE(clientStream.isWriteComplete(tokens[0]));
+    EXPECT_TRUE(clientStream.isWriteComplete(tokens[1]));
+
+    // Anything else waits for the rest, setters included.
+    clientStream.setBatchSubmission(0, 0);
+    EXPECT_TRUE(clientStream.isWriteComplete(tokens[2]));
+    memset(clientStream.alloc(100), 5, 100);
+    EXPECT_EQ(0, clientStream.flush());
+    host.join();
+
+    // A failed write fails whoever waits on it, and the stream.
+    context.ring_config->in_error = 1;
+    asg::client::RingStream::WriteToken token;
+    EXPECT_EQ(0, clientStream.writeFullyAsync(bufs[0].data(), 16, &token));
+    EXPECT_EQ(-1, clientStream.waitForWrite(token));
+    EXPECT_EQ(-1, clientStream.flush());
+    EXPECT_EQ(-1, clientStream.writeFullyAsync(bufs[0].data(), 16, &token));
+}
+
+TEST(ASG, RingStreamWritev) {
+    static constexpr size_t kRingXferSize = 16384;
+    static constexpr size_t kRingStepSize = 4096;
+
+    std::vector<uint8_t> sharedBuf(sizeof(struct asg_ring_storage) + kRingXferSize, 0);
+    uint8_t* sharedBufPtr = sharedBuf.data();
+
+    struct asg_context context =
+        asg_context_create((char*)sharedBufPtr, (char*)sharedBufPtr + sizeof(struct asg_ring_storage), kRingXferSize);
+
+    context.ring_config->buffer_size = kRingXferSize;
+    context.ring_config->flush_interval = kRingStepSize;
+    context.ring_config->host_consumed_pos = 0;
+    context.ring_config->transfer_mode = 1;
+    context.ring_config->in_error = 0;
+
+    asg::client::RingStream clientStream(sharedBufPtr, kRingXferSize, []() { });
+    asg::server::RingStream serverStream(sharedBufPtr, kRingXferSize, []() { return 0; });
+
+    // A header and payloads of sizes that make chunks start and end in the
+    // middle of segments, and wrap around the ring.
+    std::vector<std::vector<uint8_t>> segs;
+    size_t sizes[] = { 12, 40000, 3, 0, 30001 };
+    std::vector<struct iovec> iov;
+    std::vector<uint8_t> expected;
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        segs.emplace_back(sizes[i]);
+        for (size_t j = 0; j < sizes[i]; ++j) segs[i][j] = (uint8_t)(i * 50 + j);
+        expected.insert(expected.end(), segs[i].begin(), segs[i].end());
+        iov.push_back({ segs[i].data(), sizes[i] });
+    }
+
+    auto receive = [&serverStream](size_t size) {
+        std::vector<uint8_t> got(size);
+        size_t read = 0;
+        while (read < size) {
+            read += serverStream.read(got.data() + read, size - read);
+        }
+        return got;
+    };
+
+    std::thread host([&receive, &expected]() {
+        for (int i = 0; i < 3; ++i) EXPECT_EQ(expected, receive(expected.size()));
+    });
+
+    EXPECT_EQ(0, clientStream.writeFullyv(iov.data(), (int)iov.size()));
+
+    EXPECT_EQ(0, clientStream.writeFullyvAsync(iov.data(), (int)iov.size()));
+
+    asg::client::RingStream::WriteToken token;
+    EXPECT_EQ(0, clientStream.writeFullyvAsync(iov.data(), (int)iov.size(), &token));
+    EXPECT_EQ(0, clientStream.waitForWrite(token));
+    EXPECT_EQ(0, clientStream.flush());
+
+    host.join();
+}
+
+TEST(ASG, RingStreamPayloadCache) {
+    static constexpr size_t kRingXferSize = 65536;
+    static constexpr size_t kRingStepSize = 4096;
+    static constexpr size_t kPayloadSize = 40000;
+    static constexpr size_t kRefSize = sizeof(struct asg_payload_ref);
+
+    std::vector<uint8_t> sharedBuf(sizeof(struct asg_ring_storage) + kRingXferSize, 0);
+    uint8_t* sharedBufPtr = sharedBuf.data();
+
+    struct asg_context context =
+        asg_context_create((char*)sharedBufPtr, (char*)sharedBufPtr + sizeof(struct asg_ring_storage), kRingXferSize);
+
+    context.ring_config->buffer_size = kRingXferSize;
+    context.ring_config->flush_interval = kRingStepSize;
+    context.ring_config->host_consumed_pos = 0;
+    context.ring_config->transfer_mode = 1;
+    context.ring_config->in_error = 0;
+
+    // Room for two payloads and a half.
+    asg::server::RingStream serverStream(sharedBufPtr, kRingXferSize, []() { return 0; });
+    serverStream.setPayloadCacheSize(kPayloadSize * 5 / 2);
+    asg::client::RingStream clientStream(sharedBufPtr, kRingXferSize, []() { });
+    clientStream.setPayloadCache(16384);
+
+    std::vector<std::vector<uint8_t>> payloads;
+    for (uint8_t i = 0; i < 3; ++i) {
+        payloads.emplace_back(kPayloadSize);
+        for (size_t j = 0; j < kPayloadSize; ++j) payloads[i][j] = (uint8_t)(i + j * 3);
+    }
+    std::vector<uint8_t> small(100, 0x42);
+
+    // Which payload goes out, and how many bytes that takes in the ring.
+    const struct { const std::vector<uint8_t>* data; size_t sent; } writes[] = {
+        { &payloads[0], kRefSize + kPayloadSize },
+        { &payloads[0], kRefSize },
+        { &payloads[1], kRefSize + kPayloadSize },
+        { &payloads[0], kRefSize },
+        { &small, small.size() },
+        // Evicts payloads[1], the least recently used...
+        { &payloads[2], kRefSize + kPayloadSize },
+        // ...which then evicts payloads[0].
+        { &payloads[1], kRefSize + kPayloadSize },
+        { &payloads[2], kRefSize },
+        { &payloads[0], kRefSize + kPayloadSize },
+    };
+
+    std::thread host([&serverStream, &writes]() {
+        for (const auto& write : writes) {
+            std::vector<uint8_t> got(write.data->size());
+            size_t read = 0;
+            while (read < got.size()) {
+                read += serverStream.read(got.data() + read, got.size() - read);
+            }
+            EXPECT_EQ(*write.data, got);
+        }
+    });
+
+    const struct ring_buffer* largeXfer = context.to_host_large_xfer.ring;
+    for (const auto& write : writes) {
+        uint32_t before = largeXfer->write_pos;
+        EXPECT_EQ(0, clientStream.writeFully(write.data->data(), write.data->size()));
+        EXPECT_EQ(write.sent, largeXfer->write_pos - before);
+    }
+    EXPECT_EQ(0, clientStream.flush());
+    host.join();
+    EXPECT_EQ(0u, context.ring_config->in_error);
+    EXPECT_EQ(1u, context.ring_config->transfer_mode);
+
+    // A store that fails, here while it waits for an earlier transfer to
+    // drain, leaves the payload out of our cache, so it goes in full again.
+    EXPECT_EQ(0, clientStream.writeFullyAsync(small.data(), small.size()));
+    clientStream.setTimeoutNs(20000000ULL);
+    errno = 0;
+    EXPECT_EQ(-1, clientStream.writeFully(payloads[1].data(), kPayloadSize));
+    EXPECT_EQ(ETIMEDOUT, errno);
+    clientStream.setTimeoutNs(0);
+
+    std::thread host1([&serverStream, &small, &payloads]() {
+        std::vector<uint8_t> got(small.size());
+        size_t read = 0;
+        while (read < got.size()) {
+            read += serverStream.read(got.data() + read, got.size() - read);
+        }
+        EXPECT_EQ(small, got);
+
+        got.resize(kPayloadSize);
+        read = 0;
+        while (read < got.size()) {
+            read += serverStream.read(got.data() + read, got.size() - read);
+        }
+        EXPECT_EQ(payloads[1], got);
+    });
+    uint32_t before = largeXfer->write_pos;
+    EXPECT_EQ(0, clientStream.writeFully(payloads[1].data(), kPayloadSize));
+    EXPECT_EQ(kRefSize + kPayloadSize, largeXfer->write_pos - before);
+    host1.join();
+    EXPECT_EQ(0u, context.ring_config->in_error);
+
+    // Likewise, a reference that fails leaves the order of our cache alone:
+    // payloads[0] stays the least recently used, and is what the next store
+    // evicts on both sides, so payloads[1] still goes by reference.
+    EXPECT_EQ(0, clientStream.writeFullyAsync(small.data(), small.size()));
+    clientStream.setTimeoutNs(20000000ULL);
+    errno = 0;
+    EXPECT_EQ(-1, clientStream.writeFully(payloads[0].data(), kPayloadSize));
+    EXPECT_EQ(ETIMEDOUT, errno);
+    clientStream.setTimeoutNs(0);
+
+    // The last two put both caches back as they were.
+    const struct { const std::vector<uint8_t>* data; size_t sent; } afterRef[] = {
+        { &payloads[2], kRefSize + kPayloadSize },
+        { &payloads[1], kRefSize },
+        { &payloads[0], kRefSize + kPayloadSize },
+        { &payloads[1], kRefSize },
+    };
+    std::thread hostRef([&serverStream, &small, &afterRef]() {
+        std::vector<uint8_t> got(small.size());
+        size_t read = 0;
+        while (read < got.size()) {
+            read += serverStream.read(got.data() + read, got.size() - read);
+        }
+        EXPECT_EQ(small, got);
+
+        for (const auto& write : afterRef) {
+            got.assign(write.data->size(), 0);
+            read = 0;
+            while (read < got.size()) {
+                read += serverStream.read(got.data() + read, got.size() - read);
+            }
+            EXPECT_EQ(*write.data, got);
+        }
+    });
+    for (const auto& write : afterRef) {
+        before = largeXfer->write_pos;
+        EXPECT_EQ(0, clientStream.writeFully(write.data->data(), write.data->size()));
+        EXPECT_EQ(write.sent, largeXfer->write_pos - before);
+    }
+    hostRef.join();
+    EXPECT_EQ(0u, context.ring_config->in_error);
+
+    // Chunks too small to carry the asg_payload_ref in one piece.
+    serverStream.setGeometryBounds(0, 0, 10, 10);
+    std::thread host2([&serverStream, &payloads]() {
+        for (int i : { 2, 1 }) {
+            std::vector<uint8_t> got(kPayloadSize);
+            size_t read = 0;
+            while (read < got.size()) {
+                read += serverStream.read(got.data() + read, got.size() - read);
+            }
+            EXPECT_EQ(payloads[i], got);
+        }
+    });
+    before = largeXfer->write_pos;
+    EXPECT_EQ(0, clientStream.writeFully(payloads[2].data(), kPayloadSize));
+    EXPECT_EQ(kRefSize + kPayloadSize, largeXfer->write_pos - before);
+
+    // Make sure the host sees a partial one, by sending a reference to
+    // payloads[1] by hand.
+    asg::PayloadKey key = asg::hashPayload(payloads[1].data(), kPayloadSize);
+    struct asg_payload_ref ref;
+    memcpy(ref.hash, key.hash, sizeof(ref.hash));
+    ref.size = key.size;
+    ref.reserved = 0;
+    *context.transfer_size = kRefSize;
+    context.ring_config->transfer_mode = ASG_TRANSFER_MODE_PAYLOAD_REF;
+    EXPECT_EQ(1, ring_buffer_view_write(context.to_host_large_xfer.ring,
+                                        &context.to_host_large_xfer.view, &ref, 10, 1));
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    EXPECT_EQ(1, ring_buffer_view_write(context.to_host_large_xfer.ring,
+                                        &context.to_host_large_xfer.view,
+                                        (const uint8_t*)&ref + 10, kRefSize - 10, 1));
+    host2.join();
+    EXPECT_EQ(0u, *context.transfer_size);
+    EXPECT_EQ(0u, context.ring_config->in_error);
+    context.ring_config->transfer_mode = 1;
+    serverStream.setGeometryBounds(0, 0, 0, 0);
+
+    // Guests of hosts without a cache send everything in full.
+    serverStream.setPayloadCacheSize(0);
+    clientStream.setPayloadCache(16384);
+    before = largeXfer->write_pos;
+    std::thread host3([&serverStream, &payloads]() {
+        std::vector<uint8_t> got(kPayloadSize);
+        size_t read = 0;
+        while (read < got.size()) {
+            read += serverStream.read(got.data() + read, got.size() - read);
+        }
+        EXPECT_EQ(payloads[0], got);
+    });
+    EXPECT_EQ(0, clientStream.writeFully(payloads[0].data(), kPayloadSize));
+    host3.join();
+    EXPECT_EQ(kPayloadSize, largeXfer->write_pos - before);
+}
+
+TEST(ASG, PayloadCache) {
+    // Hashes depend on every byte, the length, and nothing else.
+    std::vector<uint8_t> data(1000);
+    for (size_t i = 0; i < data.size(); ++i) data[i] = (uint8_t)(i * 7);
+    std::vector<uint8_t> copy = data;
+
+    asg::PayloadKey key = asg::hashPayload(data.data(), data.size());
+    EXPECT_TRUE(key == asg::hashPayload(copy.data(), copy.size()));
+    EXPECT_EQ(1000u, key.size);
+    EXPECT_FALSE(key == asg::hashPayload(data.data(), data.size() - 1));
+    for (size_t i : { (size_t)0, (size_t)31, (size_t)500, (size_t)999 }) {
+        copy[i] ^= 1;
+        asg::PayloadKey other = asg::hashPayload(copy.data(), copy.size());
+        EXPECT_NE(key.hash[0], other.hash[0]);
+        EXPECT_NE(key.hash[1], other.hash[1]);
+        copy[i] ^= 1;
+    }
+
+    auto keyOf = [](uint64_t id, uint32_t size) {
+        asg::PayloadKey key = { { id, ~id }, size };
+        return key;
+    };
+
+    // Least recently used first out, finds included.
+    asg::PayloadCache cache(300);
+    EXPECT_TRUE(cache.insert(keyOf(1, 100), std::vector<uint8_t>(100, 1)));
+    EXPECT_TRUE(cache.insert(keyOf(2, 100), std::vector<uint8_t>()));
+    EXPECT_TRUE(cache.insert(keyOf(3, 100), std::vector<uint8_t>()));
+    ASSERT_NE(nullptr, cache.find(keyOf(1, 100)));
+    EXPECT_EQ(std::vector<uint8_t>(100, 1), *cache.find(keyOf(1, 100)));
+    EXPECT_TRUE(cache.insert(keyOf(4, 150), std::vector<uint8_t>()));
+    EXPECT_EQ(nullptr, cache.find(keyOf(2, 100)));
+    EXPECT_EQ(nullptr, cache.find(keyOf(3, 100)));
+    EXPECT_NE(nullptr, cache.find(keyOf(1, 100)));
+    EXPECT_EQ(250u, cache.bytes());
+    EXPECT_EQ(2u, cache.count());
+
+    // Same hash, different size: a different payload.
+    EXPECT_EQ(nullptr, cache.find(keyOf(1, 99)));
+
+    // contains() looks without touching; touch() does.
+    EXPECT_TRUE(cache.contains(keyOf(4, 150)));
+    EXPECT_FALSE(cache.contains(keyOf(2, 100)));
+    EXPECT_TRUE(cache.insert(keyOf(6, 50), std::vector<uint8_t>()));
+    EXPECT_TRUE(cache.insert(keyOf(7, 50), std::vector<uint8_t>()));
+    EXPECT_FALSE(cache.contains(keyOf(4, 150)));
+    cache.touch(keyOf(1, 100));
+    cache.touch(keyOf(2, 100));
+    EXPECT_TRUE(cache.insert(keyOf(8, 200), std::vector<uint8_t>()));
+    EXPECT_TRUE(cache.contains(keyOf(1, 100)));
+    EXPECT_FALSE(cache.contains(keyOf(6, 50)));
+    EXPECT_FALSE(cache.contains(keyOf(7, 50)));
+    EXPECT_EQ(300u, cache.bytes());
+
+    EXPECT_FALSE(cache.insert(keyOf(5, 301), std::vector<uint8_t>()));
+    EXPECT_EQ(2u, cache.count());
+
+    cache.reset(100);
+    EXPECT_EQ(0u, cache.count());
+    EXPECT_EQ(0u, cache.bytes());
+}
+
+TEST(ASG, RingStreamBatchSubmission) {
+    static constexpr size_t kRingXferSize = 32768;
+    static constexpr size_t kRingStepSize = 4096;
+
+    std::vector<uint8_t> sharedBuf(sizeof(struct asg_ring_storage) + kRingXferSize, 0);
+    uint8_t* sharedBufPtr = sharedBuf.data();
+
+    struct asg_context context =
+        asg_context_create((char*)sharedBufPtr, (char*)sharedBufPtr + sizeof(struct asg_ring_storage), kRingXferSize);
+
+    context.ring_config->buffer_size = kRingXferSize;
+    context.ring_config->flush_interval = kRingStepSize;
+    context.ring_config->host_consumed_pos = 0;
+    context.ring_config->transfer_mode = 1;
+    context.ring_config->in_error = 0;
+
+    uint32_t rings = 0;
+    asg::client::RingStream clientStream(sharedBufPtr, kRingXferSize, [&rings]() { ++rings; });
+    asg::server::RingStream serverStream(sharedBufPtr, kRingXferSize, []() { return 0; });
+    asg::ring<> toHost(context.to_host);
+
+    auto receive = [&serverStream](size_t steps, uint8_t first) {
+        std::vector<uint8_t> got(steps * kRingStepSize);
+        size_t read = 0;
+        while (read < got.size()) {
+            read += serverStream.read(got.data() + read, got.size() - read);
+        }
+        for (size_t i = 0; i < steps; ++i) {
+            EXPECT_EQ((uint8_t)(first + i), got[i * kRingStepSize]);
+            EXPECT_EQ((uint8_t)(first + i), got[(i + 1) * kRingStepSize - 1]);
+        }
+    };
+
+    // Each alloc of a whole step commits the previous one. Nothing is
+    // published until the fourth commit, then all four at once with one
+    // doorbell.
+    clientStream.setBatchSubmission(4, 1 << 20);
+    for (uint32_t i = 0; i < 5; ++i) {
+        memset(clientStream.alloc(kRingStepSize), (int)i, kRingStepSize);
+        EXPECT_EQ(i < 4 ? 0u : 4 * sizeof(struct asg_type1_xfer), toHost.available_read());
+    }
+    EXPECT_EQ(1u, rings);
+
+    // flush() publishes what there is.
+    EXPECT_EQ(0, clientStream.flush());
+    EXPECT_EQ(5 * sizeof(struct asg_type1_xfer), toHost.available_read());
+    receive(5, 0);
+
+    // So does going over the byte threshold.
+    clientStream.setBatchSubmission(8, 6000);
+    for (uint32_t i = 0; i < 3; ++i) {
+        memset(clientStream.alloc(kRingStepSize), (int)(10 + i), kRingStepSize);
+    }
+    EXPECT_EQ(2 * sizeof(struct asg_type1_xfer), toHost.available_read());
+
+    // And reading.
+    std::vector<uint8_t> reply(16);
+    clientStream.setTimeoutNs(1000000);
+    EXPECT_EQ(nullptr, clientStream.readback(reply.data(), reply.size()));
+    EXPECT_EQ(3 * sizeof(struct asg_type1_xfer), toHost.available_read());
+    receive(3, 10);
+}
+
+TEST(ASG, RingStreamLargeAllocInPlace) {
+    static constexpr size_t kRingXferSize = 65536;
+    static constexpr size_t kRingStepSize = 4096;
+
+    std::vector<uint8_t> sharedBuf(sizeof(struct asg_ring_storage) + kRingXferSize, 0);
+    uint8_t* sharedBufPtr = sharedBuf.data();
+    uint8_t* xferBuf = sharedBufPtr + sizeof(struct asg_ring_storage);
+
+    struct asg_context context =
+        asg_context_create((char*)sharedBufPtr, (char*)xferBuf, kRingXferSize);
+
+    context.ring_config->buffer_size = kRingXferSize;
+    context.ring_config->flush_interval = kRingStepSize;
+    context.ring_config->host_consumed_pos = 0;
+    context.ring_config->transfer_mode = 1;
+    context.ring_config->in_error = 0;
+
+    asg::client::RingStream clientStream(sharedBufPtr, kRingXferSize, []() { });
+    asg::server::RingStream serverStream(sharedBufPtr, kRingXferSize, []() { return 0; });
+
+    auto send = [&clientStream, xferBuf](size_t size, uint8_t fill, bool inPlace) {
+        uint8_t* buf = clientStream.alloc(size);
+        ASSERT_NE(nullptr, buf);
+        EXPECT_EQ(inPlace, buf >= xferBuf && buf < xferBuf + kRingXferSize);
+        for (size_t i = 0; i < size; ++i) buf[i] = (uint8_t)(fill + i);
+        EXPECT_EQ(0, clientStream.flush());
+    };
+
+    auto receive = [&serverStream](size_t size, uint8_t fill) {
+        std::vector<uint8_t> got(size);
+        size_t read = 0;
+        while (read < size) {
+            read += serverStream.read(got.data() + read, size - read);
+        }
+        for (size_t i = 0; i < size; ++i) {
+            if ((uint8_t)(fill + i) != got[i]) {
+                ADD_FAILURE() << "mismatch at " << i;
+                break;
+            }
+        }
+    };
+
+    // The client waits for the host to drain each transfer before returning
+    // from flush(), so the host reads concurrently.
+    std::thread host([&receive]() {
+        receive(48 * 1024, 1);
+        receive(32 * 1024, 2);
+        receive(2 * kRingXferSize, 3);
+        receive(16 * 1024, 4);
+    });
+
+    // Commands that fit before the end of the xfer buffer are encoded in place.
+    send(48 * 1024, 1, true);
+    // This one would wrap, so goes through the tmp buffer.
+    send(32 * 1024, 2, false);
+    // As does anything larger than the ring.
+    send(2 * kRingXferSize, 3, false);
+    send(16 * 1024, 4, true);
+
+    host.join();
+    EXPECT_EQ(1u, context.ring_config->transfer_mode);
+}
+
+TEST(ASG, TransferGeometry) {
+    using asg::client::TransferGeometry;
+
+    // Defaults: the old fixed geometry, bounded by the slot and ring sizes.
+    TransferGeometry geometry;
+    TransferGeometry::Bounds bounds;
+    geometry.setLimits(bounds, 16384, 1 << 20);
+    EXPECT_EQ(4096u, geometry.stepSize());
+    EXPECT_EQ(16384u, geometry.tmpBufThreshold());
+    EXPECT_EQ(262144u, geometry.chunkSize());
+
+    // Commits that fill the step grow it up to the slot, and small ones
+    // shrink it back down to the minimum.
+    for (int i = 0; i < 64; ++i) geometry.onType1Commit(geometry.stepSize());
+    EXPECT_EQ(16384u, geometry.stepSize());
+    for (int i = 0; i < 64; ++i) geometry.onType1Commit(100);
+    EXPECT_EQ((uint32_t)TransferGeometry::kDefaultMinStepSize, geometry.stepSize());
+
+    // Half full commits leave it be.
+    geometry.setLimits(bounds, 16384, 1 << 20);
+    for (int i = 0; i < 64; ++i) geometry.onType1Commit(geometry.stepSize());
+    for (int i = 0; i < 64; ++i) geometry.onType1Commit(geometry.stepSize() / 2);
+    uint32_t step = geometry.stepSize();
+    for (int i = 0; i < 64; ++i) geometry.onType1Commit(step / 2);
+    EXPECT_EQ(step, geometry.stepSize());
+
+    // Stalled transfers shrink the chunk, and ones that did not grow it up
+    // to half the ring.
+    for (int i = 0; i < 64; ++i) geometry.onType3Write(true);
+    EXPECT_EQ((uint32_t)TransferGeometry::kDefaultMinChunkSize, geometry.chunkSize());
+    for (int i = 0; i < 64; ++i) geometry.onType3Write(false);
+    EXPECT_EQ(524288u, geometry.chunkSize());
+
+    // The host's bounds apply, except where the rings do not allow them.
+    bounds.minStepSize = 1024;
+    bounds.maxStepSize = 8192;
+    bounds.minChunkSize = 65536;
+    bounds.maxChunkSize = 4 << 20;
+    geometry.setLimits(bounds, 16384, 1 << 20);
+    EXPECT_EQ(8192u, geometry.tmpBufThreshold());
+    EXPECT_GE(8192u, geometry.stepSize());
+    EXPECT_EQ(524288u, geometry.chunkSize());
+    for (int i = 0; i < 64; ++i) geometry.onType1Commit(0);
+    EXPECT_EQ(1024u, geometry.stepSize());
+    for (int i = 0; i < 64; ++i) geometry.onType3Write(true);
+    EXPECT_EQ(65536u, geometry.chunkSize());
+
+    // Streams move packets in between the step and the slot size in place,
+    // and large ones in whatever chunks the host allows.
+    static constexpr size_t kRingXferSize = 65536;
+    static constexpr size_t kRingStepSize = 8192;
+    static constexpr size_t kMediumSize = 6000;
+    static constexpr size_t kLargeSize = 200000;
+    static constexpr size_t kRounds = 32;
+
+    std::vector<uint8_t> sharedBuf(sizeof(struct asg_ring_storage) + kRingXferSize, 0);
+    uint8_t* sharedBufPtr = sharedBuf.data();
+
+    struct asg_context context =
+        asg_context_create((char*)sharedBufPtr, (char*)sharedBufPtr + sizeof(struct asg_ring_storage), kRingXferSize);
+
+    context.ring_config->buffer_size = kRingXferSize;
+    context.ring_config->flush_interval = kRingStepSize;
+    context.ring_config->host_consumed_pos = 0;
+    context.ring_config->transfer_mode = 1;
+    context.ring_config->in_error = 0;
+
+    asg::client::RingStream clientStream(sharedBufPtr, kRingXferSize, []() {});
+    asg::server::RingStream serverStream(sharedBufPtr, kRingXferSize, []() { return 0; });
+    serverStream.setGeometryBounds(1024, 0, 4096, 8192);
+
+    std::vector<uint8_t> sent;
+    for (size_t i = 0; i < kRounds; ++i) {
+        sent.insert(sent.end(), kMediumSize, (uint8_t)i);
+        sent.insert(sent.end(), kLargeSize, (uint8_t)~i);
+    }
+
+    FunctorThread clientThread([&clientStream, &sent]() {
+        const uint8_t* src = sent.data();
+        for (size_t i = 0; i < kRounds; ++i) {
+            memcpy(clientStream.alloc(kMediumSize), src, kMediumSize);
+            src += kMediumSize;
+            memcpy(clientStream.alloc(kLargeSize), src, kLargeSize);
+            src += kLargeSize;
+        }
+        clientStream.flush();
+    });
+
+    std::vector<uint8_t> got(sent.size());
+    FunctorThread serverThread([&serverStream, &got]() {
+        size_t read = 0;
+        while (read < got.size()) {
+            read += serverStream.read(got.data() + read, got.size() - read);
+        }
+    });
+
+    serverThread.start();
+    clientThread.start();
+    clientThread.wait();
+    serverThread.wait();
+
+    EXPECT_EQ(sent, got);
+}
+
+TEST(ASG, RingLayoutVersions) {
+    static constexpr size_t kRingXferSize = 16384;
+    static constexpr size_t kRingStepSize = 4096;
+    static constexpr size_t kLargeSize = 65536;
+
+    EXPECT_EQ(1u, asg_ring_layout_negotiate(0, ASG_RING_LAYOUT_LATEST));
+    EXPECT_EQ(1u, asg_ring_layout_negotiate(ASG_RING_LAYOUT_LATEST, 1));
+    EXPECT_EQ(2u, asg_ring_layout_negotiate(2, 2));
+    EXPECT_EQ((uint32_t)ASG_RING_LAYOUT_LATEST, asg_ring_layout_negotiate(100, 100));
+
+    std::vector<uint8_t> sharedBuf(sizeof(struct asg_ring_storage) + kRingXferSize, 0);
+    uint8_t* sharedBufPtr = sharedBuf.data();
+    char* storage = (char*)sharedBufPtr;
+    char* buffer = storage + sizeof(struct asg_ring_storage);
+
+    // v1 is what older peers see: everything in to_host's state / config[].
+    struct asg_context v1 = asg_context_create(storage, buffer, kRingXferSize);
+    EXPECT_EQ(1u, v1.layout_version);
+    EXPECT_EQ((void*)&v1.to_host->state, (void*)v1.host_state);
+    EXPECT_EQ((void*)v1.to_host->config, (void*)v1.ring_config);
+    EXPECT_EQ(&v1.ring_config->transfer_size, v1.transfer_size);
+    EXPECT_EQ(&v1.ring_config->in_error, v1.in_error);
+
+    // v2 puts the guest's config, transfer_size and the host's fields on
+    // separate 128-byte lines past the end of the to_host ring.
+    struct asg_context context =
+        asg_context_create_versioned(storage, buffer, kRingXferSize, 2, 2);
+    EXPECT_EQ(2u, context.layout_version);
+    EXPECT_EQ(2u, context.to_host->guest_version);
+    EXPECT_EQ(2u, context.to_host->host_version);
+
+    uintptr_t ringEnd = (uintptr_t)(context.to_host + 1);
+    uintptr_t lines[] = {
+        (uintptr_t)context.ring_config,
+        (uintptr_t)context.transfer_size,
+        (uintptr_t)context.host_state,
+    };
+    for (size_t i = 0; i < 3; ++i) {
+        EXPECT_EQ(0u, (lines[i] - (uintptr_t)storage) % ASG_RING_LINE_SIZE);
+        EXPECT_LE(ringEnd, lines[i]);
+        EXPECT_GE((uintptr_t)storage + ADDRESS_SPACE_GRAPHICS_PAGE_SIZE,
+                  lines[i] + ASG_RING_LINE_SIZE);
+        if (i) {
+            EXPECT_EQ(lines[i - 1] + ASG_RING_LINE_SIZE, lines[i]);
+        }
+    }
+    EXPECT_GT(lines[2] + ASG_RING_LINE_SIZE, (uintptr_t)context.in_error);
+    EXPECT_GT(lines[2] + ASG_RING_LINE_SIZE,
+              (uintptr_t)context.host_consumed_pos);
+
+    context.ring_config->buffer_size = kRingXferSize;
+    context.ring_config->flush_interval = kRingStepSize;
+    context.ring_config->transfer_mode = 1;
+    *context.host_consumed_pos = 0;
+    *context.in_error = 0;
+
+    // Streams on both sides agree on v2 and move small and large (type 3)
+    // writes through it.
+    asg::client::RingStream clientStream(
+        sharedBufPtr, kRingXferSize, []() {}, ASG_RING_LAYOUT_LATEST);
+    asg::server::RingStream serverStream(
+        sharedBufPtr, kRingXferSize, []() { return 0; }, ASG_RING_LAYOUT_LATEST);
+
+    std::vector<uint8_t> large(kLargeSize);
+    for (size_t i = 0; i < kLargeSize; ++i) large[i] = (uint8_t)(i * 7);
+
+    FunctorThread clientThread([&clientStream, &large]() {
+        auto buf = clientStream.alloc(16);
+        memset(buf, 0xab, 16);
+        clientStream.flush();
+        clientStream.writeFully(large.data(), large.size());
+    });
+
+    std::vector<uint8_t> got(16 + kLargeSize);
+    FunctorThread serverThread([&serverStream, &got]() {
+        size_t read = 0;
+        while (read < got.size()) {
+            read += serverStream.read(got.data() + read, got.size() - read);
+        }
+    });
+
+    serverThread.start();
+    clientThread.start();
+    clientThread.wait();
+    serverThread.wait();
+
+    EXPECT_EQ(std::vector<uint8_t>(16, 0xab),
+              std::vector<uint8_t>(got.begin(), got.begin() + 16));
+    EXPECT_EQ(large, std::vector<uint8_t>(got.begin() + 16, got.end()));
+    EXPECT_EQ(0u, *context.transfer_size);
+    EXPECT_EQ(0u, v1.to_host->config[5]);
+}
+
+TEST(ASG, RingTemplate) {
+    struct ring_buffer r;
+    ring_buffer_init(&r);
+
+    asg::ring<> toHost(&r);
+    static_assert(decltype(toHost)::kSize == RING_BUFFER_SIZE, "");
+    EXPECT_EQ(RING_BUFFER_SIZE - 1u, toHost.available_write());
+
+    // Interleaves with the C API on the same ring, across many wraps.
+    for (uint32_t i = 0; i < 3 * RING_BUFFER_SIZE; ++i) {
+        struct asg_type1_xfer xfer = { i, i * 3 };
+        struct asg_type1_xfer got;
+        if (i % 2) {
+            EXPECT_TRUE(toHost.write(&xfer, sizeof(xfer)));
+            EXPECT_EQ(1, ring_buffer_read(&r, &got, sizeof(got), 1));
+        } else {
+            EXPECT_EQ(1, ring_buffer_write(&r, &xfer, sizeof(xfer), 1));
+            EXPECT_EQ(sizeof(xfer), toHost.available_read());
+            EXPECT_TRUE(toHost.peek(&got, sizeof(got)));
+            EXPECT_TRUE(ring_buffer_can_read(&r, sizeof(got)));
+            toHost.consume(sizeof(got));
+        }
+        EXPECT_EQ(xfer.offset, got.offset);
+        EXPECT_EQ(xfer.size, got.size);
+    }
+
+    // Odd sizes split at the wrap point like the C API does.
+    uint8_t bytes[13] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13 };
+    uint8_t out[13];
+    for (int i = 0; i < 500; ++i) {
+        EXPECT_TRUE(toHost.write(bytes, sizeof(bytes)));
+        EXPECT_TRUE(toHost.read(out, sizeof(out)));
+        EXPECT_EQ(0, memcmp(bytes, out, sizeof(bytes)));
+    }
+    EXPECT_FALSE(toHost.read(out, 1));
+
+    // All or nothing when full.
+    std::vector<uint8_t> fill(RING_BUFFER_SIZE - 1);
+    EXPECT_TRUE(toHost.write(fill.data(), fill.size()));
+    EXPECT_FALSE(toHost.write(bytes, 1));
+    EXPECT_EQ(0u, toHost.available_write());
+
+    // A deeper descriptor ring over separate storage.
+    struct ring_buffer deep;
+    ring_buffer_init(&deep);
+    std::vector<uint8_t> storage(1 << 14);
+    asg::ring_view<14> deepRing(&deep, storage.data());
+    uint32_t queued = 0;
+    struct asg_type1_xfer xfer = { 0, 0 };
+    while (deepRing.write(&xfer, sizeof(xfer))) ++queued;
+    EXPECT_EQ((1u << 14) / sizeof(xfer) - 1, queued);
+}
+
+TEST(ASG, RingBufferRecords) {
+    struct ring_buffer r;
+    ring_buffer_init(&r);
+
+    const uint32_t maxRecord = ring_buffer_view_max_record_size(nullptr);
+    EXPECT_EQ(RING_BUFFER_SIZE / 2 - 4u, maxRecord);
+
+    std::default_random_engine generator;
+    generator.seed(0);
+    std::uniform_int_distribution<uint32_t> lenDist(0, maxRecord);
+    std::uniform_int_distribution<uint32_t> countDist(1, 8);
+
+    uint32_t sent = 0;
+    uint32_t received = 0;
+    std::vector<std::vector<uint8_t>> pending;
+
+    auto makeRecord = [](uint32_t seq, uint32_t len) {
+        std::vector<uint8_t> rec(len);
+        for (uint32_t i = 0; i < len; ++i) rec[i] = (uint8_t)(seq + i);
+        return rec;
+    };
+
+    // Random bursts in both directions wrap the ring many times, and every
+    // record must come back whole and in order.
+    for (int round = 0; round < 2000; ++round) {
+        std::vector<std::vector<uint8_t>> batch;
+        std::vector<struct ring_buffer_iovec> iov;
+        uint32_t n = countDist(generator);
+        for (uint32_t i = 0; i < n; ++i) {
+            batch.push_back(makeRecord(sent + i, lenDist(generator) / (1 + i)));
+        }
+        for (auto& rec : batch) iov.push_back({ rec.data(), (uint32_t)rec.size() });
+
+        long written = ring_buffer_view_write_records(&r, nullptr, iov.data(), n);
+        EXPECT_TRUE(written == n || errno == -EAGAIN);
+        for (long i = 0; i < written; ++i) pending.push_back(batch[i]);
+        sent += written;
+
+        std::vector<std::vector<uint8_t>> out(countDist(generator),
+                                              std::vector<uint8_t>(maxRecord));
+        std::vector<struct ring_buffer_iovec> outIov;
+        for (auto& buf : out) outIov.push_back({ buf.data(), (uint32_t)buf.size() });
+
+        if (round % 2) {
+            long read = ring_buffer_view_read_records(
+                &r, nullptr, outIov.data(), outIov.size());
+            for (long i = 0; i < read; ++i) {
+                ASSERT_EQ(pending[received].size(), outIov[i].len);
+                EXPECT_EQ(0, memcmp(pending[received].data(), out[i].data(), outIov[i].len));
+                ++received;
+            }
+        } else {
+            uint32_t bytes = 0;
+            long peeked = ring_buffer_view_peek_records(
+                &r, nullptr, outIov.data(), outIov.size(), &bytes);
+            for (long i = 0; i < peeked; ++i) {
+                ASSERT_EQ(pending[received].size(), outIov[i].len);
+                EXPECT_EQ(0, memcmp(pending[received].data(), outIov[i].base, outIov[i].len));
+                ++received;
+            }
+            ring_buffer_consume_read(&r, bytes);
+        }
+    }
+
+    EXPECT_LT(1000u, received);
+
+    // Drain, then check the error cases.
+    std::vector<uint8_t> big(maxRecord + 1);
+    struct ring_buffer_iovec bigIov = { big.data(), maxRecord };
+    while (ring_buffer_view_read_records(&r, nullptr, &bigIov, 1) == 1) {
+        bigIov.len = maxRecord;
+        ++received;
+    }
+    EXPECT_EQ(sent, received);
+    EXPECT_EQ(-EAGAIN, errno);
+
+    bigIov.len = maxRecord + 1;
+    EXPECT_EQ(0, ring_buffer_view_write_records(&r, nullptr, &bigIov, 1));
+    EXPECT_EQ(-EMSGSIZE, errno);
+
+    bigIov.len = 16;
+    EXPECT_EQ(1, ring_buffer_view_write_records(&r, nullptr, &bigIov, 1));
+    bigIov.len = 15;
+    EXPECT_EQ(0, ring_buffer_view_read_records(&r, nullptr, &bigIov, 1));
+    EXPECT_EQ(-ENOBUFS, errno);
+    bigIov.len = 16;
+    EXPECT_EQ(1, ring_buffer_view_read_records(&r, nullptr, &bigIov, 1));
+    EXPECT_EQ(16u, bigIov.len);
+}
+
+// Several producers post type1 descriptors into one ring; the consumer must
+// see each producer's descriptors exactly once and in that producer's order.
+TEST(ASG, RingBufferMpscDescriptors) {
+    static constexpr uint32_t kProducers = 4;
+    static constexpr uint32_t kXfersPerProducer = 20000;
+
+    struct ring_buffer r;
+    ring_buffer_init(&r);
+    EXPECT_EQ(RING_BUFFER_SIZE / 16u,
+              ring_buffer_mpsc_init(&r, sizeof(struct asg_type1_xfer)));
+    EXPECT_EQ(0u, ring_buffer_mpsc_init(&r, RING_BUFFER_SIZE));
+    ring_buffer_mpsc_init(&r, sizeof(struct asg_type1_xfer));
+
+    struct asg_type1_xfer xfer;
+    EXPECT_FALSE(ring_buffer_mpsc_try_dequeue(&r, sizeof(xfer), &xfer));
+
+    std::vector<std::thread> producers;
+    for (uint32_t p = 0; p < kProducers; ++p) {
+        producers.emplace_back([&r, p]() {
+            for (uint32_t i = 0; i < kXfersPerProducer; ++i) {
+                struct asg_type1_xfer out = { p, i };
+                while (!ring_buffer_mpsc_try_enqueue(&r, sizeof(out), &out)) {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+
+    std::vector<uint32_t> next(kProducers, 0);
+    for (uint32_t i = 0; i < kProducers * kXfersPerProducer; ++i) {
+        ring_buffer_mpsc_dequeue(&r, sizeof(xfer), &xfer);
+        ASSERT_LT(xfer.offset, kProducers);
+        EXPECT_EQ(next[xfer.offset], xfer.size);
+        next[xfer.offset] = xfer.size + 1;
+    }
+
+    for (auto& t : producers) t.join();
+
+    for (uint32_t p = 0; p < kProducers; ++p) {
+        EXPECT_EQ(kXfersPerProducer, next[p]);
+    }
+    EXPECT_FALSE(ring_buffer_mpsc_try_dequeue(&r, sizeof(xfer), &xfer));
+
+    // Fills up after one lap of slots.
+    uint32_t filled = 0;
+    while (ring_buffer_mpsc_try_enqueue(&r, sizeof(xfer), &xfer)) ++filled;
+    EXPECT_EQ(RING_BUFFER_SIZE / 16u, filled);
+}
+
+TEST(ASG, RingBufferCopyKernels) {
+    static constexpr size_t kMaxSize = 4096 + 256;
+
+    std::vector<uint8_t> src(kMaxSize + 64);
+    for (size_t i = 0; i < src.size(); ++i) src[i] = (uint8_t)(i * 7 + 1);
+
+    for (int k = RING_BUFFER_COPY_MEMCPY; k <= RING_BUFFER_COPY_AVX512_NT; ++k) {
+        auto kernel = (enum ring_buffer_copy_kernel)k;
+        if (!ring_buffer_copy_kernel_supported(kernel)) continue;
+
+        // Cover misaligned heads and tails, and copies shorter than a vector.
+        for (size_t size : { 0, 1, 15, 63, 64, 255, 1000, 4096, 4096 + 200 }) {
+            for (size_t align = 0; align < 64; align += 13) {
+                std::vector<uint8_t> dst(kMaxSize + 128, 0xee);
+                ring_buffer_copy_with_kernel(
+                    kernel, dst.data() + align, src.data() + (63 - align), size);
+                EXPECT_EQ(0, memcmp(dst.data() + align, src.data() + (63 - align), size))
+                    << ring_buffer_copy_kernel_name(kernel) << " " << size;
+                EXPECT_EQ(0xee, dst[align + size]);
+                if (align) {
+                    EXPECT_EQ(0xee, dst[align - 1]);
+                }
+            }
+        }
+    }
+
+    // The threshold follows the largest chunk a producer copies at a time.
+    EXPECT_EQ(256 * 1024u, ring_buffer_copy_nt_threshold_for(1 << 20, 0));
+    EXPECT_EQ(512 * 1024u, ring_buffer_copy_nt_threshold_for(1 << 24, 1 << 20));
+    EXPECT_EQ(256 * 1024u, ring_buffer_copy_nt_threshold_for(1 << 20, 1 << 24));
+    EXPECT_EQ((size_t)RING_BUFFER_COPY_NT_THRESHOLD_MIN,
+              ring_buffer_copy_nt_threshold_for(1 << 16, 0));
+
+    // Ring transfers above the threshold go through the streaming kernel.
+    size_t threshold = ring_buffer_copy_get_nt_threshold();
+    ring_buffer_copy_set_nt_threshold(64);
+    if (ring_buffer_copy_dispatched_kernel() != RING_BUFFER_COPY_MEMCPY) {
+        EXPECT_NE(ring_buffer_copy_for(63), ring_buffer_copy_for(64));
+    }
+
+    struct ring_buffer r;
+    ring_buffer_init(&r);
+    std::vector<uint8_t> dst(1000);
+    for (int i = 0; i < 8; ++i) {
+        EXPECT_EQ(1, ring_buffer_write(&r, src.data() + i, 1000, 1));
+        EXPECT_EQ(1, ring_buffer_read(&r, dst.data(), 1000, 1));
+        EXPECT_EQ(0, memcmp(src.data() + i, dst.data(), 1000));
+    }
+
+
+    // A ring's own threshold wins over the process default, and 0 defers to
+    // it.
+    ring_buffer_copy_set_nt_threshold(threshold);
+    EXPECT_EQ(ring_buffer_copy_for(64), ring_buffer_copy_for_threshold(64, 0));
+    if (ring_buffer_copy_dispatched_kernel() != RING_BUFFER_COPY_MEMCPY) {
+        EXPECT_NE(ring_buffer_copy_for(64), ring_buffer_copy_for_threshold(64, 64));
+        EXPECT_EQ(ring_buffer_copy_for(63), ring_buffer_copy_for_threshold(63, 64));
+    }
+
+    struct ring_buffer_view v;
+    ring_buffer_view_init(&r, &v, dst.data(), 512);
+    EXPECT_EQ(0u, v.nt_threshold);
+    v.nt_threshold = 64;
+    for (int i = 0; i < 8; ++i) {
+        EXPECT_EQ(1, ring_buffer_view_write(&r, &v, src.data() + i, 300, 1));
+        std::vector<uint8_t> out(300);
+        EXPECT_EQ(1, ring_buffer_view_read(&r, &v, out.data(), 300, 1));
+        EXPECT_EQ(0, memcmp(src.data() + i, out.data(), 300));
+    }
+    EXPECT_EQ(threshold, ring_buffer_copy_get_nt_threshold());
+}
+
+#ifdef __linux__
+
+TEST(ASG, RingBufferDoubleMappedView) {
+    static constexpr uint32_t kSize = 65536;
+
+    int fd = -1;
+    uint8_t* buf = ring_buffer_double_map_create(kSize, &fd);
+    ASSERT_NE(nullptr, buf);
+    EXPECT_GE(fd, 0);
+
+    // Both halves alias the same memory.
+    buf[kSize + 7] = 0x5a;
+    EXPECT_EQ(0x5a, buf[7]);
+
+    struct ring_buffer r;
+    struct ring_buffer_view v;
+    ring_buffer_view_init(&r, &v, buf, kSize);
+    v.flags |= RING_BUFFER_VIEW_DOUBLE_MAPPED;
+
+    // Move the indices to 100 bytes before the end, then write across it.
+    std::vector<uint8_t> filler(kSize - 100);
+    EXPECT_EQ(1, ring_buffer_view_write(&r, &v, filler.data(), filler.size(), 1));
+    EXPECT_EQ(1, ring_buffer_view_read(&r, &v, filler.data(), filler.size(), 1));
+
+    std::vector<uint8_t> src(300);
+    for (size_t i = 0; i < src.size(); ++i) src[i] = (uint8_t)i;
+    EXPECT_EQ(1, ring_buffer_view_write(&r, &v, src.data(), src.size(), 1));
+    EXPECT_EQ(0, memcmp(src.data() + 100, buf, 200));
+
+    // The wrapped range is readable in place as one span.
+    struct ring_buffer_spans spans;
+    EXPECT_EQ(300u, ring_buffer_view_peek_read(&r, &v, nullptr, 300, &spans));
+    EXPECT_EQ(buf + kSize - 100, spans.first);
+    EXPECT_EQ(300u, spans.first_len);
+    EXPECT_EQ(nullptr, spans.second);
+    EXPECT_EQ(0, memcmp(src.data(), spans.first, 300));
+
+    std::vector<uint8_t> copied(300);
+    EXPECT_EQ(0, ring_buffer_copy_contents(&r, &v, 300, copied.data()));
+    EXPECT_EQ(src, copied);
+
+    std::vector<uint8_t> dst(300);
+    EXPECT_EQ(1, ring_buffer_view_read(&r, &v, dst.data(), dst.size(), 1));
+    EXPECT_EQ(src, dst);
+
+    ring_buffer_double_unmap(buf, kSize);
+    close(fd);
+
+    errno = 0;
+    EXPECT_EQ(nullptr, ring_buffer_double_map_create(kSize + 1, nullptr));
+    EXPECT_EQ(EINVAL, errno);
+}
+
+#endif // __linux__
+
+#ifdef __linux__
+
+static uint64_t clockNs(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// A consumer blocked in ring_buffer_read_fully on a slow producer should
+// sleep rather than burn its CPU for the whole wait.
+TEST(ASG, RingBufferBlockingReadSleeps) {
+    static constexpr uint32_t kMessages = 10;
+
+    struct ring_buffer r;
+    ring_buffer_init(&r);
+
+    uint64_t consumerCpuNs = 0;
+    uint64_t consumerWallNs = 0;
+    uint32_t sum = 0;
+
+    std::thread consumer([&r, &consumerCpuNs, &consumerWallNs, &sum]() {
+        uint64_t wallStart = clockNs(CLOCK_MONOTONIC);
+        uint64_t cpuStart = clockNs(CLOCK_THREAD_CPUTIME_ID);
+        for (uint32_t i = 0; i < kMessages; ++i) {
+            uint32_t val;
+            ring_buffer_read_fully(&r, nullptr, &val, sizeof(val));
+            sum += val;
+        }
+        consumerCpuNs = clockNs(CLOCK_THREAD_CPUTIME_ID) - cpuStart;
+        consumerWallNs = clockNs(CLOCK_MONOTONIC) - wallStart;
+    });
+
+    for (uint32_t i = 0; i < kMessages; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        ring_buffer_write_fully(&r, nullptr, &i, sizeof(i));
+    }
+
+    consumer.join();
+
+    EXPECT_EQ(kMessages * (kMessages - 1) / 2, sum);
+    EXPECT_GE(consumerWallNs, 150000000ULL);
+    EXPECT_LT(consumerCpuNs * 4, consumerWallNs);
+}
+
+// Waits go through a shared (non-private) futex, so a ring in MAP_SHARED
+// memory can be waited on from another process.
+TEST(ASG, RingBufferBlockingAcrossProcesses) {
+    static constexpr uint32_t kMessages = 1000;
+
+    void* mem = mmap(nullptr, sizeof(struct ring_buffer),
+                     PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    ASSERT_NE(MAP_FAILED, mem);
+
+    struct ring_buffer* r = (struct ring_buffer*)mem;
+    ring_buffer_init(r);
+
+    pid_t pid = fork();
+    ASSERT_GE(pid, 0);
+
+    if (pid == 0) {
+        uint32_t sum = 0;
+        for (uint32_t i = 0; i < kMessages; ++i) {
+            uint32_t val;
+            ring_buffer_read_fully(r, nullptr, &val, sizeof(val));
+            sum += val;
+        }
+        ring_buffer_write_fully(r, nullptr, &sum, sizeof(sum));
+        _exit(0);
+    }
+
+    // Child replies on the same ring, so send everything first, then wait
+    // for the child to have drained it before reading back the reply.
+    for (uint32_t i = 0; i < kMessages; ++i) {
+        if (i % 100 == 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        }
+        ring_buffer_write_fully(r, nullptr, &i, sizeof(i));
+    }
+
+    int status = 0;
+    ASSERT_EQ(pid, waitpid(pid, &status, 0));
+    EXPECT_TRUE(WIFEXITED(status));
+
+    uint32_t sum = 0;
+    ring_buffer_read_fully(r, nullptr, &sum, sizeof(sum));
+    EXPECT_EQ(kMessages * (kMessages - 1) / 2, sum);
+
+    munmap(mem, sizeof(struct ring_buffer));
+}
+
+TEST(ASG, SharedRegionCreateAndAttach) {
+    static constexpr size_t kRingXferSize = 65536;
+
+    asg::SharedRegion::Backing backings[] = {
+        asg::SharedRegion::Backing::Memfd,
+        asg::SharedRegion::Backing::Shm,
+    };
+
+    for (size_t i = 0; i < 2; ++i) {
+        asg::SharedRegion::Options options;
+        options.backing = backings[i];
+        options.populate = true;
+        options.lock = true;
+
+        auto region = asg::SharedRegion::create(kRingXferSize, options);
+        ASSERT_NE(nullptr, region) << strerror(errno);
+        EXPECT_EQ((size_t)sysconf(_SC_PAGESIZE), region->pageSize());
+        EXPECT_LE(sizeof(struct asg_ring_storage) + kRingXferSize, region->mappedSize());
+        EXPECT_EQ(0u, region->mappedSize() % region->pageSize());
+        EXPECT_EQ(region->data() + sizeof(struct asg_ring_storage), region->xferBuffer());
+        EXPECT_EQ(0, region->data()[0]);
+        EXPECT_EQ(0, region->xferBuffer()[kRingXferSize - 1]);
+
+        // A second mapping of the same fd sees the same memory.
+        auto attached = asg::SharedRegion::attach(
+            dup(region->fd()), kRingXferSize, asg::SharedRegion::Options());
+        ASSERT_NE(nullptr, attached);
+        region->xferBuffer()[123] = 0x5a;
+        EXPECT_EQ(0x5a, attached->xferBuffer()[123]);
+
+        // Not enough room for the xfer buffer asked for.
+        errno = 0;
+        EXPECT_EQ(nullptr, asg::SharedRegion::attach(
+            dup(region->fd()), region->mappedSize(), asg::SharedRegion::Options()));
+        EXPECT_EQ(EINVAL, errno);
+    }
+
+    // Huge pages fall back to base pages unless required.
+    asg::SharedRegion::Options huge;
+    huge.hugePageSize = 2 * 1024 * 1024;
+    auto region = asg::SharedRegion::create(kRingXferSize, huge);
+    ASSERT_NE(nullptr, region);
+    EXPECT_EQ(0u, region->mappedSize() % region->pageSize());
+
+    huge.hugePagesRequired = true;
+    region = asg::SharedRegion::create(kRingXferSize, huge);
+    if (region) {
+        EXPECT_EQ(huge.hugePageSize, region->pageSize());
+        EXPECT_EQ(0u, (uintptr_t)region->data() % huge.hugePageSize);
+    }
+
+    huge.hugePageSize = 3 * 1024 * 1024;
+    errno = 0;
+    EXPECT_EQ(nullptr, asg::SharedRegion::create(kRingXferSize, huge));
+    EXPECT_EQ(EINVAL, errno);
+}
+
+// The host creates a region and passes it to a guest process over a unix
+// socket; the guest then talks to the host through RingStreams over it.
+TEST(ASG, SharedRegionAcrossProcesses) {
+    static constexpr size_t kRingXferSize = 16384;
+    static constexpr size_t kRingStepSize = 4096;
+    static constexpr size_t kSendSize = 100000;
+
+    asg::SharedRegion::Options options;
+    options.populate = true;
+    auto region = asg::SharedRegion::create(kRingXferSize, options);
+    ASSERT_NE(nullptr, region);
+
+    struct asg_context context = asg_context_create(
+        (char*)region->data(), (char*)region->xferBuffer(), kRingXferSize);
+    context.ring_config->buffer_size = kRingXferSize;
+    context.ring_config->flush_interval = kRingStepSize;
+    context.ring_config->host_consumed_pos = 0;
+    context.ring_config->transfer_mode = 1;
+    context.ring_config->in_error = 0;
+
+    asg::server::RingStream serverStream(
+        region->data(), kRingXferSize, []() { return 0; });
+
+    int sockets[2];
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sockets));
+
+    pid_t pid = fork();
+    ASSERT_GE(pid, 0);
+
+    if (pid == 0) {
+        close(sockets[0]);
+        auto guestRegion = asg::SharedRegion::receiveFrom(
+            sockets[1], asg::SharedRegion::Options());
+        if (!guestRegion || guestRegion->ringXferBufferSize() != kRingXferSize) {
+            _exit(1);
+        }
+
+        asg::client::RingStream clientStream(
+            guestRegion->data(), kRingXferSize, []() {});
+        std::vector<uint8_t> data(kSendSize);
+        for (size_t i = 0; i < kSendSize; ++i) data[i] = (uint8_t)(i * 13);
+        if (clientStream.writeFully(data.data(), data.size())) _exit(2);
+
+        uint8_t ack;
+        if (!clientStream.readFully(&ack, 1) || ack != 0x42) _exit(3);
+        _exit(0);
+    }
+
+    close(sockets[1]);
+    ASSERT_EQ(0, region->sendTo(sockets[0]));
+    close(sockets[0]);
+
+    std::vector<uint8_t> got(kSendSize);
+    size_t read = 0;
+    while (read < got.size()) {
+        read += serverStream.read(got.data() + read, got.size() - read);
+    }
+    for (size_t i = 0; i < kSendSize; ++i) {
+        ASSERT_EQ((uint8_t)(i * 13), got[i]) << i;
+    }
+
+    uint8_t ack = 0x42;
+    EXPECT_EQ(0, serverStream.writeFully(&ack, 1));
+
+    int status = 0;
+    ASSERT_EQ(pid, waitpid(pid, &status, 0));
+    EXPECT_TRUE(WIFEXITED(status));
+    EXPECT_EQ(0, WEXITSTATUS(status));
+}
+
+static const asg::Doorbell::Kind kDoorbellKinds[] = {
+    asg::Doorbell::Kind::Eventfd,
+    asg::Doorbell::Kind::Futex,
+    asg::Doorbell::Kind::Pipe,
+    asg::Doorbell::Kind::UnixSocket,
+};
+
+// Every kind coalesces rings, stops on shutdown, and wakes a waiter in
+// another process.
+TEST(ASG, DoorbellKinds) {
+    static constexpr uint32_t kPings = 200;
+
+    uint32_t* futexWords = (uint32_t*)mmap(
+        nullptr, 4096, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    ASSERT_NE(MAP_FAILED, (void*)futexWords);
+
+    for (size_t i = 0; i < 4; ++i) {
+        asg::Doorbell::Kind kind = kDoorbellKinds[i];
+        auto ping = asg::Doorbell::create(kind, &futexWords[0]);
+        auto pong = asg::Doorbell::create(kind, &futexWords[16]);
+        ASSERT_NE(nullptr, ping);
+        ASSERT_NE(nullptr, pong);
+        EXPECT_EQ(kind, ping->kind());
+
+        ping->ring();
+        ping->ring();
+        ping->ring();
+        EXPECT_EQ(0, ping->wait());
+
+        pid_t pid = fork();
+        ASSERT_GE(pid, 0);
+        if (pid == 0) {
+            for (uint32_t j = 0; j < kPings; ++j) {
+                if (ping->wait()) _exit(1);
+                pong->ring();
+            }
+            _exit(0);
+        }
+
+        for (uint32_t j = 0; j < kPings; ++j) {
+            ping->ring();
+            EXPECT_EQ(0, pong->wait());
+        }
+
+        int status = 0;
+        ASSERT_EQ(pid, waitpid(pid, &status, 0));
+        EXPECT_TRUE(WIFEXITED(status));
+        EXPECT_EQ(0, WEXITSTATUS(status));
+
+        FunctorThread waiter([&ping]() {
+            EXPECT_EQ(-1, ping->wait());
+        });
+        waiter.start();
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        ping->shutdown();
+        waiter.wait();
+        EXPECT_EQ(-1, ping->wait());
+    }
+
+    errno = 0;
+    EXPECT_EQ(nullptr, asg::Doorbell::create(asg::Doorbell::Kind::Futex));
+    EXPECT_EQ(EINVAL, errno);
+
+    munmap(futexWords, 4096);
+}
+
+// The RingStreams wired to each kind of doorbell instead of a MessageChannel.
+TEST(ASG, DoorbellRingStreams) {
+    static constexpr size_t kRingXferSize = 16384;
+    static constexpr size_t kRingStepSize = 4096;
+    static constexpr size_t kRoundTrips = 256;
+    static constexpr size_t kSendSizeBytes = 384;
+
+    for (size_t i = 0; i < 4; ++i) {
+        std::vector<uint8_t> sharedBuf(sizeof(struct asg_ring_storage) + kRingXferSize, 0);
+        uint8_t* sharedBufPtr = sharedBuf.data();
+
+        struct asg_context context =
+            asg_context_create((char*)sharedBufPtr, (char*)sharedBufPtr + sizeof(struct asg_ring_storage), kRingXferSize);
+
+        context.ring_config->buffer_size = kRingXferSize;
+        context.ring_config->flush_interval = kRingStepSize;
+        context.ring_config->host_consumed_pos = 0;
+        context.ring_config->transfer_mode = 1;
+        context.ring_config->in_error = 0;
+
+        // One doorbell each way: requests to the server and replies back.
+        uint32_t futexWords[2] = {};
+        auto doorbell = asg::Doorbell::create(kDoorbellKinds[i], &futexWords[0]);
+        auto replyDoorbell = asg::Doorbell::create(kDoorbellKinds[i], &futexWords[1]);
+        ASSERT_NE(nullptr, doorbell);
+        ASSERT_NE(nullptr, replyDoorbell);
+
+        asg::client::RingStream clientStream(
+            sharedBufPtr, kRingXferSize, doorbell->doorbellFunc());
+        asg::server::RingStream serverStream(
+            sharedBufPtr, kRingXferSize, doorbell->unavailableReadFunc());
+        clientStream.setReplyWaitFunc(replyDoorbell->unavailableReadFunc());
+        serverStream.setGuestNotifyFunc(replyDoorbell->doorbellFunc());
+
+        FunctorThread clientThread([&clientStream]() {
+            std::vector<uint8_t> readBuf(kSendSizeBytes);
+            for (uint32_t j = 0; j < kRoundTrips; ++j) {
+                auto buf = clientStream.alloc(kSendSizeBytes);
+                memset(buf, (int)j, kSendSizeBytes);
+                clientStream.readback(readBuf.data(), kSendSizeBytes);
+                EXPECT_EQ((uint8_t)j, readBuf[kSendSizeBytes - 1]);
+            }
+        });
+
+        FunctorThread serverThread([&serverStream]() {
+            std::vector<uint8_t> readBuf(kSendSizeBytes);
+            for (uint32_t j = 0; j < kRoundTrips; ++j) {
+                size_t read = 0;
+                while (read < kSendSizeBytes) {
+                    read += serverStream.read(readBuf.data() + read, kSendSizeBytes - read);
+                }
+                serverStream.writeFully(readBuf.data(), kSendSizeBytes);
+            }
+        });
+
+        serverThread.start();
+        clientThread.start();
+        clientThread.wait();
+        serverThread.wait();
+    }
+}
+
+#endif // __linux__